@@ -0,0 +1,163 @@
+/*
+ * gptsync/bootdb.h
+ * On-disk format of the boot code fingerprint database
+ *
+ * Copyright (c) 2006 Christoph Pfisterer
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are
+ * met:
+ *
+ *  * Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ *
+ *  * Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the
+ *    distribution.
+ *
+ *  * Neither the name of Christoph Pfisterer nor the names of the
+ *    contributors may be used to endorse or promote products derived
+ *    from this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+ * A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT
+ * OWNER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+ * SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT
+ * LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+ * DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+ * THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+ * OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#ifndef __BOOTDB_H__
+#define __BOOTDB_H__
+
+//
+// A boot code database is built by mkbootdb from a directory of known boot
+// sectors and mapped read-only by showpart. It identifies a loader and its
+// version from the hash of the code part of a boot sector alone. All
+// fields are little-endian. The file is laid out as
+//
+//   BOOTDB_HEADER
+//   BOOTDB_ENTRY   entries[entry_count]
+//   UINT32         index[index_size]     entry number + 1, 0 = empty slot
+//   CHAR8          names[names_size]     NUL-terminated UTF-8 strings
+//
+// The index is an open-addressing hash table over the code hashes, probed
+// linearly from hash & (index_size - 1). It is at most half full.
+//
+
+#define BOOTDB_MAGIC        "GPTBOOTD"
+#define BOOTDB_VERSION      (1)
+
+typedef struct {
+    UINT8   magic[8];
+    UINT32  version;
+    UINT32  entry_count;
+    UINT32  index_size;         // a power of two
+    UINT32  names_size;
+} BOOTDB_HEADER;
+
+typedef struct {
+    UINT64  hash;               // bootdb_hash() of the code region
+    UINT32  name_offset;        // loader name, into the name table
+    UINT32  version_offset;     // loader version, into the name table
+} BOOTDB_ENTRY;
+
+// Finds the code in a boot sector: an MBR up to the disk signature, a
+// volume boot record from the end of its BIOS parameter block (which
+// differs between volumes) up to the 55AA signature.
+static void bootdb_code_region(UINT8 *sector, BOOLEAN is_mbr, UINTN *start, UINTN *end)
+{
+    *start = 0;
+    *end   = 510;
+    if (is_mbr)
+        *end = 440;
+    else if (CompareMem(sector + 3, "NTFS    ", 8) == 0)
+        *start = 84;
+    else if (CompareMem(sector + 3, "EXFAT   ", 8) == 0)
+        *start = 120;
+    else if (CompareMem(sector + 82, "FAT32   ", 8) == 0)
+        *start = 90;
+    else if (sector[0] == 0xeb && (sector[38] == 0x28 || sector[38] == 0x29))
+        *start = 62;
+}
+
+// XXH64 with seed 0, also used by mkbootdb
+#define BOOTDB_PRIME1       (0x9E3779B185EBCA87ULL)
+#define BOOTDB_PRIME2       (0xC2B2AE3D27D4EB4FULL)
+#define BOOTDB_PRIME3       (0x165667B19E3779F9ULL)
+#define BOOTDB_PRIME4       (0x85EBCA77C2B2AE63ULL)
+#define BOOTDB_PRIME5       (0x27D4EB2F165667C5ULL)
+#define BOOTDB_ROTL(x, r)   (((x) << (r)) | ((x) >> (64 - (r))))
+
+static UINT64 bootdb_round(UINT64 acc, UINT64 input)
+{
+    acc += input * BOOTDB_PRIME2;
+    acc  = BOOTDB_ROTL(acc, 31);
+    return acc * BOOTDB_PRIME1;
+}
+
+static UINT64 bootdb_merge(UINT64 hash, UINT64 acc)
+{
+    hash ^= bootdb_round(0, acc);
+    return hash * BOOTDB_PRIME1 + BOOTDB_PRIME4;
+}
+
+static UINT64 bootdb_hash(UINT8 *data, UINTN length)
+{
+    UINT8   *end = data + length;
+    UINT64  v[4], hash, word;
+    UINT32  half;
+    UINTN   i;
+    
+    if (length >= 32) {
+        v[0] = BOOTDB_PRIME1 + BOOTDB_PRIME2;
+        v[1] = BOOTDB_PRIME2;
+        v[2] = 0;
+        v[3] = 0 - BOOTDB_PRIME1;
+        for (; data + 32 <= end; data += 32) {
+            for (i = 0; i < 4; i++) {
+                CopyMem(&word, data + i * 8, 8);
+                v[i] = bootdb_round(v[i], word);
+            }
+        }
+        hash = BOOTDB_ROTL(v[0], 1) + BOOTDB_ROTL(v[1], 7) + BOOTDB_ROTL(v[2], 12) + BOOTDB_ROTL(v[3], 18);
+        for (i = 0; i < 4; i++)
+            hash = bootdb_merge(hash, v[i]);
+    } else
+        hash = BOOTDB_PRIME5;
+    hash += length;
+    
+    for (; data + 8 <= end; data += 8) {
+        CopyMem(&word, data, 8);
+        hash ^= bootdb_round(0, word);
+        hash  = BOOTDB_ROTL(hash, 27) * BOOTDB_PRIME1 + BOOTDB_PRIME4;
+    }
+    if (data + 4 <= end) {
+        CopyMem(&half, data, 4);
+        hash ^= half * BOOTDB_PRIME1;
+        hash  = BOOTDB_ROTL(hash, 23) * BOOTDB_PRIME2 + BOOTDB_PRIME3;
+        data += 4;
+    }
+    for (; data < end; data++) {
+        hash ^= *data * BOOTDB_PRIME5;
+        hash  = BOOTDB_ROTL(hash, 11) * BOOTDB_PRIME1;
+    }
+    
+    hash ^= hash >> 33;
+    hash *= BOOTDB_PRIME2;
+    hash ^= hash >> 29;
+    hash *= BOOTDB_PRIME3;
+    hash ^= hash >> 32;
+    return hash;
+}
+
+#endif
+
+/* EOF */
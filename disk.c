@@ -0,0 +1,474 @@
+/*
+ * gptsync/disk.c
+ * Block device backend dispatch and the in-memory backend
+ *
+ * Copyright (c) 2006-2007 Christoph Pfisterer
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are
+ * met:
+ *
+ *  * Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ *
+ *  * Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the
+ *    distribution.
+ *
+ *  * Neither the name of Christoph Pfisterer nor the names of the
+ *    contributors may be used to endorse or promote products derived
+ *    from this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+ * A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT
+ * OWNER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+ * SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT
+ * LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+ * DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+ * THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+ * OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include "gptsync.h"
+
+//
+// backend dispatch
+//
+
+UINTN disk_read(DISK_DEVICE *disk, UINT64 lba, UINTN count, UINT8 *buffer)
+{
+    return disk->ops->read(disk, lba, count, buffer);
+}
+
+UINTN disk_write(DISK_DEVICE *disk, UINT64 lba, UINTN count, UINT8 *buffer)
+{
+    if (disk->read_only || disk->ops->write == NULL) {
+        error("Device is read-only");
+        return 1;
+    }
+    return disk->ops->write(disk, lba, count, buffer);
+}
+
+UINTN disk_read_batch(DISK_DEVICE *disk, IO_REQUEST *requests, UINTN count)
+{
+    UINTN   i, status;
+    
+    if (disk->ops->read_batch != NULL)
+        return disk->ops->read_batch(disk, requests, count);
+    
+    // no batch support in the backend, issue the requests in order
+    for (i = 0; i < count; i++) {
+        status = disk->ops->read(disk, requests[i].lba, requests[i].count, requests[i].buffer);
+        if (status != 0)
+            return status;
+    }
+    return 0;
+}
+
+UINTN disk_flush(DISK_DEVICE *disk)
+{
+    if (disk->ops->flush == NULL)
+        return 0;
+    return disk->ops->flush(disk);
+}
+
+// Finds the first run of sectors [*data_lba, *data_end) in [lba, end_lba)
+// that may hold data; everything in front of it reads as zeros. *data_lba
+// is end_lba if nothing in the range is allocated. Backends that can't
+// tell report the whole range.
+UINTN disk_find_data(DISK_DEVICE *disk, UINT64 lba, UINT64 end_lba, UINT64 *data_lba, UINT64 *data_end)
+{
+    if (lba >= end_lba) {
+        *data_lba = end_lba;
+        *data_end = end_lba;
+        return 0;
+    }
+    if (disk->ops->find_data == NULL) {
+        *data_lba = lba;
+        *data_end = end_lba;
+        return 0;
+    }
+    return disk->ops->find_data(disk, lba, end_lba, data_lba, data_end);
+}
+
+VOID disk_close(DISK_DEVICE *disk)
+{
+    if (disk->ops->close != NULL)
+        disk->ops->close(disk);
+}
+
+//
+// in-memory backend
+//
+
+typedef struct {
+    DISK_DEVICE disk;
+    UINT8       *image;
+    UINT64      size;
+} MEMORY_DISK;
+
+static BOOLEAN memory_range_ok(MEMORY_DISK *mem, UINT64 lba, UINTN count)
+{
+    UINT64 offset = lba * mem->disk.sector_size;
+    UINT64 length = (UINT64)count * mem->disk.sector_size;
+    
+    if (offset > mem->size || length > mem->size - offset) {
+        error("Data access beyond end of image at position %llu", offset);
+        return FALSE;
+    }
+    return TRUE;
+}
+
+static UINTN memory_read(DISK_DEVICE *disk, UINT64 lba, UINTN count, UINT8 *buffer)
+{
+    MEMORY_DISK *mem = disk->data;
+    
+    if (!memory_range_ok(mem, lba, count))
+        return 1;
+    CopyMem(buffer, mem->image + lba * disk->sector_size, count * disk->sector_size);
+    return 0;
+}
+
+static UINTN memory_write(DISK_DEVICE *disk, UINT64 lba, UINTN count, UINT8 *buffer)
+{
+    MEMORY_DISK *mem = disk->data;
+    
+    if (!memory_range_ok(mem, lba, count))
+        return 1;
+    CopyMem(mem->image + lba * disk->sector_size, buffer, count * disk->sector_size);
+    return 0;
+}
+
+static VOID memory_close(DISK_DEVICE *disk)
+{
+    FreePool(disk->data);
+}
+
+static DISK_OPS memory_ops = {
+    STR("memory"),
+    memory_read,
+    memory_write,
+    NULL,
+    NULL,
+    NULL,
+    memory_close,
+};
+
+DISK_DEVICE * disk_open_memory(UINT8 *image, UINT64 size, UINTN block_size, BOOLEAN writable)
+{
+    MEMORY_DISK *mem;
+    
+    mem = AllocatePool(sizeof(MEMORY_DISK));
+    if (mem == NULL)
+        return NULL;
+    ZeroMem(mem, sizeof(MEMORY_DISK));
+    mem->image                     = image;
+    mem->size                      = size;
+    mem->disk.ops                  = &memory_ops;
+    mem->disk.data                 = mem;
+    mem->disk.sector_size          = block_size;
+    mem->disk.block_count          = size / block_size;
+    mem->disk.physical_sector_size = block_size;
+    mem->disk.rotational           = FALSE;
+    mem->disk.read_only            = !writable;
+    mem->disk.thread_safe          = TRUE;
+    return &mem->disk;
+}
+
+
+//
+// sector cache, stacked on top of another backend
+//
+
+#define CACHE_NONE ((UINTN)-1)
+
+typedef struct {
+    UINT64      lba;
+    UINTN       hash_next;              // next slot in the same hash bucket
+    UINTN       lru_prev, lru_next;     // towards most / least recently used
+} CACHE_SLOT;
+
+typedef struct {
+    DISK_DEVICE disk;
+    DISK_DEVICE *lower;
+    
+    UINTN       capacity;               // in sectors
+    UINTN       used;
+    CACHE_SLOT  *slots;
+    UINT8       *data;                  // capacity sectors, slot i at i * sector_size
+    UINTN       *buckets;
+    UINTN       bucket_mask;
+    UINTN       lru_head, lru_tail;     // most and least recently used slot
+    
+    UINT64      hits, misses;
+} CACHE_DISK;
+
+static UINTN cache_bucket(CACHE_DISK *cache, UINT64 lba)
+{
+    return (UINTN)((lba * 0x9E3779B97F4A7C15ULL) >> 32) & cache->bucket_mask;
+}
+
+static VOID cache_lru_unlink(CACHE_DISK *cache, UINTN slot)
+{
+    CACHE_SLOT *s = &cache->slots[slot];
+    
+    if (s->lru_prev != CACHE_NONE)
+        cache->slots[s->lru_prev].lru_next = s->lru_next;
+    else
+        cache->lru_head = s->lru_next;
+    if (s->lru_next != CACHE_NONE)
+        cache->slots[s->lru_next].lru_prev = s->lru_prev;
+    else
+        cache->lru_tail = s->lru_prev;
+}
+
+static VOID cache_lru_push(CACHE_DISK *cache, UINTN slot)
+{
+    CACHE_SLOT *s = &cache->slots[slot];
+    
+    s->lru_prev = CACHE_NONE;
+    s->lru_next = cache->lru_head;
+    if (cache->lru_head != CACHE_NONE)
+        cache->slots[cache->lru_head].lru_prev = slot;
+    else
+        cache->lru_tail = slot;
+    cache->lru_head = slot;
+}
+
+static UINT8 * cache_slot_data(CACHE_DISK *cache, UINTN slot)
+{
+    return cache->data + slot * cache->disk.sector_size;
+}
+
+// returns the cached copy of a sector and marks it most recently used
+static UINT8 * cache_lookup(CACHE_DISK *cache, UINT64 lba)
+{
+    UINTN slot;
+    
+    for (slot = cache->buckets[cache_bucket(cache, lba)]; slot != CACHE_NONE;
+         slot = cache->slots[slot].hash_next) {
+        if (cache->slots[slot].lba == lba) {
+            cache_lru_unlink(cache, slot);
+            cache_lru_push(cache, slot);
+            return cache_slot_data(cache, slot);
+        }
+    }
+    return NULL;
+}
+
+// stores a copy of a sector, evicting the least recently used one if full
+static VOID cache_insert(CACHE_DISK *cache, UINT64 lba, UINT8 *buffer)
+{
+    UINT8   *data;
+    UINTN   slot, *link;
+    
+    data = cache_lookup(cache, lba);
+    if (data == NULL) {
+        if (cache->used < cache->capacity) {
+            slot = cache->used++;
+        } else {
+            slot = cache->lru_tail;
+            cache_lru_unlink(cache, slot);
+            for (link = &cache->buckets[cache_bucket(cache, cache->slots[slot].lba)];
+                 *link != slot; link = &cache->slots[*link].hash_next)
+                ;
+            *link = cache->slots[slot].hash_next;
+        }
+        cache->slots[slot].lba = lba;
+        cache->slots[slot].hash_next = cache->buckets[cache_bucket(cache, lba)];
+        cache->buckets[cache_bucket(cache, lba)] = slot;
+        cache_lru_push(cache, slot);
+        data = cache_slot_data(cache, slot);
+    }
+    CopyMem(data, buffer, cache->disk.sector_size);
+}
+
+static UINTN cache_read(DISK_DEVICE *disk, UINT64 lba, UINTN count, UINT8 *buffer)
+{
+    CACHE_DISK  *cache = disk->data;
+    UINTN       sector_size = disk->sector_size;
+    UINTN       i, run, status;
+    UINT8       *data;
+    
+    i = 0;
+    while (i < count) {
+        data = cache_lookup(cache, lba + i);
+        if (data != NULL) {
+            CopyMem(buffer + i * sector_size, data, sector_size);
+            cache->hits++;
+            i++;
+            continue;
+        }
+        
+        // fetch the whole run of missing sectors with one request
+        for (run = 1; i + run < count; run++)
+            if (cache_lookup(cache, lba + i + run) != NULL)
+                break;
+        status = disk_read(cache->lower, lba + i, run, buffer + i * sector_size);
+        if (status != 0)
+            return status;
+        cache->misses += run;
+        for (; run > 0; run--, i++)
+            cache_insert(cache, lba + i, buffer + i * sector_size);
+    }
+    return 0;
+}
+
+static UINTN cache_write(DISK_DEVICE *disk, UINT64 lba, UINTN count, UINT8 *buffer)
+{
+    CACHE_DISK  *cache = disk->data;
+    UINTN       i, status;
+    
+    // write-through, keeping the cached copies current
+    status = disk_write(cache->lower, lba, count, buffer);
+    if (status != 0)
+        return status;
+    for (i = 0; i < count; i++)
+        cache_insert(cache, lba + i, buffer + i * disk->sector_size);
+    return 0;
+}
+
+static UINTN cache_read_batch(DISK_DEVICE *disk, IO_REQUEST *requests, UINTN count)
+{
+    CACHE_DISK  *cache = disk->data;
+    IO_REQUEST  *missing;
+    UINTN       sector_size = disk->sector_size;
+    UINTN       i, k, missing_count, status;
+    UINT8       *data;
+    
+    missing = AllocatePool(count * sizeof(IO_REQUEST));
+    if (missing == NULL) {
+        error("Out of memory");
+        return 1;
+    }
+    
+    // serve what we can from the cache, pass the rest down as one batch
+    missing_count = 0;
+    for (i = 0; i < count; i++) {
+        for (k = 0; k < requests[i].count; k++) {
+            data = cache_lookup(cache, requests[i].lba + k);
+            if (data == NULL)
+                break;
+            CopyMem(requests[i].buffer + k * sector_size, data, sector_size);
+        }
+        if (k == requests[i].count)
+            cache->hits += k;
+        else
+            missing[missing_count++] = requests[i];
+    }
+    
+    status = 0;
+    if (missing_count > 0) {
+        status = disk_read_batch(cache->lower, missing, missing_count);
+        if (status == 0) {
+            for (i = 0; i < missing_count; i++) {
+                cache->misses += missing[i].count;
+                for (k = 0; k < missing[i].count; k++)
+                    cache_insert(cache, missing[i].lba + k, missing[i].buffer + k * sector_size);
+            }
+        }
+    }
+    
+    FreePool(missing);
+    return status;
+}
+
+static UINTN cache_flush(DISK_DEVICE *disk)
+{
+    CACHE_DISK  *cache = disk->data;
+    
+    return disk_flush(cache->lower);
+}
+
+// the cache writes through, so the lower device knows what is allocated
+static UINTN cache_find_data(DISK_DEVICE *disk, UINT64 lba, UINT64 end_lba, UINT64 *data_lba, UINT64 *data_end)
+{
+    CACHE_DISK  *cache = disk->data;
+    
+    return disk_find_data(cache->lower, lba, end_lba, data_lba, data_end);
+}
+
+static VOID cache_close(DISK_DEVICE *disk)
+{
+    CACHE_DISK  *cache = disk->data;
+    
+    // the lower device belongs to the caller and stays open
+    free_io_buffer(cache->data);
+    FreePool(cache->slots);
+    FreePool(cache->buckets);
+    FreePool(cache);
+}
+
+static DISK_OPS cache_ops = {
+    STR("cache"),
+    cache_read,
+    cache_write,
+    cache_read_batch,
+    cache_flush,
+    cache_find_data,
+    cache_close,
+};
+
+DISK_DEVICE * disk_open_cache(DISK_DEVICE *lower, UINTN cache_size)
+{
+    CACHE_DISK  *cache;
+    UINTN       i, bucket_count;
+    
+    cache = AllocatePool(sizeof(CACHE_DISK));
+    if (cache == NULL) {
+        error("Out of memory");
+        return NULL;
+    }
+    ZeroMem(cache, sizeof(CACHE_DISK));
+    cache->disk             = *lower;
+    cache->disk.ops         = &cache_ops;
+    cache->disk.data        = cache;
+    cache->disk.thread_safe = FALSE;    // the LRU lists are not locked
+    cache->lower            = lower;
+    
+    cache->capacity = cache_size / lower->sector_size;
+    if (cache->capacity < 1)
+        cache->capacity = 1;
+    for (bucket_count = 1; bucket_count < cache->capacity; bucket_count <<= 1)
+        ;
+    cache->bucket_mask = bucket_count - 1;
+    cache->lru_head    = CACHE_NONE;
+    cache->lru_tail    = CACHE_NONE;
+    
+    cache->slots   = AllocatePool(cache->capacity * sizeof(CACHE_SLOT));
+    cache->buckets = AllocatePool(bucket_count * sizeof(UINTN));
+    cache->data    = alloc_io_buffer(cache->capacity * lower->sector_size);
+    if (cache->slots == NULL || cache->buckets == NULL || cache->data == NULL) {
+        error("Out of memory");
+        if (cache->data != NULL)
+            free_io_buffer(cache->data);
+        if (cache->slots != NULL)
+            FreePool(cache->slots);
+        if (cache->buckets != NULL)
+            FreePool(cache->buckets);
+        FreePool(cache);
+        return NULL;
+    }
+    for (i = 0; i < bucket_count; i++)
+        cache->buckets[i] = CACHE_NONE;
+    
+    return &cache->disk;
+}
+
+VOID disk_cache_stats(DISK_DEVICE *disk, UINT64 *hits, UINT64 *misses)
+{
+    CACHE_DISK  *cache;
+    
+    *hits   = 0;
+    *misses = 0;
+    if (disk->ops != &cache_ops)
+        return;
+    cache = disk->data;
+    *hits   = cache->hits;
+    *misses = cache->misses;
+}
@@ -102,16 +102,16 @@ int xtoi(const char* xs, UINT8* result)
 // MBR functions
 //
 
-static UINTN check_mbr(VOID)
+static UINTN check_mbr(SCAN_CONTEXT *ctx)
 {
     UINTN       i;
     
     // check each entry
-    for (i = 0; i < mbr_part_count; i++) {
+    for (i = 0; i < ctx->mbr_part_count; i++) {
         /*
 		// check for overlap
-        for (k = 0; k < mbr_part_count; k++) {
-            if (k != i && !(mbr_parts[i].start_lba > mbr_parts[k].end_lba || mbr_parts[k].start_lba > mbr_parts[i].end_lba)) {
+        for (k = 0; k < ctx->mbr_part_count; k++) {
+            if (k != i && !(ctx->mbr_parts[i].start_lba > ctx->mbr_parts[k].end_lba || ctx->mbr_parts[k].start_lba > ctx->mbr_parts[i].end_lba)) {
                 Print(L"Status: MBR partition table is invalid, partitions overlap.\n");
                 return 1;
             }
@@ -119,9 +119,9 @@ static UINTN check_mbr(VOID)
 		*/
         
         // check for extended partitions
-        if (mbr_parts[i].mbr_type == 0x05 || mbr_parts[i].mbr_type == 0x0f || mbr_parts[i].mbr_type == 0x85) {
+        if (ctx->mbr_parts[i].mbr_type == 0x05 || ctx->mbr_parts[i].mbr_type == 0x0f || ctx->mbr_parts[i].mbr_type == 0x85) {
             Print(L"Status: Extended partition found in MBR table, will not touch this disk.\n",
-                  gpt_parts[i].gpt_parttype->name);
+                  ctx->gpt_parts[i].gpt_parttype->name);
             return 1;
         }
     }
@@ -129,7 +129,7 @@ static UINTN check_mbr(VOID)
     return 0;
 }
 
-static UINTN write_mbr(VOID)
+static UINTN write_mbr(SCAN_CONTEXT *ctx)
 {
     UINTN               status;
     UINTN               i, k;
@@ -140,21 +140,21 @@ static UINTN write_mbr(VOID)
     Print(L"\nWriting new MBR...\n");
     
     // read MBR data
-    status = read_sector(0, sector);
+    status = disk_read(ctx->disk, 0, 1, ctx->sector);
     if (status != 0)
         return status;
     
     // write partition table
-    *((UINT16 *)(sector + 510)) = 0xaa55;
+    *((UINT16 *)(ctx->sector + 510)) = 0xaa55;
     
-    table = (MBR_PARTITION_INFO *)(sector + 446);
+    table = (MBR_PARTITION_INFO *)(ctx->sector + 446);
     active = 0x80;
     for (i = 0; i < 4; i++) {
-        for (k = 0; k < new_mbr_part_count; k++) {
-            if (new_mbr_parts[k].index == i)
+        for (k = 0; k < ctx->new_mbr_part_count; k++) {
+            if (ctx->new_mbr_parts[k].index == i)
                 break;
         }
-        if (k >= new_mbr_part_count) {
+        if (k >= ctx->new_mbr_part_count) {
             // unused entry
             table[i].flags        = 0;
             table[i].start_chs[0] = 0;
@@ -167,7 +167,7 @@ static UINTN write_mbr(VOID)
             table[i].start_lba    = 0;
             table[i].size         = 0;
         } else {
-            if (new_mbr_parts[k].active) {
+            if (ctx->new_mbr_parts[k].active) {
                 table[i].flags        = active;
                 active = 0x00;
             } else
@@ -175,19 +175,19 @@ static UINTN write_mbr(VOID)
             table[i].start_chs[0] = 0xfe;
             table[i].start_chs[1] = 0xff;
             table[i].start_chs[2] = 0xff;
-            table[i].type         = new_mbr_parts[k].mbr_type;
+            table[i].type         = ctx->new_mbr_parts[k].mbr_type;
             table[i].end_chs[0]   = 0xfe;
             table[i].end_chs[1]   = 0xff;
             table[i].end_chs[2]   = 0xff;
             
-            lba = new_mbr_parts[k].start_lba;
+            lba = ctx->new_mbr_parts[k].start_lba;
             if (lba > 0xffffffffULL) {
                 Print(L"Warning: Partition %d starts beyond 2 TiB limit\n", i+1);
                 lba = 0xffffffffULL;
             }
             table[i].start_lba    = (UINT32)lba;
             
-            lba = new_mbr_parts[k].end_lba + 1 - new_mbr_parts[k].start_lba;
+            lba = ctx->new_mbr_parts[k].end_lba + 1 - ctx->new_mbr_parts[k].start_lba;
             if (lba > 0xffffffffULL) {
                 Print(L"Warning: Partition %d extends beyond 2 TiB limit\n", i+1);
                 lba = 0xffffffffULL;
@@ -197,7 +197,10 @@ static UINTN write_mbr(VOID)
     }
     
     // write MBR data
-    status = write_sector(0, sector);
+    status = disk_write(ctx->disk, 0, 1, ctx->sector);
+    if (status != 0)
+        return status;
+    status = disk_flush(ctx->disk);
     if (status != 0)
         return status;
     
@@ -210,40 +213,41 @@ static UINTN write_mbr(VOID)
 // GPT functions
 //
 
-static UINTN check_gpt(VOID)
+static UINTN check_gpt(SCAN_CONTEXT *ctx)
 {
     UINTN       i, k;
     BOOLEAN     found_data_parts;
     
-    if (gpt_part_count == 0) {
+    if (ctx->gpt_part_count == 0) {
         Print(L"Status: No GPT partition table, no need to sync.\n");
         return 1;
     }
     
-    // check each entry
-    found_data_parts = FALSE;
-    for (i = 0; i < gpt_part_count; i++) {
-        // check sanity
-        if (gpt_parts[i].end_lba < gpt_parts[i].start_lba) {
+    // check sanity
+    for (i = 0; i < ctx->gpt_part_count; i++) {
+        if (ctx->gpt_end_lbas[i] < ctx->gpt_start_lbas[i]) {
             Print(L"Status: GPT partition table is invalid.\n");
             return 1;
         }
-        // check for overlap
-        for (k = 0; k < gpt_part_count; k++) {
-            if (k != i && !(gpt_parts[i].start_lba > gpt_parts[k].end_lba || gpt_parts[k].start_lba > gpt_parts[i].end_lba)) {
-                Print(L"Status: GPT partition table is invalid, partitions overlap.\n");
-                return 1;
-            }
-        }
-        
+    }
+    // check for overlap
+    if (gpt_find_overlap(ctx, &i, &k)) {
+        Print(L"Status: GPT partition table is invalid, partitions %d and %d overlap.\n",
+              ctx->gpt_parts[i].index + 1, ctx->gpt_parts[k].index + 1);
+        return 1;
+    }
+    
+    // check each entry
+    found_data_parts = FALSE;
+    for (i = 0; i < ctx->gpt_part_count; i++) {
         // check for partitions kind
-        if (gpt_parts[i].gpt_parttype->kind == GPT_KIND_FATAL) {
+        if (ctx->gpt_parts[i].gpt_parttype->kind == GPT_KIND_FATAL) {
             Print(L"Status: GPT partition of type '%s' found, will not touch this disk.\n",
-                  gpt_parts[i].gpt_parttype->name);
+                  ctx->gpt_parts[i].gpt_parttype->name);
             return 1;
         }
-        if (gpt_parts[i].gpt_parttype->kind == GPT_KIND_DATA ||
-            gpt_parts[i].gpt_parttype->kind == GPT_KIND_BASIC_DATA)
+        if (ctx->gpt_parts[i].gpt_parttype->kind == GPT_KIND_DATA ||
+            ctx->gpt_parts[i].gpt_parttype->kind == GPT_KIND_BASIC_DATA)
             found_data_parts = TRUE;
     }
     
@@ -255,28 +259,28 @@ static UINTN check_gpt(VOID)
     return 0;
 }
 
-static void add_gpt_partition_to_mbr(int mbr_part_index, int gpt_part_index, UINT8 force_type, BOOLEAN active) {
+static void add_gpt_partition_to_mbr(SCAN_CONTEXT *ctx, int mbr_part_index, int gpt_part_index, UINT8 force_type, BOOLEAN active) {
 	int k;
 	
-	new_mbr_parts[mbr_part_index].index     = mbr_part_index;
-	new_mbr_parts[mbr_part_index].start_lba = gpt_parts[gpt_part_index].start_lba;
-	new_mbr_parts[mbr_part_index].end_lba   = gpt_parts[gpt_part_index].end_lba;
-	new_mbr_parts[mbr_part_index].mbr_type  = force_type ? force_type : gpt_parts[gpt_part_index].mbr_type;
-	new_mbr_parts[mbr_part_index].active    = active;
+	ctx->new_mbr_parts[mbr_part_index].index     = mbr_part_index;
+	ctx->new_mbr_parts[mbr_part_index].start_lba = ctx->gpt_parts[gpt_part_index].start_lba;
+	ctx->new_mbr_parts[mbr_part_index].end_lba   = ctx->gpt_parts[gpt_part_index].end_lba;
+	ctx->new_mbr_parts[mbr_part_index].mbr_type  = force_type ? force_type : ctx->gpt_parts[gpt_part_index].mbr_type;
+	ctx->new_mbr_parts[mbr_part_index].active    = active;
 
 	// find matching partition in the old MBR table
-	for (k = 0; k < mbr_part_count; k++) {
-		if (mbr_parts[k].start_lba == gpt_parts[gpt_part_index].start_lba) {
+	for (k = 0; k < ctx->mbr_part_count; k++) {
+		if (ctx->mbr_parts[k].start_lba == ctx->gpt_parts[gpt_part_index].start_lba) {
 			// keep type if not detected
-			if (new_mbr_parts[mbr_part_index].mbr_type == 0)
-				new_mbr_parts[mbr_part_index].mbr_type = mbr_parts[k].mbr_type;
+			if (ctx->new_mbr_parts[mbr_part_index].mbr_type == 0)
+				ctx->new_mbr_parts[mbr_part_index].mbr_type = ctx->mbr_parts[k].mbr_type;
 			break;
 		}
 	}
 	
-	if (new_mbr_parts[mbr_part_index].mbr_type == 0)
+	if (ctx->new_mbr_parts[mbr_part_index].mbr_type == 0)
 		// final fallback: set to a (hopefully) unused type
-		new_mbr_parts[mbr_part_index].mbr_type = 0xc0;
+		ctx->new_mbr_parts[mbr_part_index].mbr_type = 0xc0;
 }
 
 //
@@ -286,7 +290,7 @@ static void add_gpt_partition_to_mbr(int mbr_part_index, int gpt_part_index, UIN
 #define ACTION_NOP         (0)
 #define ACTION_REWRITE     (1)
 
-static UINTN analyze(int optind, int argc, char **argv)
+static UINTN analyze(SCAN_CONTEXT *ctx, int optind, int argc, char **argv)
 {
     UINTN   action;
     UINTN   i, k, count_active, detected_parttype;
@@ -295,9 +299,9 @@ static UINTN analyze(int optind, int argc, char **argv)
     UINTN   status;
     BOOLEAN have_esp;
     
-    new_mbr_part_count = 0;
+    ctx->new_mbr_part_count = 0;
     
-	block_count = get_disk_size();
+	block_count = ctx->disk->block_count;
 	last_disk_lba = block_count - 1;
 	if (block_count == 0) {
 		error("can't retrieve disk size");
@@ -305,43 +309,45 @@ static UINTN analyze(int optind, int argc, char **argv)
 	}
 
     // determine correct MBR types for GPT partitions
-    if (gpt_part_count == 0) {
+    if (ctx->gpt_part_count == 0) {
         Print(L"Status: No GPT partitions defined, nothing to sync.\n");
         return 1;
     }
     have_esp = FALSE;
-    for (i = 0; i < gpt_part_count; i++) {
-        gpt_parts[i].mbr_type = gpt_parts[i].gpt_parttype->mbr_type;
-        if (gpt_parts[i].gpt_parttype->kind == GPT_KIND_BASIC_DATA) {
+    for (i = 0; i < ctx->gpt_part_count; i++) {
+        ctx->gpt_parts[i].mbr_type = ctx->gpt_parts[i].gpt_parttype->mbr_type;
+        if (ctx->gpt_parts[i].gpt_parttype->kind == GPT_KIND_BASIC_DATA) {
             // Basic Data: need to look at data in the partition
-            status = detect_mbrtype_fs(gpt_parts[i].start_lba, &detected_parttype, &fsname);
+            status = detect_mbrtype_fs(ctx, ctx->gpt_parts[i].start_lba, ctx->gpt_parts[i].end_lba,
+                                       &detected_parttype, &fsname);
             if (detected_parttype)
-                gpt_parts[i].mbr_type = detected_parttype;
+                ctx->gpt_parts[i].mbr_type = detected_parttype;
             else
-                gpt_parts[i].mbr_type = 0x0b;  // fallback: FAT32
-        } else if (gpt_parts[i].mbr_type == 0xef) {
+                ctx->gpt_parts[i].mbr_type = 0x0b;  // fallback: FAT32
+        } else if (ctx->gpt_parts[i].mbr_type == 0xef) {
             // EFI System Partition: GNU parted can put this on any partition,
             // need to detect file systems
-            status = detect_mbrtype_fs(gpt_parts[i].start_lba, &detected_parttype, &fsname);
+            status = detect_mbrtype_fs(ctx, ctx->gpt_parts[i].start_lba, ctx->gpt_parts[i].end_lba,
+                                       &detected_parttype, &fsname);
             if (!have_esp && (detected_parttype == 0x01 || detected_parttype == 0x0e || detected_parttype == 0x0c))
                 ;  // seems to be a legitimate ESP, don't change
             else if (detected_parttype)
-                gpt_parts[i].mbr_type = detected_parttype;
+                ctx->gpt_parts[i].mbr_type = detected_parttype;
             else if (have_esp)    // make sure there's no more than one ESP per disk
-                gpt_parts[i].mbr_type = 0x83;  // fallback: Linux
+                ctx->gpt_parts[i].mbr_type = 0x83;  // fallback: Linux
         }
         // NOTE: mbr_type may still be 0 if content detection fails for exotic GPT types or file systems
         
-        if (gpt_parts[i].mbr_type == 0xef)
+        if (ctx->gpt_parts[i].mbr_type == 0xef)
             have_esp = TRUE;
     }
     
     // generate the new table
     
-	new_mbr_part_count = 1;
+	ctx->new_mbr_part_count = 1;
 	count_active = 0;
 	
-	if (! create_empty_mbr) {
+	if (! ctx->create_empty_mbr) {
 		if (optind < argc) {
 			for (i = optind; i < argc; i++) {
 				char *separator, csep = 0;
@@ -357,8 +363,8 @@ static UINTN analyze(int optind, int argc, char **argv)
 				}
 			
 				int part = atoi(argv[i]);
-				if (part < 1 || part > gpt_part_count) {
-					error("invalid argument '%s', partition number must be between 1-%d !", argv[i], gpt_part_count);
+				if (part < 1 || part > ctx->gpt_part_count) {
+					error("invalid argument '%s', partition number must be between 1-%d !", argv[i], ctx->gpt_part_count);
 					return 1;
 				}
 				part--; // 0 base partition number
@@ -380,74 +386,74 @@ static UINTN analyze(int optind, int argc, char **argv)
 				}
 			
 				// Check that a partition has not already enter
-				for (k = 1; k < new_mbr_part_count; k++) {
-					if (new_mbr_parts[k].start_lba == gpt_parts[part].start_lba ||
-						new_mbr_parts[k].end_lba   == gpt_parts[part].end_lba ) {
+				for (k = 1; k < ctx->new_mbr_part_count; k++) {
+					if (ctx->new_mbr_parts[k].start_lba == ctx->gpt_parts[part].start_lba ||
+						ctx->new_mbr_parts[k].end_lba   == ctx->gpt_parts[part].end_lba ) {
 							error("you already add partition %d !",part+1);
 							return 1;
 					}
 				}
 			
-				add_gpt_partition_to_mbr(new_mbr_part_count, part, force_type, active);
-				new_mbr_part_count++;
+				add_gpt_partition_to_mbr(ctx, ctx->new_mbr_part_count, part, force_type, active);
+				ctx->new_mbr_part_count++;
 			}
 		}
 		else {
 			// add other GPT partitions until the table is full
 			// TODO: in the future, prioritize partitions by kind
-			if (gpt_parts[0].mbr_type == 0xef)
+			if (ctx->gpt_parts[0].mbr_type == 0xef)
 				i = 1;
 			else
 				i = 0;
 		
-			for (; i < gpt_part_count && new_mbr_part_count < 4; i++) {
-				add_gpt_partition_to_mbr(new_mbr_part_count, i, 0, FALSE);
+			for (; i < ctx->gpt_part_count && ctx->new_mbr_part_count < 4; i++) {
+				add_gpt_partition_to_mbr(ctx, ctx->new_mbr_part_count, i, 0, FALSE);
         
-				new_mbr_part_count++;
+				ctx->new_mbr_part_count++;
 			}
 		}
 	}
 	
 	// get the first and last used lba
-	if ( new_mbr_part_count == 1) { // Only one EFI Protective partition
+	if ( ctx->new_mbr_part_count == 1) { // Only one EFI Protective partition
 		min_start_lba = max_end_lba  = last_disk_lba + 1; // Take whole disk
 	}
 	else {
-		min_start_lba = new_mbr_parts[1].start_lba;
-		max_end_lba   = new_mbr_parts[1].end_lba;
-		for (k = 2; k < new_mbr_part_count; k++) {
-			if (max_end_lba < new_mbr_parts[k].end_lba)
-				max_end_lba = new_mbr_parts[k].end_lba;
-			if (min_start_lba > new_mbr_parts[k].start_lba)
-				min_start_lba = new_mbr_parts[k].start_lba;
+		min_start_lba = ctx->new_mbr_parts[1].start_lba;
+		max_end_lba   = ctx->new_mbr_parts[1].end_lba;
+		for (k = 2; k < ctx->new_mbr_part_count; k++) {
+			if (max_end_lba < ctx->new_mbr_parts[k].end_lba)
+				max_end_lba = ctx->new_mbr_parts[k].end_lba;
+			if (min_start_lba > ctx->new_mbr_parts[k].start_lba)
+				min_start_lba = ctx->new_mbr_parts[k].start_lba;
 		}
 	}
 	
 	// Reserved last part if not used
-	if (new_mbr_part_count < 4 && max_end_lba < last_disk_lba && fill_mbr) {
-		new_mbr_parts[new_mbr_part_count].index = new_mbr_part_count;
-		new_mbr_parts[new_mbr_part_count].start_lba = max_end_lba + 1;
-		new_mbr_parts[new_mbr_part_count].end_lba   = last_disk_lba;
-		new_mbr_parts[new_mbr_part_count].mbr_type  = 0xee; // another protective area
-		new_mbr_parts[new_mbr_part_count].active    = FALSE;
-		new_mbr_part_count ++;
+	if (ctx->new_mbr_part_count < 4 && max_end_lba < last_disk_lba && ctx->fill_mbr) {
+		ctx->new_mbr_parts[ctx->new_mbr_part_count].index = ctx->new_mbr_part_count;
+		ctx->new_mbr_parts[ctx->new_mbr_part_count].start_lba = max_end_lba + 1;
+		ctx->new_mbr_parts[ctx->new_mbr_part_count].end_lba   = last_disk_lba;
+		ctx->new_mbr_parts[ctx->new_mbr_part_count].mbr_type  = 0xee; // another protective area
+		ctx->new_mbr_parts[ctx->new_mbr_part_count].active    = FALSE;
+		ctx->new_mbr_part_count ++;
 	}
     
     // first entry: EFI Protective
-    new_mbr_parts[0].index     = 0;
-    new_mbr_parts[0].start_lba = 1;
-    new_mbr_parts[0].end_lba   = min_start_lba - 1;
-    new_mbr_parts[0].mbr_type  = 0xee;
+    ctx->new_mbr_parts[0].index     = 0;
+    ctx->new_mbr_parts[0].start_lba = 1;
+    ctx->new_mbr_parts[0].end_lba   = min_start_lba - 1;
+    ctx->new_mbr_parts[0].mbr_type  = 0xee;
         
 	action = ACTION_NOP;
 
 	// Check if we need to rewrite MBR
 	for (i = 0; i < 4; i ++) {
-		if (new_mbr_parts[i].index     != mbr_parts[i].index     ||
-			new_mbr_parts[i].start_lba != mbr_parts[i].start_lba ||
-			new_mbr_parts[i].end_lba   != mbr_parts[i].end_lba   ||
-			new_mbr_parts[i].mbr_type  != mbr_parts[i].mbr_type  ||
-			new_mbr_parts[i].active    != mbr_parts[i].active) {
+		if (ctx->new_mbr_parts[i].index     != ctx->mbr_parts[i].index     ||
+			ctx->new_mbr_parts[i].start_lba != ctx->mbr_parts[i].start_lba ||
+			ctx->new_mbr_parts[i].end_lba   != ctx->mbr_parts[i].end_lba   ||
+			ctx->new_mbr_parts[i].mbr_type  != ctx->mbr_parts[i].mbr_type  ||
+			ctx->new_mbr_parts[i].active    != ctx->mbr_parts[i].active) {
 			action = ACTION_REWRITE;
 			break;
 		}
@@ -464,14 +470,14 @@ static UINTN analyze(int optind, int argc, char **argv)
     // dump table
     Print(L"\nProposed new MBR partition table:\n");
     Print(L" # A    Start LBA      End LBA  Type\n");
-    for (i = 0; i < new_mbr_part_count; i++) {
+    for (i = 0; i < ctx->new_mbr_part_count; i++) {
         Print(L" %d %s %12lld %12lld  %02x  %s\n",
-              new_mbr_parts[i].index + 1,
-              new_mbr_parts[i].active ? STR("*") : STR(" "),
-              new_mbr_parts[i].start_lba,
-              new_mbr_parts[i].end_lba,
-              new_mbr_parts[i].mbr_type,
-              mbr_parttype_name(new_mbr_parts[i].mbr_type));
+              ctx->new_mbr_parts[i].index + 1,
+              ctx->new_mbr_parts[i].active ? STR("*") : STR(" "),
+              ctx->new_mbr_parts[i].start_lba,
+              ctx->new_mbr_parts[i].end_lba,
+              ctx->new_mbr_parts[i].mbr_type,
+              mbr_parttype_name(ctx->new_mbr_parts[i].mbr_type));
     }
     
     return 0;
@@ -481,37 +487,53 @@ static UINTN analyze(int optind, int argc, char **argv)
 // sync algorithm entry point
 //
 
-UINTN gptsync(int optind, int argc, char **argv)
+UINTN gptsync_init(VOID)
+{
+    lib_init();
+    return 0;
+}
+
+UINTN gptsync(SCAN_CONTEXT *ctx, int optind, int argc, char **argv)
 {
     UINTN   status = 0;
     UINTN   status_gpt, status_mbr;
     BOOLEAN proceed = FALSE;
     
     // get full information from disk
-    status_gpt = read_gpt();
-    status_mbr = read_mbr();
+    status_gpt = read_gpt(ctx);
+    status_mbr = read_mbr(ctx);
     if (status_gpt != 0 || status_mbr != 0)
         return (status_gpt || status_mbr);
     
+    // fetch everything the analysis will need in a few large reads
+    plan_reads(ctx, FALSE);
+    
     // cross-check current situation
     Print(L"\n");
-    status = check_gpt();   // check GPT for consistency
+    status = check_gpt(ctx);   // check GPT for consistency
     if (status != 0)
         return status;
-    status = check_mbr();   // check MBR for consistency
+    status = check_mbr(ctx);   // check MBR for consistency
     if (status != 0)
         return status;
-    status = analyze(optind, argc, argv);     // analyze the situation & compose new MBR table
+    status = analyze(ctx, optind, argc, argv);     // analyze the situation & compose new MBR table
     if (status != 0)
         return status;
 
+    // a read-only device (image container, pipe) can only be inspected;
+    // don't ask, standard input may be the disk itself
+    if (ctx->disk->read_only) {
+        Print(L"\nDevice is read-only, the MBR is left unchanged.\n");
+        return 0;
+    }
+    
     // offer user the choice what to do
     status = input_boolean(STR("\nMay I update the MBR as printed above? [y/N] "), &proceed);
     if (status != 0 || proceed != TRUE)
         return status;
     
     // adjust the MBR and write it back
-    status = write_mbr();
+    status = write_mbr(ctx);
     if (status != 0)
         return status;
     
@@ -100,13 +100,28 @@ void Print(wchar_t *format, ...);
 
 #define CopyMem     memcpy
 #define SetMem      memset
+#define ZeroMem(buffer, size) memset(buffer, 0, size)
 #define CompareMem  memcmp
+#define AllocatePool malloc
+#define FreePool    free
 
 #define copy_guid(destguid, srcguid) (memcpy(destguid, srcguid, 16))
 #define guids_are_equal(guid1, guid2) (memcmp(guid1, guid2, 16) == 0)
 
 #endif
 
+//
+// sector geometry
+//
+
+// logical sector sizes from 512 bytes (classic and 512e drives) up to
+// 4096 bytes (4Kn drives) are supported
+#define MIN_SECTOR_SIZE     (512)
+#define MAX_SECTOR_SIZE     (4096)
+
+// static I/O buffers are aligned for direct (uncached) device access
+#define IO_ALIGNED          __attribute__((aligned(MAX_SECTOR_SIZE)))
+
 //
 // platform-independent types
 //
@@ -163,6 +178,12 @@ typedef struct {
     UINTN   kind;
 } GPT_PARTTYPE;
 
+typedef struct {
+    UINT64  lba;
+    UINTN   count;
+    UINT8   *buffer;
+} IO_REQUEST;
+
 typedef struct {
     UINTN   index;
     UINT64  start_lba;
@@ -173,55 +194,222 @@ typedef struct {
     BOOLEAN active;
 } PARTITION_INFO;
 
+//
+// block device backends
+//
+
+typedef struct _DISK_DEVICE DISK_DEVICE;
+
+typedef struct {
+    CHARN   *name;
+    UINTN   (*read)(DISK_DEVICE *disk, UINT64 lba, UINTN count, UINT8 *buffer);
+    UINTN   (*write)(DISK_DEVICE *disk, UINT64 lba, UINTN count, UINT8 *buffer);
+    UINTN   (*read_batch)(DISK_DEVICE *disk, IO_REQUEST *requests, UINTN count);   // optional
+    UINTN   (*flush)(DISK_DEVICE *disk);                                            // optional
+    UINTN   (*find_data)(DISK_DEVICE *disk, UINT64 lba, UINT64 end_lba,
+                         UINT64 *data_lba, UINT64 *data_end);                      // optional
+    VOID    (*close)(DISK_DEVICE *disk);
+} DISK_OPS;
+
+struct _DISK_DEVICE {
+    DISK_OPS    *ops;
+    VOID        *data;                  // backend private state
+    
+    // geometry and topology
+    UINTN       sector_size;            // logical sector size in bytes
+    UINT64      block_count;            // size in logical sectors, 0 if unknown
+    UINTN       physical_sector_size;
+    UINTN       optimal_io_size;        // preferred request size in bytes, 0 if unknown
+    BOOLEAN     rotational;
+    BOOLEAN     sequential;             // can only be read front to back (pipes)
+    BOOLEAN     thread_safe;            // reads may run in several threads at once
+    BOOLEAN     read_only;
+};
+
+UINTN disk_read(DISK_DEVICE *disk, UINT64 lba, UINTN count, UINT8 *buffer);
+UINTN disk_write(DISK_DEVICE *disk, UINT64 lba, UINTN count, UINT8 *buffer);
+UINTN disk_read_batch(DISK_DEVICE *disk, IO_REQUEST *requests, UINTN count);
+UINTN disk_flush(DISK_DEVICE *disk);
+UINTN disk_find_data(DISK_DEVICE *disk, UINT64 lba, UINT64 end_lba, UINT64 *data_lba, UINT64 *data_end);
+VOID disk_close(DISK_DEVICE *disk);
+
+DISK_DEVICE * disk_open_memory(UINT8 *image, UINT64 size, UINTN block_size, BOOLEAN writable);
+UINTN disk_open_image(DISK_DEVICE *lower, UINTN sector_size, DISK_DEVICE **image);
+#ifndef CONFIG_EFI
+UINTN disk_open_compressed(char *filename, UINTN sector_size, DISK_DEVICE **image);
+#endif
+
+// scans read through an LRU cache of this many bytes
+#define SECTOR_CACHE_SIZE   (1024*1024)
+
+DISK_DEVICE * disk_open_cache(DISK_DEVICE *lower, UINTN cache_size);
+VOID disk_cache_stats(DISK_DEVICE *disk, UINT64 *hits, UINT64 *misses);
+
 //
 // functions provided by the OS-specific module
 //
 
 void error(const char *msg, ...);
 void errore(const char *msg, ...);
-UINT64 get_disk_size(VOID);
-UINTN read_sector(UINT64 lba, UINT8 *buffer);
-UINTN write_sector(UINT64 lba, UINT8 *buffer);
+VOID * alloc_io_buffer(UINTN size);
+VOID free_io_buffer(VOID *buffer);
 UINTN input_boolean(CHARN *prompt, BOOLEAN *bool_out);
+#ifndef CONFIG_EFI
+VOID * output_get_target(VOID);
+VOID output_set_target(VOID *target);
+#endif
 
 //
-// vars and functions provided by the common lib module
+// per-scan memory arena, released in one shot
 //
 
-extern UINT8           empty_guid[16];
+typedef struct _ARENA_BLOCK ARENA_BLOCK;
+
+typedef struct {
+    ARENA_BLOCK *blocks;
+} ARENA;
+
+VOID * arena_alloc(ARENA *arena, UINTN size, UINTN align);
+VOID arena_free_all(ARENA *arena);
+
+//
+// scan context: everything known about one disk
+//
 
-extern PARTITION_INFO  mbr_parts[4];
-extern UINTN           mbr_part_count;
-extern PARTITION_INFO  gpt_parts[128];
-extern UINTN           gpt_part_count;
+typedef struct {
+    DISK_DEVICE     *disk;              // the sector cache in front of raw_disk
+    DISK_DEVICE     *raw_disk;
+    ARENA           arena;              // the context itself lives in here
+    
+    PARTITION_INFO  mbr_parts[4];
+    UINTN           mbr_part_count;
+    PARTITION_INFO  *gpt_parts;         // used entries of the table, grown as needed
+    UINT64          *gpt_start_lbas;    // start and end LBAs of gpt_parts again,
+    UINT64          *gpt_end_lbas;      // contiguous for the overlap check
+    UINTN           gpt_part_count;
+    UINTN           gpt_part_capacity;
+    UINT64          gpt_backup_lba;     // from the primary header, 0 if no GPT
+    
+    PARTITION_INFO  new_mbr_parts[4];
+    UINTN           new_mbr_part_count;
+    
+    UINT8           *sector;            // scratch buffer of one sector
+    UINT8           *probe_buffer;      // scratch buffer for detect_mbrtype_fs()
+    
+    // options
+    BOOLEAN         fill_mbr;
+    BOOLEAN         create_empty_mbr;
+    BOOLEAN         check_contents;     // showpart: classify partition contents
+    UINTN           recover_threads;    // showpart: scan for lost partitions, 0 = don't
+    BOOLEAN         recover_progress;   // showpart: report the scan's progress on stderr
+} SCAN_CONTEXT;
+
+SCAN_CONTEXT * scan_create(DISK_DEVICE *disk);
+VOID scan_destroy(SCAN_CONTEXT *ctx);
+VOID lib_init(VOID);
 
-extern PARTITION_INFO  new_mbr_parts[4];
-extern UINTN           new_mbr_part_count;
+//
+// vars and functions provided by the common lib module
+//
 
-extern UINT8           sector[512];
+extern UINT8           empty_guid[16];
 
 extern MBR_PARTTYPE    mbr_types[];
 extern GPT_PARTTYPE    gpt_types[];
 extern GPT_PARTTYPE    gpt_dummy_type;
 
+UINT32 crc32_update(UINT32 crc, UINT8 *data, UINTN length);
+
 CHARN * mbr_parttype_name(UINT8 type);
-UINTN read_mbr(VOID);
+UINTN read_mbr(SCAN_CONTEXT *ctx);
 
 GPT_PARTTYPE * gpt_parttype(UINT8 *type_guid);
-UINTN read_gpt(VOID);
+#ifndef CONFIG_EFI
+UINTN gpt_load_type_db(UINT8 *data, UINTN size);
+#endif
+UINTN read_gpt(SCAN_CONTEXT *ctx);
+BOOLEAN gpt_find_overlap(SCAN_CONTEXT *ctx, UINTN *first, UINTN *second);
+
+// the file system probe reads at most this many regions per partition,
+// the first one starts at the partition start
+#define FS_PROBE_MAX_REGIONS (8)
+
+// what a file system probe found out about a volume
+#define FS_UUID_SIZE        (48)
+#define FS_LABEL_SIZE       (64)
 
-UINTN detect_mbrtype_fs(UINT64 partlba, UINTN *parttype, CHARN **fsname);
+typedef struct {
+    UINTN   mbr_type;                   // 0 if not recognized
+    CHARN   *name;
+    CHARN   uuid[FS_UUID_SIZE];         // UUID or serial number as text, empty if unknown
+    CHARN   label[FS_LABEL_SIZE];       // empty if unknown
+    UINT32  block_size;                 // 0 if unknown
+    UINT64  size;                       // bytes, as recorded by the file system; 0 if unknown
+} FS_INFO;
+
+// end_lba is the last sector of the partition, or this if it isn't known
+#define FS_PROBE_NO_END     (~(UINT64)0)
+
+UINTN fs_probe_size(SCAN_CONTEXT *ctx);
+UINTN fs_probe_requests(SCAN_CONTEXT *ctx, UINT64 partlba, UINT64 end_lba, UINT8 *buffer, IO_REQUEST *requests);
+UINTN detect_fs_data(SCAN_CONTEXT *ctx, UINT8 *buffer, UINT64 partlba, UINT64 end_lba, FS_INFO *info);
+UINTN detect_mbrtype_fs_data(SCAN_CONTEXT *ctx, UINT8 *buffer, UINT64 partlba, UINT64 end_lba,
+                             UINTN *parttype, CHARN **fsname);
+UINTN detect_mbrtype_fs(SCAN_CONTEXT *ctx, UINT64 partlba, UINT64 end_lba, UINTN *parttype, CHARN **fsname);
+
+// a file system found by the recovery scan
+typedef struct {
+    UINT64  start_lba;
+    UINT64  sector_count;       // from the superblock, 0 if unknown
+    UINT64  key_position;       // byte offset of the signature that matched
+    UINTN   probe;              // the probe that matched, lower ones take precedence
+    FS_INFO fs;
+} RECOVER_CANDIDATE;
+
+// recover_scan_sectors() stores at most this many candidates per sector
+#define RECOVER_MAX_PER_SECTOR  (32)
+
+VOID recover_margins(UINTN *before, UINTN *after);
+UINTN recover_scan_sectors(UINTN sector_size, UINT64 lba, UINTN count, UINT8 *data,
+                           RECOVER_CANDIDATE *found, UINTN max_found, UINTN *found_count);
+#ifndef CONFIG_EFI
+UINTN recover_scan(SCAN_CONTEXT *ctx, UINTN thread_count, RECOVER_CANDIDATE **found, UINTN *found_count);
+#endif
+
+#ifndef CONFIG_EFI
+UINTN bootcode_load_db(UINT8 *data, UINTN size);
+BOOLEAN bootcode_fingerprint(UINT8 *sector, BOOLEAN is_mbr, UINT64 *hash, CHARN **name, CHARN **version);
+#endif
+
+// what scan_contents() found in a range of sectors
+#define CONTENTS_SPARSE     (0)     // nothing allocated
+#define CONTENTS_ZERO       (1)     // allocated, but all zeros
+#define CONTENTS_DATA       (2)
+
+UINTN scan_contents(SCAN_CONTEXT *ctx, UINT64 start_lba, UINT64 end_lba, UINTN *contents, UINT64 *data_lba);
+
+VOID plan_reads(SCAN_CONTEXT *ctx, BOOLEAN all_parts);
+
+#ifndef CONFIG_EFI
+// makes the report of one device for inventory_serve(), which frees it
+typedef UINTN (*INVENTORY_SCAN)(VOID *context, char *filename, char **report, UINTN *length);
+
+UINTN inventory_serve(char *socket_path, char **filenames, UINTN count, UINTN worker_count,
+                      INVENTORY_SCAN scan, VOID *scan_context);
+#endif
 
 extern char *progname;
-extern BOOLEAN fill_mbr;
-extern BOOLEAN create_empty_mbr;
 
 //
 // actual platform-independent programs
 //
 
-UINTN gptsync(int optind, int argc, char **argv);
-UINTN showpart(VOID);
+// The init functions build the lookup tables up front. They run once,
+// before the first device and before any other thread is started.
+UINTN gptsync_init(VOID);
+UINTN showpart_init(VOID);
+UINTN gptsync(SCAN_CONTEXT *ctx, int optind, int argc, char **argv);
+UINTN showpart(SCAN_CONTEXT *ctx, int optind, int argc, char **argv);
 
 
 /* EOF */
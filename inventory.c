@@ -0,0 +1,785 @@
+/*
+ * gptsync/inventory.c
+ * Long-running showpart that keeps the reports of all disks at hand and
+ * answers queries on a Unix socket, Unix only
+ *
+ * Copyright (c) 2006-2007 Christoph Pfisterer
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are
+ * met:
+ *
+ *  * Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ *
+ *  * Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the
+ *    distribution.
+ *
+ *  * Neither the name of Christoph Pfisterer nor the names of the
+ *    contributors may be used to endorse or promote products derived
+ *    from this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+ * A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT
+ * OWNER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+ * SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT
+ * LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+ * DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+ * THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+ * OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include "gptsync.h"
+
+#include <pthread.h>
+#include <stdarg.h>
+#include <limits.h>
+#include <poll.h>
+#include <signal.h>
+#include <glob.h>
+#include <dirent.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#ifdef __linux__
+#include <linux/netlink.h>
+#endif
+
+// without kernel events, everything is looked at again this often (seconds)
+#define INVENTORY_RESCAN_INTERVAL   (300)
+#define INVENTORY_MAX_REQUEST       (4096)
+// a client gets this long to send its request and take the reply (seconds)
+#define INVENTORY_CLIENT_TIMEOUT    (2)
+
+typedef struct {
+    char        *filename;
+    char        *report;            // NULL until the first scan is done
+    UINTN       report_length;
+    UINTN       status;             // of the scan that made the report
+    time_t      scanned;
+    BOOLEAN     dirty;              // needs a (new) scan
+    BOOLEAN     block_device;       // changes are reported by the kernel
+    BOOLEAN     scanning;
+    BOOLEAN     removed;            // gone from the system, dropped after its scan
+} INVENTORY_DEVICE;
+
+typedef struct {
+    INVENTORY_SCAN      scan;
+    VOID                *scan_context;
+    BOOLEAN             fixed;              // devices given by the user, no discovery
+    
+    pthread_mutex_t     lock;               // protects everything below
+    pthread_cond_t      work;               // a device got dirty, or stopping
+    INVENTORY_DEVICE    **devices;          // sorted by file name
+    UINTN               device_count, device_capacity;
+    BOOLEAN             stopping;
+} INVENTORY;
+
+typedef struct {
+    char    *data;
+    UINTN   length;
+    UINTN   size;
+    BOOLEAN failed;
+} INVENTORY_REPLY;
+
+static volatile sig_atomic_t inventory_stop = 0;
+
+static void inventory_signal(int sig)
+{
+    inventory_stop = 1;
+}
+
+//
+// the device table, all called with the lock held
+//
+
+static INVENTORY_DEVICE * inventory_find(INVENTORY *inv, const char *filename, UINTN *index)
+{
+    UINTN   low, high, mid;
+    int     cmp;
+    
+    low = 0;
+    high = inv->device_count;
+    while (low < high) {
+        mid = (low + high) / 2;
+        cmp = strcmp(inv->devices[mid]->filename, filename);
+        if (cmp == 0) {
+            *index = mid;
+            return inv->devices[mid];
+        }
+        if (cmp < 0)
+            low = mid + 1;
+        else
+            high = mid;
+    }
+    *index = low;
+    return NULL;
+}
+
+// also finds devices by the names of links to them
+static INVENTORY_DEVICE * inventory_lookup(INVENTORY *inv, const char *filename)
+{
+    INVENTORY_DEVICE    *dev;
+    char                resolved[PATH_MAX];
+    UINTN               index;
+    
+    dev = inventory_find(inv, filename, &index);
+    if (dev == NULL && realpath(filename, resolved) != NULL)
+        dev = inventory_find(inv, resolved, &index);
+    return dev;
+}
+
+// adds the device if it is new and schedules a scan; kernel events name
+// the device node, so links like /dev/disk/by-id/... are resolved first
+static UINTN inventory_add(INVENTORY *inv, const char *filename)
+{
+    INVENTORY_DEVICE    *dev, **grown;
+    struct stat         sb;
+    char                resolved[PATH_MAX];
+    UINTN               index;
+    
+    if (realpath(filename, resolved) != NULL)
+        filename = resolved;
+    dev = inventory_find(inv, filename, &index);
+    if (dev == NULL) {
+        if (inv->device_count == inv->device_capacity) {
+            inv->device_capacity = (inv->device_capacity == 0) ? 16 : inv->device_capacity * 2;
+            grown = realloc(inv->devices, inv->device_capacity * sizeof(INVENTORY_DEVICE *));
+            if (grown == NULL) {
+                error("Out of memory");
+                return 1;
+            }
+            inv->devices = grown;
+        }
+        dev = calloc(1, sizeof(INVENTORY_DEVICE));
+        if (dev == NULL || (dev->filename = strdup(filename)) == NULL) {
+            free(dev);
+            error("Out of memory");
+            return 1;
+        }
+        memmove(inv->devices + index + 1, inv->devices + index,
+                (inv->device_count - index) * sizeof(INVENTORY_DEVICE *));
+        inv->devices[index] = dev;
+        inv->device_count++;
+    }
+    dev->removed      = FALSE;
+    dev->dirty        = TRUE;
+    dev->block_device = (stat(filename, &sb) == 0 && S_ISBLK(sb.st_mode));
+    pthread_cond_signal(&inv->work);
+    return 0;
+}
+
+static void inventory_free_device(INVENTORY_DEVICE *dev)
+{
+    free(dev->filename);
+    free(dev->report);
+    free(dev);
+}
+
+// a device being scanned is dropped by its worker when the scan is done
+static void inventory_remove(INVENTORY *inv, const char *filename)
+{
+    INVENTORY_DEVICE    *dev;
+    UINTN               index;
+    
+    dev = inventory_find(inv, filename, &index);
+    if (dev == NULL)
+        return;
+    memmove(inv->devices + index, inv->devices + index + 1,
+            (inv->device_count - index - 1) * sizeof(INVENTORY_DEVICE *));
+    inv->device_count--;
+    if (dev->scanning)
+        dev->removed = TRUE;
+    else
+        inventory_free_device(dev);
+}
+
+//
+// device discovery
+//
+
+#ifdef __linux__
+
+// disks with no medium (empty loop devices, card readers) have size 0
+static BOOLEAN sysfs_disk_present(const char *name)
+{
+    char    path[PATH_MAX], line[64];
+    FILE    *f;
+    BOOLEAN present = FALSE;
+    
+    snprintf(path, sizeof(path), "/sys/block/%s/size", name);
+    f = fopen(path, "r");
+    if (f == NULL)
+        return FALSE;
+    if (fgets(line, sizeof(line), f) != NULL)
+        present = (strtoull(line, NULL, 10) > 0);
+    fclose(f);
+    return present;
+}
+
+// sysfs spells a / in a device name as ! (cciss!c0d0 is /dev/cciss/c0d0)
+static void sysfs_device_filename(const char *name, char *filename, size_t size)
+{
+    char    *p;
+    
+    snprintf(filename, size, "/dev/%s", name);
+    for (p = filename + 5; *p; p++)
+        if (*p == '!')
+            *p = '/';
+}
+
+static UINTN inventory_discover(INVENTORY *inv)
+{
+    DIR             *dir;
+    struct dirent   *entry;
+    char            filename[PATH_MAX];
+    UINTN           status = 0;
+    
+    dir = opendir("/sys/block");
+    if (dir == NULL) {
+        errore("Can't list the block devices");
+        return 1;
+    }
+    while (status == 0 && (entry = readdir(dir)) != NULL) {
+        if (entry->d_name[0] == '.' || !sysfs_disk_present(entry->d_name))
+            continue;
+        sysfs_device_filename(entry->d_name, filename, sizeof(filename));
+        status = inventory_add(inv, filename);
+    }
+    closedir(dir);
+    return status;
+}
+
+#else
+
+// whole disks only, /dev/disk0 but not /dev/disk0s1
+static UINTN inventory_discover(INVENTORY *inv)
+{
+    glob_t  g;
+    size_t  i;
+    char    *p;
+    UINTN   status = 0;
+    
+    if (glob("/dev/disk*", 0, NULL, &g) != 0)
+        return 0;
+    for (i = 0; i < g.gl_pathc && status == 0; i++) {
+        for (p = g.gl_pathv[i] + 9; *p >= '0' && *p <= '9'; p++)
+            ;
+        if (p > g.gl_pathv[i] + 9 && *p == 0)
+            status = inventory_add(inv, g.gl_pathv[i]);
+    }
+    globfree(&g);
+    return status;
+}
+
+#endif
+
+// looks at all devices again: new disks are added, vanished ones dropped
+static UINTN inventory_rescan_all(INVENTORY *inv)
+{
+    UINTN   i, status;
+    
+    pthread_mutex_lock(&inv->lock);
+    for (i = 0; i < inv->device_count; i++)
+        inv->devices[i]->removed = TRUE;      // marks the ones not found again
+    status = 0;
+    if (inv->fixed) {
+        for (i = 0; i < inv->device_count; i++) {
+            inv->devices[i]->removed = FALSE;
+            inv->devices[i]->dirty   = TRUE;
+        }
+    } else
+        status = inventory_discover(inv);
+    for (i = inv->device_count; i > 0; i--)
+        if (inv->devices[i-1]->removed)
+            inventory_remove(inv, inv->devices[i-1]->filename);
+    pthread_cond_broadcast(&inv->work);
+    pthread_mutex_unlock(&inv->lock);
+    return status;
+}
+
+// image files and the like are never mentioned by kernel events
+static void inventory_rescan_files(INVENTORY *inv)
+{
+    UINTN   i;
+    
+    pthread_mutex_lock(&inv->lock);
+    for (i = 0; i < inv->device_count; i++)
+        if (!inv->devices[i]->block_device)
+            inv->devices[i]->dirty = TRUE;
+    pthread_cond_broadcast(&inv->work);
+    pthread_mutex_unlock(&inv->lock);
+}
+
+//
+// kernel device events
+//
+
+#ifdef __linux__
+
+static int uevent_open(void)
+{
+    struct sockaddr_nl  sa;
+    int                 fd;
+    
+    fd = socket(AF_NETLINK, SOCK_DGRAM, NETLINK_KOBJECT_UEVENT);
+    if (fd < 0)
+        return -1;
+    ZeroMem(&sa, sizeof(sa));
+    sa.nl_family = AF_NETLINK;
+    sa.nl_groups = 1;               // the kernel's own broadcasts
+    if (bind(fd, (struct sockaddr *)&sa, sizeof(sa)) < 0) {
+        close(fd);
+        return -1;
+    }
+    return fd;
+}
+
+// A uevent is "ACTION@DEVPATH" followed by KEY=VALUE strings. Changes to
+// a partition rescan the disk it is on; the partition's parent is the
+// next to last component of its DEVPATH.
+static void uevent_handle(INVENTORY *inv, int fd)
+{
+    char                buf[8192], filename[PATH_MAX], parent[NAME_MAX + 1];
+    struct sockaddr_nl  sa;
+    socklen_t           sa_length;
+    ssize_t             length;
+    char                *p, *action, *subsystem, *devtype, *devname, *devpath, *slash;
+    INVENTORY_DEVICE    *dev;
+    UINTN               index;
+    
+    sa_length = sizeof(sa);
+    length = recvfrom(fd, buf, sizeof(buf) - 1, 0, (struct sockaddr *)&sa, &sa_length);
+    if (length <= 0 || sa.nl_pid != 0)          // only trust the kernel
+        return;
+    buf[length] = 0;
+    
+    action = subsystem = devtype = devname = devpath = NULL;
+    for (p = buf; p < buf + length; p += strlen(p) + 1) {
+        if (strncmp(p, "ACTION=", 7) == 0)
+            action = p + 7;
+        else if (strncmp(p, "SUBSYSTEM=", 10) == 0)
+            subsystem = p + 10;
+        else if (strncmp(p, "DEVTYPE=", 8) == 0)
+            devtype = p + 8;
+        else if (strncmp(p, "DEVNAME=", 8) == 0)
+            devname = p + 8;
+        else if (strncmp(p, "DEVPATH=", 8) == 0)
+            devpath = p + 8;
+    }
+    if (action == NULL || subsystem == NULL || devtype == NULL || devpath == NULL ||
+        strcmp(subsystem, "block") != 0)
+        return;
+    
+    pthread_mutex_lock(&inv->lock);
+    if (strcmp(devtype, "partition") == 0) {
+        slash = strrchr(devpath, '/');
+        if (slash != NULL) {
+            *slash = 0;
+            slash = strrchr(devpath, '/');
+        }
+        if (slash != NULL && strlen(slash + 1) <= NAME_MAX) {
+            strcpy(parent, slash + 1);
+            sysfs_device_filename(parent, filename, sizeof(filename));
+            dev = inventory_find(inv, filename, &index);
+            if (dev != NULL) {
+                dev->dirty = TRUE;
+                pthread_cond_signal(&inv->work);
+            }
+        }
+    } else if (strcmp(devtype, "disk") == 0 && devname != NULL) {
+        snprintf(filename, sizeof(filename), "/dev/%s", devname);
+        dev = inventory_find(inv, filename, &index);
+        if (strcmp(action, "remove") == 0) {
+            if (!inv->fixed)
+                inventory_remove(inv, filename);
+        } else if (inv->fixed) {
+            if (dev != NULL) {
+                dev->dirty = TRUE;
+                pthread_cond_signal(&inv->work);
+            }
+        } else {
+            slash = strrchr(devpath, '/');
+            if (slash != NULL && sysfs_disk_present(slash + 1))
+                inventory_add(inv, filename);
+            else
+                inventory_remove(inv, filename);    // the medium went away
+        }
+    }
+    pthread_mutex_unlock(&inv->lock);
+}
+
+#else
+
+// no kernel events here, the periodic rescan has to do
+static int uevent_open(void)
+{
+    return -1;
+}
+
+static void uevent_handle(INVENTORY *inv, int fd)
+{
+}
+
+#endif
+
+//
+// scanner threads
+//
+
+static void * inventory_worker(void *arg)
+{
+    INVENTORY           *inv = arg;
+    INVENTORY_DEVICE    *dev;
+    UINTN               i, status, length;
+    char                *report;
+    
+    pthread_mutex_lock(&inv->lock);
+    while (!inv->stopping) {
+        dev = NULL;
+        for (i = 0; i < inv->device_count && dev == NULL; i++)
+            if (inv->devices[i]->dirty && !inv->devices[i]->scanning)
+                dev = inv->devices[i];
+        if (dev == NULL) {
+            pthread_cond_wait(&inv->work, &inv->lock);
+            continue;
+        }
+        
+        // the device stays allocated while it is being scanned; a change
+        // reported meanwhile makes it dirty again for one more scan
+        dev->dirty    = FALSE;
+        dev->scanning = TRUE;
+        pthread_mutex_unlock(&inv->lock);
+        report = NULL;
+        length = 0;
+        status = inv->scan(inv->scan_context, dev->filename, &report, &length);
+        pthread_mutex_lock(&inv->lock);
+        
+        dev->scanning = FALSE;
+        if (dev->removed) {
+            free(report);
+            inventory_free_device(dev);
+        } else if (report != NULL) {
+            free(dev->report);
+            dev->report        = report;
+            dev->report_length = length;
+            dev->status        = status;
+            dev->scanned       = time(NULL);
+        }
+    }
+    pthread_mutex_unlock(&inv->lock);
+    return NULL;
+}
+
+//
+// queries
+//
+
+static void reply_append(INVENTORY_REPLY *reply, const char *data, UINTN length)
+{
+    char    *grown;
+    UINTN   size;
+    
+    if (reply->failed)
+        return;
+    if (reply->length + length > reply->size) {
+        size = (reply->size == 0) ? 4096 : reply->size;
+        while (size < reply->length + length)
+            size *= 2;
+        grown = realloc(reply->data, size);
+        if (grown == NULL) {
+            reply->failed = TRUE;
+            return;
+        }
+        reply->data = grown;
+        reply->size = size;
+    }
+    CopyMem(reply->data + reply->length, (VOID *)data, length);
+    reply->length += length;
+}
+
+static void reply_printf(INVENTORY_REPLY *reply, const char *format, ...)
+{
+    va_list par;
+    char    buf[PATH_MAX + 256];
+    int     length;
+    
+    va_start(par, format);
+    length = vsnprintf(buf, sizeof(buf), format, par);
+    va_end(par);
+    if (length > 0)
+        reply_append(reply, buf, (length < (int)sizeof(buf)) ? (UINTN)length : sizeof(buf) - 1);
+}
+
+// Requests are one line each:
+//   list              every device with its state and the time of its report
+//   show [DEVICE]     the report of DEVICE, or of all devices with headers
+//   rescan [DEVICE]   scan DEVICE or all devices again
+// Everything is answered from memory, only rescan touches the disks.
+static void inventory_answer(INVENTORY *inv, char *request, INVENTORY_REPLY *reply)
+{
+    INVENTORY_DEVICE    *dev;
+    char                *command, *argument;
+    UINTN               i;
+    
+    command = strtok(request, " \t\r\n");
+    argument = strtok(NULL, " \t\r\n");
+    if (command == NULL) {
+        reply_printf(reply, "ERROR: empty request\n");
+        return;
+    }
+    
+    pthread_mutex_lock(&inv->lock);
+    if (strcmp(command, "list") == 0) {
+        for (i = 0; i < inv->device_count; i++) {
+            dev = inv->devices[i];
+            reply_printf(reply, "%s %s %lld\n", dev->filename,
+                         (dev->report == NULL) ? "pending" : (dev->status == 0) ? "ok" : "error",
+                         (long long)dev->scanned);
+        }
+        
+    } else if (strcmp(command, "show") == 0 && argument != NULL) {
+        dev = inventory_lookup(inv, argument);
+        if (dev == NULL)
+            reply_printf(reply, "ERROR: unknown device %s\n", argument);
+        else if (dev->report == NULL)
+            reply_printf(reply, "ERROR: %s has not been scanned yet\n", argument);
+        else
+            reply_append(reply, dev->report, dev->report_length);
+        
+    } else if (strcmp(command, "show") == 0) {
+        for (i = 0; i < inv->device_count; i++) {
+            dev = inv->devices[i];
+            if (dev->report == NULL)
+                continue;
+            reply_printf(reply, "==> %s <==\n", dev->filename);
+            reply_append(reply, dev->report, dev->report_length);
+        }
+        
+    } else if (strcmp(command, "rescan") == 0) {
+        dev = (argument != NULL) ? inventory_lookup(inv, argument) : NULL;
+        if (argument != NULL && dev == NULL) {
+            reply_printf(reply, "ERROR: unknown device %s\n", argument);
+        } else {
+            for (i = 0; i < inv->device_count; i++)
+                if (dev == NULL || inv->devices[i] == dev)
+                    inv->devices[i]->dirty = TRUE;
+            pthread_cond_broadcast(&inv->work);
+            reply_printf(reply, "OK\n");
+        }
+        
+    } else
+        reply_printf(reply, "ERROR: unknown request %s\n", command);
+    pthread_mutex_unlock(&inv->lock);
+}
+
+static void inventory_client(INVENTORY *inv, int listen_fd)
+{
+    int             fd;
+    struct timeval  timeout;
+    char            request[INVENTORY_MAX_REQUEST];
+    UINTN           length, done;
+    ssize_t         n;
+    INVENTORY_REPLY reply;
+    
+    fd = accept(listen_fd, NULL, NULL);
+    if (fd < 0)
+        return;
+    timeout.tv_sec  = INVENTORY_CLIENT_TIMEOUT;
+    timeout.tv_usec = 0;
+    setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+    setsockopt(fd, SOL_SOCKET, SO_SNDTIMEO, &timeout, sizeof(timeout));
+    
+    // read up to the end of the first line
+    length = 0;
+    while (length < sizeof(request) - 1) {
+        n = read(fd, request + length, sizeof(request) - 1 - length);
+        if (n <= 0)
+            break;
+        length += n;
+        if (memchr(request, '\n', length) != NULL)
+            break;
+    }
+    request[length] = 0;
+    
+    ZeroMem(&reply, sizeof(reply));
+    inventory_answer(inv, request, &reply);
+    if (reply.failed) {
+        reply.length = 0;
+        reply_printf(&reply, "ERROR: out of memory\n");
+    }
+    for (done = 0; done < reply.length; done += n) {
+        n = write(fd, reply.data + done, reply.length - done);
+        if (n <= 0)
+            break;
+    }
+    free(reply.data);
+    close(fd);
+}
+
+// a socket left behind by an instance that is gone is replaced, a live one
+// is not, and neither is anything that isn't a socket
+static int inventory_listen(char *socket_path)
+{
+    struct sockaddr_un  sa;
+    struct stat         sb;
+    int                 fd, probe_fd;
+    mode_t              old_umask;
+    
+    if (strlen(socket_path) >= sizeof(sa.sun_path)) {
+        error("socket path %s is too long", socket_path);
+        return -1;
+    }
+    ZeroMem(&sa, sizeof(sa));
+    sa.sun_family = AF_UNIX;
+    strcpy(sa.sun_path, socket_path);
+    
+    if (lstat(socket_path, &sb) == 0 && !S_ISSOCK(sb.st_mode)) {
+        error("%s exists and is not a socket", socket_path);
+        return -1;
+    }
+    probe_fd = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (probe_fd >= 0) {
+        if (connect(probe_fd, (struct sockaddr *)&sa, sizeof(sa)) == 0) {
+            close(probe_fd);
+            error("%s is already being served", socket_path);
+            return -1;
+        }
+        if (errno == ECONNREFUSED)
+            unlink(socket_path);
+        close(probe_fd);
+    }
+    
+    fd = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (fd < 0) {
+        errore("Can't create socket %s", socket_path);
+        return -1;
+    }
+    old_umask = umask(077);         // the disk layout is for root's eyes
+    if (bind(fd, (struct sockaddr *)&sa, sizeof(sa)) < 0) {
+        umask(old_umask);
+        errore("Can't bind socket %s", socket_path);
+        close(fd);
+        return -1;
+    }
+    umask(old_umask);
+    if (listen(fd, 64) < 0) {
+        errore("Can't listen on socket %s", socket_path);
+        close(fd);
+        unlink(socket_path);
+        return -1;
+    }
+    return fd;
+}
+
+//
+// entry point
+//
+
+// Scans the given devices, or all disks if there are none, and answers
+// queries on socket_path until SIGINT or SIGTERM. Devices are rescanned
+// when the kernel reports a change, and every INVENTORY_RESCAN_INTERVAL
+// seconds where it can't (everything without kernel events, image files
+// with them).
+UINTN inventory_serve(char *socket_path, char **filenames, UINTN count, UINTN worker_count,
+                      INVENTORY_SCAN scan, VOID *scan_context)
+{
+    INVENTORY       inv;
+    pthread_t       *workers;
+    struct pollfd   fds[2];
+    UINTN           i, started, status;
+    int             listen_fd, uevent_fd;
+    time_t          next_rescan, now;
+    
+    ZeroMem(&inv, sizeof(inv));
+    inv.scan         = scan;
+    inv.scan_context = scan_context;
+    inv.fixed        = (count > 0);
+    pthread_mutex_init(&inv.lock, NULL);
+    pthread_cond_init(&inv.work, NULL);
+    
+    status = 0;
+    for (i = 0; i < count && status == 0; i++)
+        status = inventory_add(&inv, filenames[i]);
+    if (status == 0 && !inv.fixed)
+        status = inventory_discover(&inv);
+    workers = calloc(worker_count, sizeof(pthread_t));
+    if (status == 0 && workers == NULL) {
+        error("Out of memory");
+        status = 1;
+    }
+    listen_fd = (status == 0) ? inventory_listen(socket_path) : -1;
+    if (listen_fd < 0) {
+        for (i = 0; i < inv.device_count; i++)
+            inventory_free_device(inv.devices[i]);
+        free(inv.devices);
+        free(workers);
+        return 1;
+    }
+    uevent_fd = uevent_open();
+    
+    signal(SIGINT, inventory_signal);
+    signal(SIGTERM, inventory_signal);
+    signal(SIGPIPE, SIG_IGN);
+    
+    for (started = 0; started < worker_count; started++)
+        if (pthread_create(&workers[started], NULL, inventory_worker, &inv) != 0)
+            break;
+    if (started == 0) {
+        error("Can't start the scanner threads");
+        status = 1;
+        inventory_stop = 1;
+    }
+    
+    next_rescan = time(NULL) + INVENTORY_RESCAN_INTERVAL;
+    while (!inventory_stop) {
+        fds[0].fd = listen_fd;
+        fds[0].events = POLLIN;
+        fds[1].fd = uevent_fd;
+        fds[1].events = POLLIN;
+        
+        // wake up once a second to notice signals that arrive just before poll()
+        if (poll(fds, (uevent_fd >= 0) ? 2 : 1, 1000) > 0) {
+            if (fds[0].revents & POLLIN)
+                inventory_client(&inv, listen_fd);
+            if (uevent_fd >= 0 && (fds[1].revents & POLLIN))
+                uevent_handle(&inv, uevent_fd);
+        }
+        
+        now = time(NULL);
+        if (now >= next_rescan) {
+            if (uevent_fd < 0)
+                inventory_rescan_all(&inv);
+            else
+                inventory_rescan_files(&inv);
+            next_rescan = now + INVENTORY_RESCAN_INTERVAL;
+        }
+    }
+    
+    // scans in progress are finished, not abandoned
+    pthread_mutex_lock(&inv.lock);
+    inv.stopping = TRUE;
+    pthread_cond_broadcast(&inv.work);
+    pthread_mutex_unlock(&inv.lock);
+    for (i = 0; i < started; i++)
+        pthread_join(workers[i], NULL);
+    
+    if (uevent_fd >= 0)
+        close(uevent_fd);
+    close(listen_fd);
+    unlink(socket_path);
+    for (i = 0; i < inv.device_count; i++)
+        inventory_free_device(inv.devices[i]);
+    free(inv.devices);
+    free(workers);
+    pthread_cond_destroy(&inv.work);
+    pthread_mutex_destroy(&inv.lock);
+    return status;
+}
+
+/* EOF */
@@ -35,119 +35,226 @@
  */
 
 #include "gptsync.h"
+#include "typedb.h"
+#ifndef CONFIG_EFI
+#include "bootdb.h"
+#endif
 
 // variables
 
 UINT8           empty_guid[16] = { 0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0 };
 
-PARTITION_INFO  mbr_parts[4];
-UINTN           mbr_part_count = 0;
-PARTITION_INFO  gpt_parts[128];
-UINTN           gpt_part_count = 0;
+// the GPT entry array is fetched in chunks of this size
+// (16K hold a standard 128-entry table in a single read)
+#define ENTRY_BUFFER_SIZE (16384)
+// largest GPT entry array accepted, 128 times the usual 16 KiB
+#define GPT_MAX_ARRAY_SIZE (2*1024*1024)
 
-PARTITION_INFO  new_mbr_parts[4];
-UINTN           new_mbr_part_count = 0;
+//
+// memory arena
+//
+
+// arena memory is requested from the OS in blocks of this size
+#define ARENA_BLOCK_SIZE (65536)
+
+struct _ARENA_BLOCK {
+    ARENA_BLOCK *next;
+    UINTN       size;
+    UINTN       used;
+};
+
+// allocations are zeroed; blocks come from alloc_io_buffer(), which aligns
+// them to at least MAX_SECTOR_SIZE, so alignments up to that can be met by
+// rounding the offset within the block
+VOID * arena_alloc(ARENA *arena, UINTN size, UINTN align)
+{
+    ARENA_BLOCK *block;
+    UINTN       offset, block_size;
+    
+    if (align < 16)
+        align = 16;
+    
+    block = arena->blocks;
+    if (block != NULL) {
+        offset = (block->used + align - 1) & ~(align - 1);
+        if (offset <= block->size && size <= block->size - offset) {
+            block->used = offset + size;
+            ZeroMem((UINT8 *)block + offset, size);
+            return (UINT8 *)block + offset;
+        }
+    }
+    
+    // start a new block, big enough for this request
+    offset = (sizeof(ARENA_BLOCK) + align - 1) & ~(align - 1);
+    block_size = ARENA_BLOCK_SIZE;
+    if (offset + size > block_size)
+        block_size = offset + size;
+    block = alloc_io_buffer(block_size);
+    if (block == NULL) {
+        error("Out of memory");
+        return NULL;
+    }
+    block->next = arena->blocks;
+    block->size = block_size;
+    block->used = offset + size;
+    arena->blocks = block;
+    
+    ZeroMem((UINT8 *)block + offset, size);
+    return (UINT8 *)block + offset;
+}
+
+VOID arena_free_all(ARENA *arena)
+{
+    ARENA_BLOCK *block, *next;
+    
+    for (block = arena->blocks; block != NULL; block = next) {
+        next = block->next;
+        free_io_buffer(block);
+    }
+    arena->blocks = NULL;
+}
+
+//
+// CRC32 (IEEE 802.3 polynomial, as used by GPT)
+//
+// Computed with the ARMv8 CRC32 instructions where the compiler targets
+// them, otherwise slice-by-16: sixteen lookup tables let one step consume
+// 16 bytes with independent loads instead of one dependent load per byte.
+//
+
+#if defined(__ARM_FEATURE_CRC32)
+
+#include <arm_acle.h>
+
+static VOID crc32_init(VOID)
+{
+    // nothing to build
+}
+
+UINT32 crc32_update(UINT32 crc, UINT8 *data, UINTN length)
+{
+    UINT64  word;
+    
+    crc = ~crc;
+    while (length >= 8) {
+        CopyMem(&word, data, 8);
+        crc = __crc32d(crc, word);
+        data += 8;
+        length -= 8;
+    }
+    while (length-- > 0)
+        crc = __crc32b(crc, *data++);
+    return ~crc;
+}
+
+#else
+
+static UINT32   crc32_table[16][256];
+static BOOLEAN  crc32_table_ready = FALSE;
+
+static VOID crc32_init(VOID)
+{
+    UINT32  i, k, crc;
+    
+    for (i = 0; i < 256; i++) {
+        crc = i;
+        for (k = 0; k < 8; k++)
+            crc = (crc >> 1) ^ (0xEDB88320 & (0 - (crc & 1)));
+        crc32_table[0][i] = crc;
+    }
+    for (i = 0; i < 256; i++)
+        for (k = 1; k < 16; k++)
+            crc32_table[k][i] = (crc32_table[k-1][i] >> 8) ^ crc32_table[0][crc32_table[k-1][i] & 0xff];
+    crc32_table_ready = TRUE;
+}
+
+UINT32 crc32_update(UINT32 crc, UINT8 *data, UINTN length)
+{
+    UINT32  w[4];
+    
+    if (!crc32_table_ready)
+        crc32_init();
+    
+    crc = ~crc;
+    while (length >= 16) {
+        CopyMem(w, data, 16);       // little-endian words
+        w[0] ^= crc;
+        crc = crc32_table[15][ w[0]        & 0xff] ^ crc32_table[14][(w[0] >>  8) & 0xff] ^
+              crc32_table[13][(w[0] >> 16) & 0xff] ^ crc32_table[12][ w[0] >> 24        ] ^
+              crc32_table[11][ w[1]        & 0xff] ^ crc32_table[10][(w[1] >>  8) & 0xff] ^
+              crc32_table[ 9][(w[1] >> 16) & 0xff] ^ crc32_table[ 8][ w[1] >> 24        ] ^
+              crc32_table[ 7][ w[2]        & 0xff] ^ crc32_table[ 6][(w[2] >>  8) & 0xff] ^
+              crc32_table[ 5][(w[2] >> 16) & 0xff] ^ crc32_table[ 4][ w[2] >> 24        ] ^
+              crc32_table[ 3][ w[3]        & 0xff] ^ crc32_table[ 2][(w[3] >>  8) & 0xff] ^
+              crc32_table[ 1][(w[3] >> 16) & 0xff] ^ crc32_table[ 0][ w[3] >> 24        ];
+        data += 16;
+        length -= 16;
+    }
+    while (length-- > 0)
+        crc = (crc >> 8) ^ crc32_table[0][(crc ^ *data++) & 0xff];
+    return ~crc;
+}
 
-UINT8           sector[512];
+#endif
+
+//
+// scan context
+//
+
+SCAN_CONTEXT * scan_create(DISK_DEVICE *disk)
+{
+    ARENA           arena;
+    SCAN_CONTEXT    *ctx;
+    
+    arena.blocks = NULL;
+    ctx = arena_alloc(&arena, sizeof(SCAN_CONTEXT), 0);
+    if (ctx == NULL)
+        return NULL;
+    ctx->arena = arena;
+    
+    ctx->raw_disk = disk;
+    ctx->disk = disk_open_cache(disk, SECTOR_CACHE_SIZE);
+    if (ctx->disk == NULL) {
+        scan_destroy(ctx);
+        return NULL;
+    }
+    ctx->sector = arena_alloc(&ctx->arena, disk->sector_size, MAX_SECTOR_SIZE);
+    if (ctx->sector == NULL) {
+        scan_destroy(ctx);
+        return NULL;
+    }
+    
+    ctx->fill_mbr         = TRUE;
+    ctx->create_empty_mbr = FALSE;
+    ctx->check_contents   = FALSE;
+    ctx->recover_threads  = 0;
+    ctx->recover_progress = FALSE;
+    return ctx;
+}
+
+VOID scan_destroy(SCAN_CONTEXT *ctx)
+{
+    ARENA           arena;
+    
+    if (ctx->disk != NULL)
+        disk_close(ctx->disk);
+    
+    // the context itself is freed along with the arena
+    arena = ctx->arena;
+    arena_free_all(&arena);
+}
+
+// the type tables are expanded from parttypes.h
 
 MBR_PARTTYPE    mbr_types[] = {
-    { 0x01, STR("FAT12 (CHS)") },
-    { 0x04, STR("FAT16 <32M (CHS)") },
-    { 0x05, STR("Extended (CHS)") },
-    { 0x06, STR("FAT16 (CHS)") },
-    { 0x07, STR("NTFS/HPFS") },
-    { 0x0b, STR("FAT32 (CHS)") },
-    { 0x0c, STR("FAT32 (LBA)") },
-    { 0x0e, STR("FAT16 (LBA)") },
-    { 0x0f, STR("Extended (LBA)") },
-    { 0x11, STR("Hidden FAT12 (CHS)") },
-    { 0x14, STR("Hidden FAT16 <32M (CHS)") },
-    { 0x16, STR("Hidden FAT16 (CHS)") },
-    { 0x17, STR("Hidden NTFS/HPFS") },
-    { 0x1b, STR("Hidden FAT32 (CHS)") },
-    { 0x1c, STR("Hidden FAT32 (LBA)") },
-    { 0x1e, STR("Hidden FAT16 (LBA)") },
-    { 0x82, STR("Linux swap / Solaris") },
-    { 0x83, STR("Linux") },
-    { 0x85, STR("Linux Extended") },
-    { 0x86, STR("NT FAT volume set") },
-    { 0x87, STR("NTFS volume set") },
-    { 0x8e, STR("Linux LVM") },
-    { 0xa5, STR("FreeBSD") },
-    { 0xa6, STR("OpenBSD") },
-    { 0xa7, STR("NeXTSTEP") },
-    { 0xa8, STR("Mac OS X UFS") },
-    { 0xa9, STR("NetBSD") },
-    { 0xab, STR("Mac OS X Boot") },
-    { 0xac, STR("Apple RAID") },
-    { 0xaf, STR("Mac OS X HFS+") },
-    { 0xbe, STR("Solaris Boot") },
-    { 0xbf, STR("Solaris") },
-    { 0xeb, STR("BeOS") },
-    { 0xee, STR("EFI Protective") },
-    { 0xef, STR("EFI System (FAT)") },
-    { 0xfd, STR("Linux RAID") },
+#define MBR_TYPE(type, name) { type, STR(name) },
+#include "parttypes.h"
     { 0, NULL },
 };
 
 GPT_PARTTYPE    gpt_types[] = {
-    // Defined by EFI/UEFI specification
-    { "\x28\x73\x2A\xC1\x1F\xF8\xD2\x11\xBA\x4B\x00\xA0\xC9\x3E\xC9\x3B", 0xef, STR("EFI System (FAT)"), GPT_KIND_SYSTEM },
-    { "\x41\xEE\x4D\x02\xE7\x33\xD3\x11\x9D\x69\x00\x08\xC7\x81\xF3\x9F", 0x00, STR("MBR partition scheme"), GPT_KIND_FATAL },
-    // Generally well-known
-    { "\x16\xE3\xC9\xE3\x5C\x0B\xB8\x4D\x81\x7D\xF9\x2D\xF0\x02\x15\xAE", 0x00, STR("MS Reserved"), GPT_KIND_SYSTEM },
-    { "\xA2\xA0\xD0\xEB\xE5\xB9\x33\x44\x87\xC0\x68\xB6\xB7\x26\x99\xC7", 0x00, STR("Basic Data"), GPT_KIND_BASIC_DATA },
-    // From Wikipedia
-    { "\xAA\xC8\x08\x58\x8F\x7E\xE0\x42\x85\xD2\xE1\xE9\x04\x34\xCF\xB3", 0x00, STR("MS LDM Metadata"), GPT_KIND_FATAL },
-    { "\xA0\x60\x9B\xAF\x31\x14\x62\x4F\xBC\x68\x33\x11\x71\x4A\x69\xAD", 0x00, STR("MS LDM Data"), GPT_KIND_FATAL },
-    { "\x1E\x4C\x89\x75\xEB\x3A\xD3\x11\xB7\xC1\x7B\x03\xA0\x00\x00\x00", 0x00, STR("HP/UX Data"), GPT_KIND_DATA },
-    { "\x28\xE7\xA1\xE2\xE3\x32\xD6\x11\xA6\x82\x7B\x03\xA0\x00\x00\x00", 0x00, STR("HP/UX Service"), GPT_KIND_SYSTEM },
-    // From Linux repository, fs/partitions/efi.h
-    { "\x0F\x88\x9D\xA1\xFC\x05\x3B\x4D\xA0\x06\x74\x3F\x0F\x84\x91\x1E", 0xfd, STR("Linux RAID"), GPT_KIND_DATA },
-    { "\x6D\xFD\x57\x06\xAB\xA4\xC4\x43\x84\xE5\x09\x33\xC8\x4B\x4F\x4F", 0x82, STR("Linux Swap"), GPT_KIND_SYSTEM },
-    { "\x79\xD3\xD6\xE6\x07\xF5\xC2\x44\xA2\x3C\x23\x8F\x2A\x3D\xF9\x28", 0x8e, STR("Linux LVM"), GPT_KIND_DATA },
-    // From Wikipedia
-    { "\x39\x33\xA6\x8D\x07\x00\xC0\x60\xC4\x36\x08\x3A\xC8\x23\x09\x08", 0x00, STR("Linux Reserved"), GPT_KIND_SYSTEM },
-    // From grub2 repository, grub/include/grub/gpt_partition.h
-    { "\x48\x61\x68\x21\x49\x64\x6F\x6E\x74\x4E\x65\x65\x64\x45\x46\x49", 0x00, STR("GRUB2 BIOS Boot"), GPT_KIND_SYSTEM },
-    // From FreeBSD repository, sys/sys/gpt.h
-    { "\xB4\x7C\x6E\x51\xCF\x6E\xD6\x11\x8F\xF8\x00\x02\x2D\x09\x71\x2B", 0xa5, STR("FreeBSD Data"), GPT_KIND_DATA },
-    { "\xB5\x7C\x6E\x51\xCF\x6E\xD6\x11\x8F\xF8\x00\x02\x2D\x09\x71\x2B", 0x00, STR("FreeBSD Swap"), GPT_KIND_SYSTEM },
-    { "\xB6\x7C\x6E\x51\xCF\x6E\xD6\x11\x8F\xF8\x00\x02\x2D\x09\x71\x2B", 0xa5, STR("FreeBSD UFS"), GPT_KIND_DATA },
-    { "\xB8\x7C\x6E\x51\xCF\x6E\xD6\x11\x8F\xF8\x00\x02\x2D\x09\x71\x2B", 0x00, STR("FreeBSD Vinum"), GPT_KIND_DATA },
-    { "\xBA\x7C\x6E\x51\xCF\x6E\xD6\x11\x8F\xF8\x00\x02\x2D\x09\x71\x2B", 0xa5, STR("FreeBSD ZFS"), GPT_KIND_DATA },
-    { "\x9D\x6B\xBD\x83\x41\x7F\xDC\x11\xBE\x0B\x00\x15\x60\xB8\x4F\x0F", 0xa5, STR("FreeBSD Boot"), GPT_KIND_DATA },
-    // From NetBSD repository, sys/sys/disklabel_gpt.h
-    { "\x32\x8D\xF4\x49\x0E\xB1\xDC\x11\xB9\x9B\x00\x19\xD1\x87\x96\x48", 0x00, STR("NetBSD Swap"), GPT_KIND_SYSTEM },
-    { "\x5A\x8D\xF4\x49\x0E\xB1\xDC\x11\xB9\x9B\x00\x19\xD1\x87\x96\x48", 0xa9, STR("NetBSD FFS"), GPT_KIND_DATA },
-    { "\x82\x8D\xF4\x49\x0E\xB1\xDC\x11\xB9\x9B\x00\x19\xD1\x87\x96\x48", 0xa9, STR("NetBSD LFS"), GPT_KIND_DATA },
-    { "\xAA\x8D\xF4\x49\x0E\xB1\xDC\x11\xB9\x9B\x00\x19\xD1\x87\x96\x48", 0xa9, STR("NetBSD RAID"), GPT_KIND_DATA },
-    { "\xC4\x19\xB5\x2D\x0E\xB1\xDC\x11\xB9\x9B\x00\x19\xD1\x87\x96\x48", 0xa9, STR("NetBSD CCD"), GPT_KIND_DATA },
-    { "\xEC\x19\xB5\x2D\x0E\xB1\xDC\x11\xB9\x9B\x00\x19\xD1\x87\x96\x48", 0xa9, STR("NetBSD CGD"), GPT_KIND_DATA },
-    // From http://developer.apple.com/mac/library/technotes/tn2006/tn2166.html
-    { "\x00\x53\x46\x48\x00\x00\xAA\x11\xAA\x11\x00\x30\x65\x43\xEC\xAC", 0xaf, STR("Mac OS X HFS+"), GPT_KIND_DATA },
-    { "\x00\x53\x46\x55\x00\x00\xAA\x11\xAA\x11\x00\x30\x65\x43\xEC\xAC", 0xa8, STR("Mac OS X UFS"), GPT_KIND_DATA },
-    { "\x74\x6F\x6F\x42\x00\x00\xAA\x11\xAA\x11\x00\x30\x65\x43\xEC\xAC", 0xab, STR("Mac OS X Boot"), GPT_KIND_DATA },
-    { "\x44\x49\x41\x52\x00\x00\xAA\x11\xAA\x11\x00\x30\x65\x43\xEC\xAC", 0xac, STR("Apple RAID"), GPT_KIND_DATA },
-    { "\x44\x49\x41\x52\x4F\x5F\xAA\x11\xAA\x11\x00\x30\x65\x43\xEC\xAC", 0xac, STR("Apple RAID (Offline)"), GPT_KIND_DATA },
-    { "\x65\x62\x61\x4C\x00\x6C\xAA\x11\xAA\x11\x00\x30\x65\x43\xEC\xAC", 0x00, STR("Apple Label"), GPT_KIND_SYSTEM },
-    // From Wikipedia
-    { "\x6F\x63\x65\x52\x65\x76\xAA\x11\xAA\x11\x00\x30\x65\x43\xEC\xAC", 0x00, STR("Apple TV Recovery"), GPT_KIND_BASIC_DATA },
-    { "\x72\x6f\x74\x53\x67\x61\xAA\x11\xAA\x11\x00\x30\x65\x43\xEC\xAC", 0xaf, STR("Apple Core Storage"), GPT_KIND_DATA },
-    // From OpenSolaris repository, usr/src/uts/common/sys/efi_partition.h
-    { "\x7f\x23\x96\x6A\xD2\x1D\xB2\x11\x99\xa6\x08\x00\x20\x73\x66\x31", 0x00, STR("Solaris Reserved"), GPT_KIND_SYSTEM },
-    { "\x45\xCB\x82\x6A\xD2\x1D\xB2\x11\x99\xa6\x08\x00\x20\x73\x66\x31", 0xbf, STR("Solaris Boot"), GPT_KIND_DATA },
-    { "\x4D\xCF\x85\x6A\xD2\x1D\xB2\x11\x99\xa6\x08\x00\x20\x73\x66\x31", 0xbf, STR("Solaris Root"), GPT_KIND_DATA },
-    { "\x6F\xC4\x87\x6A\xD2\x1D\xB2\x11\x99\xa6\x08\x00\x20\x73\x66\x31", 0x00, STR("Solaris Swap"), GPT_KIND_SYSTEM },
-    { "\xC3\x8C\x89\x6A\xD2\x1D\xB2\x11\x99\xa6\x08\x00\x20\x73\x66\x31", 0xbf, STR("Solaris Usr / Apple ZFS"), GPT_KIND_DATA },
-    { "\x2B\x64\x8B\x6A\xD2\x1D\xB2\x11\x99\xa6\x08\x00\x20\x73\x66\x31", 0x00, STR("Solaris Backup"), GPT_KIND_SYSTEM },
-    { "\xC7\x2A\x8D\x6A\xD2\x1D\xB2\x11\x99\xa6\x08\x00\x20\x73\x66\x31", 0x00, STR("Solaris Reserved (Stand)"), GPT_KIND_SYSTEM },
-    { "\xE9\xF2\x8E\x6A\xD2\x1D\xB2\x11\x99\xa6\x08\x00\x20\x73\x66\x31", 0xbf, STR("Solaris Var"), GPT_KIND_DATA },
-    { "\x39\xBA\x90\x6A\xD2\x1D\xB2\x11\x99\xa6\x08\x00\x20\x73\x66\x31", 0xbf, STR("Solaris Home"), GPT_KIND_DATA },
-    { "\xA5\x83\x92\x6A\xD2\x1D\xB2\x11\x99\xa6\x08\x00\x20\x73\x66\x31", 0x00, STR("Solaris Alternate Sector"), GPT_KIND_SYSTEM },
-    { "\x3B\x5A\x94\x6A\xD2\x1D\xB2\x11\x99\xa6\x08\x00\x20\x73\x66\x31", 0x00, STR("Solaris Reserved (Cache)"), GPT_KIND_SYSTEM },
-    { "\xD1\x30\x96\x6A\xD2\x1D\xB2\x11\x99\xa6\x08\x00\x20\x73\x66\x31", 0x00, STR("Solaris Reserved"), GPT_KIND_SYSTEM },
-    { "\x67\x07\x98\x6A\xD2\x1D\xB2\x11\x99\xa6\x08\x00\x20\x73\x66\x31", 0x00, STR("Solaris Reserved"), GPT_KIND_SYSTEM },
+#define GPT_TYPE(guid, mbr_type, name, kind) { guid, mbr_type, STR(name), kind },
+#include "parttypes.h"
     // List sentinel
     { { 0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0 }, 0, NULL, 0 },
 };
@@ -158,17 +265,20 @@ GPT_PARTTYPE    gpt_dummy_type =
 // MBR functions
 //
 
+// indexed directly by the type byte
+static CHARN    *mbr_type_names[256] = {
+#define MBR_TYPE(type, name) [type] = STR(name),
+#include "parttypes.h"
+};
+
 CHARN * mbr_parttype_name(UINT8 type)
 {
-    int i;
-    
-    for (i = 0; mbr_types[i].name; i++)
-        if (mbr_types[i].type == type)
-            return mbr_types[i].name;
-    return STR("Unknown");
+    if (mbr_type_names[type] == NULL)
+        return STR("Unknown");
+    return mbr_type_names[type];
 }
 
-UINTN read_mbr(VOID)
+UINTN read_mbr(SCAN_CONTEXT *ctx)
 {
     UINTN               status;
     UINTN               i;
@@ -178,16 +288,16 @@ UINTN read_mbr(VOID)
     Print(L"\nCurrent MBR partition table:\n");
     
     // read MBR data
-    status = read_sector(0, sector);
+    status = disk_read(ctx->disk, 0, 1, ctx->sector);
     if (status != 0)
         return status;
     
     // check for validity
-    if (*((UINT16 *)(sector + 510)) != 0xaa55) {
+    if (*((UINT16 *)(ctx->sector + 510)) != 0xaa55) {
         Print(L" No MBR partition table present!\n");
         return 1;
     }
-    table = (MBR_PARTITION_INFO *)(sector + 446);
+    table = (MBR_PARTITION_INFO *)(ctx->sector + 446);
     for (i = 0; i < 4; i++) {
         if (table[i].flags != 0x00 && table[i].flags != 0x80) {
             Print(L" MBR partition table is invalid!\n");
@@ -214,21 +324,21 @@ UINTN read_mbr(VOID)
         if (table[i].start_lba == 0 || table[i].size == 0)
             continue;
         
-        mbr_parts[mbr_part_count].index     = i;
-        mbr_parts[mbr_part_count].start_lba = (UINT64)table[i].start_lba;
-        mbr_parts[mbr_part_count].end_lba   = (UINT64)table[i].start_lba + (UINT64)table[i].size - 1;
-        mbr_parts[mbr_part_count].mbr_type  = table[i].type;
-        mbr_parts[mbr_part_count].active    = (table[i].flags == 0x80) ? TRUE : FALSE;
+        ctx->mbr_parts[ctx->mbr_part_count].index     = i;
+        ctx->mbr_parts[ctx->mbr_part_count].start_lba = (UINT64)table[i].start_lba;
+        ctx->mbr_parts[ctx->mbr_part_count].end_lba   = (UINT64)table[i].start_lba + (UINT64)table[i].size - 1;
+        ctx->mbr_parts[ctx->mbr_part_count].mbr_type  = table[i].type;
+        ctx->mbr_parts[ctx->mbr_part_count].active    = (table[i].flags == 0x80) ? TRUE : FALSE;
         
         Print(L" %d %s %12lld %12lld  %02x  %s\n",
-              mbr_parts[mbr_part_count].index + 1,
-              mbr_parts[mbr_part_count].active ? STR("*") : STR(" "),
-              mbr_parts[mbr_part_count].start_lba,
-              mbr_parts[mbr_part_count].end_lba,
-              mbr_parts[mbr_part_count].mbr_type,
-              mbr_parttype_name(mbr_parts[mbr_part_count].mbr_type));
+              ctx->mbr_parts[ctx->mbr_part_count].index + 1,
+              ctx->mbr_parts[ctx->mbr_part_count].active ? STR("*") : STR(" "),
+              ctx->mbr_parts[ctx->mbr_part_count].start_lba,
+              ctx->mbr_parts[ctx->mbr_part_count].end_lba,
+              ctx->mbr_parts[ctx->mbr_part_count].mbr_type,
+              mbr_parttype_name(ctx->mbr_parts[ctx->mbr_part_count].mbr_type));
         
-        mbr_part_count++;
+        ctx->mbr_part_count++;
     }
     
     return 0;
@@ -238,33 +348,374 @@ UINTN read_mbr(VOID)
 // GPT functions
 //
 
+// Open-addressing hash index over gpt_types, built on first use. It is kept
+// at most half full, so a lookup costs one or two GUID compares.
+#define GPT_INDEX_SIZE      (1024)
+
+static UINT16   gpt_type_index[GPT_INDEX_SIZE];     // gpt_types index + 1, 0 = empty
+static BOOLEAN  gpt_type_index_ready = FALSE;
+
+// fails to compile when parttypes.h outgrows the index
+typedef char gpt_index_size_check[(sizeof(gpt_types) / sizeof(gpt_types[0]) <= GPT_INDEX_SIZE / 2) ? 1 : -1];
+
+static VOID gpt_type_index_init(VOID)
+{
+    UINTN   i, slot;
+    
+    for (i = 0; gpt_types[i].name; i++) {
+        // on duplicate GUIDs the first entry wins, as with a linear search
+        for (slot = typedb_guid_hash(gpt_types[i].guid) & (GPT_INDEX_SIZE - 1); gpt_type_index[slot] != 0;
+             slot = (slot + 1) & (GPT_INDEX_SIZE - 1))
+            if (guids_are_equal(gpt_types[gpt_type_index[slot] - 1].guid, gpt_types[i].guid))
+                break;
+        if (gpt_type_index[slot] == 0)
+            gpt_type_index[slot] = (UINT16)(i + 1);
+    }
+    gpt_type_index_ready = TRUE;
+}
+
+#ifndef CONFIG_EFI
+
+// external type database, see typedb.h
+static UINT32           *type_db_index;
+static UINTN            type_db_index_size;
+static GPT_PARTTYPE     *type_db_types;
+
+// Checks a database image (usually a read-only mapping that stays in place)
+// and makes it the first place gpt_parttype() looks. The names point into
+// the image, only the GPT_PARTTYPE records are allocated, once.
+UINTN gpt_load_type_db(UINT8 *data, UINTN size)
+{
+    TYPEDB_HEADER   *header = (TYPEDB_HEADER *)data;
+    TYPEDB_ENTRY    *entries;
+    GPT_PARTTYPE    *types;
+    UINT32          *index;
+    CHARN           *names;
+    UINT64          needed;
+    UINTN           i;
+    
+    if (size < sizeof(TYPEDB_HEADER) || CompareMem(header->magic, TYPEDB_MAGIC, 8) != 0 ||
+        header->version != TYPEDB_VERSION) {
+        error("not a type database (or an unsupported version)");
+        return 1;
+    }
+    needed = sizeof(TYPEDB_HEADER) + (UINT64)header->entry_count * sizeof(TYPEDB_ENTRY) +
+             (UINT64)header->index_size * sizeof(UINT32) + header->names_size;
+    if (header->index_size == 0 || (header->index_size & (header->index_size - 1)) != 0 ||
+        header->entry_count > header->index_size / 2 || header->names_size == 0 || needed > size) {
+        error("type database is damaged (bad sizes)");
+        return 1;
+    }
+    entries = (TYPEDB_ENTRY *)(data + sizeof(TYPEDB_HEADER));
+    index   = (UINT32 *)(entries + header->entry_count);
+    names   = (CHARN *)(index + header->index_size);
+    if (names[header->names_size - 1] != 0) {
+        error("type database is damaged (bad name table)");
+        return 1;
+    }
+    for (i = 0; i < header->index_size; i++) {
+        if (index[i] > header->entry_count) {
+            error("type database is damaged (bad index)");
+            return 1;
+        }
+    }
+    
+    if (header->entry_count == 0)
+        return 0;
+    
+    types = AllocatePool(header->entry_count * sizeof(GPT_PARTTYPE));
+    if (types == NULL) {
+        error("Out of memory");
+        return 1;
+    }
+    for (i = 0; i < header->entry_count; i++) {
+        if (entries[i].name_offset >= header->names_size || entries[i].kind > GPT_KIND_FATAL) {
+            error("type database is damaged (entry %d)", i);
+            FreePool(types);
+            return 1;
+        }
+        copy_guid(types[i].guid, entries[i].guid);
+        types[i].mbr_type = entries[i].mbr_type;
+        types[i].name     = names + entries[i].name_offset;
+        types[i].kind     = entries[i].kind;
+    }
+    
+    type_db_index      = index;
+    type_db_index_size = header->index_size;
+    type_db_types      = types;
+    return 0;
+}
+
+#endif
+
 GPT_PARTTYPE * gpt_parttype(UINT8 *type_guid)
 {
-    int i;
+    UINTN   slot;
     
-    for (i = 0; gpt_types[i].name; i++)
-        if (guids_are_equal(gpt_types[i].guid, type_guid))
-            return &(gpt_types[i]);
+#ifndef CONFIG_EFI
+    if (type_db_types != NULL) {
+        for (slot = typedb_guid_hash(type_guid) & (type_db_index_size - 1); type_db_index[slot] != 0;
+             slot = (slot + 1) & (type_db_index_size - 1))
+            if (guids_are_equal(type_db_types[type_db_index[slot] - 1].guid, type_guid))
+                return &(type_db_types[type_db_index[slot] - 1]);
+    }
+#endif
+    
+    if (!gpt_type_index_ready)
+        gpt_type_index_init();
+    
+    for (slot = typedb_guid_hash(type_guid) & (GPT_INDEX_SIZE - 1); gpt_type_index[slot] != 0; slot = (slot + 1) & (GPT_INDEX_SIZE - 1))
+        if (guids_are_equal(gpt_types[gpt_type_index[slot] - 1].guid, type_guid))
+            return &(gpt_types[gpt_type_index[slot] - 1]);
     return &gpt_dummy_type;
 }
 
-UINTN read_gpt(VOID)
+// Fetches the primary header and entry array and the standard location of
+// the backup in one batch, so checking the backup adds no round trip. This
+// is only a hint; anything not covered here is read on demand.
+static VOID gpt_prefetch(SCAN_CONTEXT *ctx)
+{
+    IO_REQUEST  requests[2];
+    UINTN       sector_size = ctx->disk->sector_size;
+    UINTN       span, count, i;
+    UINT8       *buffer;
+    
+    span = 1 + ENTRY_BUFFER_SIZE / sector_size;
+    if (ctx->disk->block_count > 0 && ctx->disk->block_count < 2 + 2 * span)
+        return;
+    
+    count = 0;
+    requests[count].lba   = 1;
+    requests[count].count = span;
+    count++;
+    if (ctx->disk->block_count > 0 && !ctx->disk->sequential) {
+        requests[count].lba   = ctx->disk->block_count - span;
+        requests[count].count = span;
+        count++;
+    }
+    
+    buffer = alloc_io_buffer(count * span * sector_size);
+    if (buffer == NULL)
+        return;
+    for (i = 0; i < count; i++)
+        requests[i].buffer = buffer + i * span * sector_size;
+    disk_read_batch(ctx->disk, requests, count);
+    free_io_buffer(buffer);
+}
+
+// checks the header size and returns 0 if the stored header checksum is right
+static UINTN gpt_check_header(SCAN_CONTEXT *ctx, UINT8 *sector, UINT32 *computed_crc)
+{
+    GPT_HEADER  *header = (GPT_HEADER *)sector;
+    UINT32      stored_crc;
+    
+    if (header->header_size < 92 || header->header_size > ctx->disk->sector_size)
+        return 1;
+    
+    // the checksum is computed with the checksum field zeroed
+    stored_crc = header->header_crc32;
+    header->header_crc32 = 0;
+    *computed_crc = crc32_update(0, sector, header->header_size);
+    header->header_crc32 = stored_crc;
+    return (*computed_crc != stored_crc) ? 2 : 0;
+}
+
+// Entries are 128 bytes times a power of two. Larger entries span sectors,
+// but every chunk of the entry buffer still holds whole entries. The array
+// size is capped, which also keeps it from overflowing a UINTN and bounds
+// it on streams of unknown size.
+static BOOLEAN gpt_entry_array_valid(SCAN_CONTEXT *ctx, GPT_HEADER *header)
+{
+    UINT64      array_sectors;
+    
+    if (header->entry_size < sizeof(GPT_ENTRY) || header->entry_size > ENTRY_BUFFER_SIZE ||
+        (header->entry_size & (header->entry_size - 1)) != 0)
+        return FALSE;
+    if ((UINT64)header->entry_count * header->entry_size > GPT_MAX_ARRAY_SIZE)
+        return FALSE;
+    
+    // the array must lie on the disk, which also bounds entry_count
+    array_sectors = ((UINT64)header->entry_count * header->entry_size + ctx->disk->sector_size - 1) /
+                    ctx->disk->sector_size;
+    if (header->entry_lba < 2)
+        return FALSE;
+    if (ctx->disk->block_count > 0 && header->entry_lba + array_sectors > ctx->disk->block_count)
+        return FALSE;
+    return TRUE;
+}
+
+// computes the checksum of the entry array described by header
+static UINTN gpt_entries_crc(SCAN_CONTEXT *ctx, GPT_HEADER *header, UINT8 *entry_buffer, UINT32 *crc)
+{
+    UINT64      entry_lba, bytes_left;
+    UINTN       chunk_sectors, chunk_bytes, status;
+    
+    *crc       = 0;
+    entry_lba  = header->entry_lba;
+    bytes_left = (UINT64)header->entry_count * header->entry_size;
+    while (bytes_left > 0) {
+        chunk_sectors = (UINTN)((bytes_left + ctx->disk->sector_size - 1) / ctx->disk->sector_size);
+        if (chunk_sectors > ENTRY_BUFFER_SIZE / ctx->disk->sector_size)
+            chunk_sectors = ENTRY_BUFFER_SIZE / ctx->disk->sector_size;
+        status = disk_read(ctx->disk, entry_lba, chunk_sectors, entry_buffer);
+        if (status != 0)
+            return status;
+        chunk_bytes = chunk_sectors * ctx->disk->sector_size;
+        if (chunk_bytes > bytes_left)
+            chunk_bytes = (UINTN)bytes_left;
+        *crc = crc32_update(*crc, entry_buffer, chunk_bytes);
+        entry_lba  += chunk_sectors;
+        bytes_left -= chunk_bytes;
+    }
+    return 0;
+}
+
+static VOID gpt_compare_field(CHARN *name, UINT64 primary_value, UINT64 backup_value, UINTN *diff_count)
+{
+    if (primary_value == backup_value)
+        return;
+    Print(L" Warning: Backup GPT %s differs: primary %lld, backup %lld\n", name, primary_value, backup_value);
+    (*diff_count)++;
+}
+
+// Validates the backup GPT and compares it with the primary one. With no
+// usable primary header (primary == NULL), it is looked for in the last
+// sector and only its own consistency is reported.
+static UINTN gpt_check_backup(SCAN_CONTEXT *ctx, GPT_HEADER *primary, UINT8 *entry_buffer)
+{
+    GPT_HEADER  *backup;
+    UINT64      last_lba, backup_lba;
+    UINTN       status, diff_count;
+    UINT32      crc;
+    
+    // a sequential device can't come back for the end of the disk
+    if (ctx->disk->block_count == 0 || ctx->disk->sequential)
+        return 0;
+    
+    last_lba   = ctx->disk->block_count - 1;
+    backup_lba = (primary != NULL) ? primary->alternate_header_lba : last_lba;
+    if (backup_lba != last_lba)
+        Print(L" Warning: Backup GPT header is at LBA %lld, not at the end of the disk (LBA %lld)\n",
+              backup_lba, last_lba);
+    if (backup_lba <= 1 || backup_lba > last_lba) {
+        Print(L" Warning: Backup GPT header location is outside the disk\n");
+        return 0;
+    }
+    
+    backup = arena_alloc(&ctx->arena, ctx->disk->sector_size, MAX_SECTOR_SIZE);
+    if (backup == NULL)
+        return 1;
+    status = disk_read(ctx->disk, backup_lba, 1, (UINT8 *)backup);
+    if (status != 0)
+        return status;
+    
+    if (backup->signature != 0x5452415020494645ULL) {
+        Print(L" Warning: No backup GPT header found at LBA %lld\n", backup_lba);
+        return 0;
+    }
+    status = gpt_check_header(ctx, (UINT8 *)backup, &crc);
+    if (status == 1) {
+        Print(L" Warning: Invalid backup GPT header size %d\n", backup->header_size);
+        return 0;
+    } else if (status != 0) {
+        Print(L" Warning: Backup GPT header checksum mismatch (stored %08x, computed %08x)\n",
+              backup->header_crc32, crc);
+        return 0;
+    }
+    if (!gpt_entry_array_valid(ctx, backup)) {
+        Print(L" Warning: Invalid backup GPT entry array (size %d, count %d, LBA %lld)\n",
+              backup->entry_size, backup->entry_count, backup->entry_lba);
+        return 0;
+    }
+    status = gpt_entries_crc(ctx, backup, entry_buffer, &crc);
+    if (status != 0)
+        return status;
+    if (crc != backup->entry_crc32) {
+        Print(L" Warning: Backup GPT partition entry checksum mismatch (stored %08x, computed %08x)\n",
+              backup->entry_crc32, crc);
+        return 0;
+    }
+    
+    if (primary == NULL) {
+        Print(L" The backup GPT at LBA %lld is intact.\n", backup_lba);
+        return 0;
+    }
+    
+    // everything but the location fields must match; equal entry checksums
+    // over two verified arrays mean equal entries
+    diff_count = 0;
+    gpt_compare_field(STR("own location"), backup_lba, backup->header_lba, &diff_count);
+    gpt_compare_field(STR("primary location"), primary->header_lba, backup->alternate_header_lba, &diff_count);
+    gpt_compare_field(STR("revision"), primary->spec_revision, backup->spec_revision, &diff_count);
+    gpt_compare_field(STR("header size"), primary->header_size, backup->header_size, &diff_count);
+    gpt_compare_field(STR("first usable LBA"), primary->first_usable_lba, backup->first_usable_lba, &diff_count);
+    gpt_compare_field(STR("last usable LBA"), primary->last_usable_lba, backup->last_usable_lba, &diff_count);
+    gpt_compare_field(STR("entry count"), primary->entry_count, backup->entry_count, &diff_count);
+    gpt_compare_field(STR("entry size"), primary->entry_size, backup->entry_size, &diff_count);
+    if (!guids_are_equal(primary->disk_guid, backup->disk_guid)) {
+        Print(L" Warning: Backup GPT disk GUID differs\n");
+        diff_count++;
+    }
+    if (primary->entry_crc32 != backup->entry_crc32) {
+        Print(L" Warning: Backup GPT partition entries differ (checksum %08x, primary %08x)\n",
+              backup->entry_crc32, primary->entry_crc32);
+        diff_count++;
+    }
+    if (diff_count > 0)
+        Print(L" The backup GPT at LBA %lld does not match the primary one.\n", backup_lba);
+    
+    return 0;
+}
+
+// Grows the GPT partition store. The old arrays stay in the arena until the
+// scan ends; doubling keeps that waste below the final size.
+static UINTN gpt_parts_grow(SCAN_CONTEXT *ctx)
+{
+    UINTN           capacity;
+    PARTITION_INFO  *parts;
+    UINT64          *start_lbas, *end_lbas;
+    
+    capacity = (ctx->gpt_part_capacity == 0) ? 128 : ctx->gpt_part_capacity * 2;
+    parts      = arena_alloc(&ctx->arena, capacity * sizeof(PARTITION_INFO), 0);
+    start_lbas = arena_alloc(&ctx->arena, capacity * sizeof(UINT64), 0);
+    end_lbas   = arena_alloc(&ctx->arena, capacity * sizeof(UINT64), 0);
+    if (parts == NULL || start_lbas == NULL || end_lbas == NULL)
+        return 1;
+    
+    if (ctx->gpt_part_count > 0) {
+        CopyMem(parts, ctx->gpt_parts, ctx->gpt_part_count * sizeof(PARTITION_INFO));
+        CopyMem(start_lbas, ctx->gpt_start_lbas, ctx->gpt_part_count * sizeof(UINT64));
+        CopyMem(end_lbas, ctx->gpt_end_lbas, ctx->gpt_part_count * sizeof(UINT64));
+    }
+    ctx->gpt_parts         = parts;
+    ctx->gpt_start_lbas    = start_lbas;
+    ctx->gpt_end_lbas      = end_lbas;
+    ctx->gpt_part_capacity = capacity;
+    return 0;
+}
+
+UINTN read_gpt(SCAN_CONTEXT *ctx)
 {
     UINTN       status;
     GPT_HEADER  *header;
     GPT_ENTRY   *entry;
     UINT64      entry_lba;
     UINTN       entry_count, entry_size, i;
+    UINTN       entry_offset, chunk_entries, chunk_sectors;
+    UINT64      sectors_left;
+    UINT32      crc;
+    UINT8       *entry_buffer;
     
     Print(L"\nCurrent GPT partition table:\n");
     
-    // read GPT header
-    status = read_sector(1, sector);
+    // read GPT header, with both copies of the table fetched in one go
+    gpt_prefetch(ctx);
+    status = disk_read(ctx->disk, 1, 1, ctx->sector);
     if (status != 0)
         return status;
     
     // check signature
-    header = (GPT_HEADER *)sector;
+    header = (GPT_HEADER *)ctx->sector;
     if (header->signature != 0x5452415020494645ULL) {
         Print(L" No GPT partition table present!\n");
         return 0;
@@ -272,48 +723,98 @@ UINTN read_gpt(VOID)
     if (header->spec_revision != 0x00010000UL) {
         Print(L" Warning: Unknown GPT spec revision 0x%08x\n", header->spec_revision);
     }
-    if ((512 % header->entry_size) > 0 || header->entry_size > 512) {
-        Print(L" Error: Invalid GPT entry size (misaligned or more than 512 bytes)\n");
+    
+    entry_buffer = arena_alloc(&ctx->arena, ENTRY_BUFFER_SIZE, MAX_SECTOR_SIZE);
+    if (entry_buffer == NULL)
+        return 1;
+    
+    status = gpt_check_header(ctx, ctx->sector, &crc);
+    if (status != 0) {
+        if (status == 1)
+            Print(L" Error: Invalid GPT header size %d\n", header->header_size);
+        else
+            Print(L" Error: GPT header checksum mismatch (stored %08x, computed %08x)\n", header->header_crc32, crc);
+        gpt_check_backup(ctx, NULL, entry_buffer);
+        return 1;
+    }
+    
+    ctx->gpt_backup_lba = header->alternate_header_lba;
+    if (!gpt_entry_array_valid(ctx, header)) {
+        Print(L" Error: Invalid GPT entry array (size %d, count %d, LBA %lld)\n",
+              header->entry_size, header->entry_count, header->entry_lba);
         return 0;
     }
     
-    // read entries
+    // verify the entry array checksum before trusting any entry
+    status = gpt_entries_crc(ctx, header, entry_buffer, &crc);
+    if (status != 0)
+        return status;
+    if (crc != header->entry_crc32) {
+        Print(L" Error: GPT partition entry checksum mismatch (stored %08x, computed %08x)\n",
+              header->entry_crc32, crc);
+        gpt_check_backup(ctx, NULL, entry_buffer);
+        return 1;
+    }
+    
+    status = gpt_check_backup(ctx, header, entry_buffer);
+    if (status != 0)
+        return status;
+    
+    // read entries, the sectors now come from the cache
     entry_lba   = header->entry_lba;
     entry_size  = header->entry_size;
     entry_count = header->entry_count;
     
+    sectors_left  = ((UINT64)entry_count * entry_size + ctx->disk->sector_size - 1) / ctx->disk->sector_size;
+    chunk_entries = 0;
+    entry_offset  = 0;
     for (i = 0; i < entry_count; i++) {
-        if (((i * entry_size) % 512) == 0) {
-            status = read_sector(entry_lba, sector);
+        if (entry_offset >= chunk_entries * entry_size) {
+            // fetch the next run of the entry array in one request
+            chunk_sectors = ENTRY_BUFFER_SIZE / ctx->disk->sector_size;
+            if (sectors_left < chunk_sectors)
+                chunk_sectors = (UINTN)sectors_left;
+            status = disk_read(ctx->disk, entry_lba, chunk_sectors, entry_buffer);
             if (status != 0)
                 return status;
-            entry_lba++;
+            entry_lba     += chunk_sectors;
+            sectors_left  -= chunk_sectors;
+            chunk_entries  = (chunk_sectors * ctx->disk->sector_size) / entry_size;
+            entry_offset   = 0;
         }
-        entry = (GPT_ENTRY *)(sector + ((i * entry_size) % 512));
+        entry = (GPT_ENTRY *)(entry_buffer + entry_offset);
+        entry_offset += entry_size;
         
         if (guids_are_equal(entry->type_guid, empty_guid))
             continue;
-        if (gpt_part_count == 0) {
+        if (ctx->gpt_part_count == 0) {
             Print(L" #      Start LBA      End LBA  Type\n");
         }
+        if (ctx->gpt_part_count == ctx->gpt_part_capacity) {
+            status = gpt_parts_grow(ctx);
+            if (status != 0)
+                return status;
+        }
+        ctx->gpt_start_lbas[ctx->gpt_part_count] = entry->start_lba;
+        ctx->gpt_end_lbas[ctx->gpt_part_count]   = entry->end_lba;
         
-        gpt_parts[gpt_part_count].index     = i;
-        gpt_parts[gpt_part_count].start_lba = entry->start_lba;
-        gpt_parts[gpt_part_count].end_lba   = entry->end_lba;
-        gpt_parts[gpt_part_count].mbr_type  = 0;
-        copy_guid(gpt_parts[gpt_part_count].gpt_type, entry->type_guid);
-        gpt_parts[gpt_part_count].gpt_parttype = gpt_parttype(gpt_parts[gpt_part_count].gpt_type);
-        gpt_parts[gpt_part_count].active    = FALSE;
+        ctx->gpt_parts[ctx->gpt_part_count].index     = i;
+        ctx->gpt_parts[ctx->gpt_part_count].start_lba = entry->start_lba;
+        ctx->gpt_parts[ctx->gpt_part_count].end_lba   = entry->end_lba;
+        ctx->gpt_parts[ctx->gpt_part_count].mbr_type  = 0;
+        copy_guid(ctx->gpt_parts[ctx->gpt_part_count].gpt_type, entry->type_guid);
+        ctx->gpt_parts[ctx->gpt_part_count].gpt_parttype = gpt_parttype(ctx->gpt_parts[ctx->gpt_part_count].gpt_type);
+        ctx->gpt_parts[ctx->gpt_part_count].active    = FALSE;
         
         Print(L" %d   %12lld %12lld  %s\n",
-              gpt_parts[gpt_part_count].index + 1,
-              gpt_parts[gpt_part_count].start_lba,
-              gpt_parts[gpt_part_count].end_lba,
-              gpt_parts[gpt_part_count].gpt_parttype->name);
+              ctx->gpt_parts[ctx->gpt_part_count].index + 1,
+              ctx->gpt_parts[ctx->gpt_part_count].start_lba,
+              ctx->gpt_parts[ctx->gpt_part_count].end_lba,
+              ctx->gpt_parts[ctx->gpt_part_count].gpt_parttype->name);
         
-        gpt_part_count++;
+        ctx->gpt_part_count++;
     }
-    if (gpt_part_count == 0) {
+    if (ctx->gpt_part_count == 0) {
         Print(L" No partitions defined\n");
         return 0;
     }
@@ -321,183 +822,1121 @@ UINTN read_gpt(VOID)
     return 0;
 }
 
+// Sorts the partition indices by start LBA (heap sort, the EFI library has
+// no qsort) and sweeps them once, keeping the furthest end seen so far.
+// Returns TRUE and the two partitions involved if any pair overlaps.
+BOOLEAN gpt_find_overlap(SCAN_CONTEXT *ctx, UINTN *first, UINTN *second)
+{
+    UINT64      *start = ctx->gpt_start_lbas;
+    UINT64      max_end;
+    UINTN       *order, n, i, k, child, root, tmp, max_owner;
+    
+    n = ctx->gpt_part_count;
+    if (n < 2)
+        return FALSE;
+    order = arena_alloc(&ctx->arena, n * sizeof(UINTN), 0);
+    if (order == NULL)
+        return FALSE;
+    for (i = 0; i < n; i++)
+        order[i] = i;
+    
+    // build the heap, then move the maximum to the end repeatedly
+    for (k = n / 2; k-- > 0; ) {
+        for (root = k; (child = 2 * root + 1) < n; root = child) {
+            if (child + 1 < n && start[order[child+1]] > start[order[child]])
+                child++;
+            if (start[order[root]] >= start[order[child]])
+                break;
+            tmp = order[root]; order[root] = order[child]; order[child] = tmp;
+        }
+    }
+    for (i = n - 1; i > 0; i--) {
+        tmp = order[0]; order[0] = order[i]; order[i] = tmp;
+        for (root = 0; (child = 2 * root + 1) < i; root = child) {
+            if (child + 1 < i && start[order[child+1]] > start[order[child]])
+                child++;
+            if (start[order[root]] >= start[order[child]])
+                break;
+            tmp = order[root]; order[root] = order[child]; order[child] = tmp;
+        }
+    }
+    
+    // a partition overlaps an earlier one iff it starts before the furthest end
+    max_owner = order[0];
+    max_end   = ctx->gpt_end_lbas[max_owner];
+    for (i = 1; i < n; i++) {
+        k = order[i];
+        if (start[k] <= max_end) {
+            *first  = max_owner;
+            *second = k;
+            return TRUE;
+        }
+        if (ctx->gpt_end_lbas[k] > max_end) {
+            max_owner = k;
+            max_end   = ctx->gpt_end_lbas[k];
+        }
+    }
+    return FALSE;
+}
+
 //
 // detect file system type
 //
+// Each file system is described by an entry in fs_probes[]: where its
+// superblock lives, how many bytes its check looks at, and the check. The
+// regions actually read are the union of those ranges, so one batch of a
+// few requests serves every probe. A matching check also fills in what the
+// superblock tells about the volume (UUID, label, sizes).
+//
+
+// probe ranges closer than this are read as one region
+#define FS_PROBE_MERGE_GAP  (4096)
 
-UINTN detect_mbrtype_fs(UINT64 partlba, UINTN *parttype, CHARN **fsname)
+// key_offset of probes the recovery scan can't look for cheaply
+#define FS_PROBE_NO_KEY     (0xffff)
+
+typedef struct {
+    UINT32  offset;         // from the partition start
+    UINT32  length;         // bytes the check looks at
+    UINT8   mbr_type;       // result if the check matches, it may refine it
+    CHARN   *name;
+    BOOLEAN (*check)(UINT8 *data, FS_INFO *info);
+    UINT16  key_offset;     // a byte every match has there, from offset
+    UINT8   key[2];         // either value, for the recovery scan
+} FS_PROBE;
+
+static UINT16 fs_get_be16(UINT8 *p)
 {
-    UINTN   status;
-    UINTN   signature, score;
+    return (UINT16)((p[0] << 8) | p[1]);
+}
+
+static UINT32 fs_get_be32(UINT8 *p)
+{
+    return ((UINT32)p[0] << 24) | ((UINT32)p[1] << 16) | ((UINT32)p[2] << 8) | (UINT32)p[3];
+}
+
+static UINT64 fs_get_be64(UINT8 *p)
+{
+    return ((UINT64)fs_get_be32(p) << 32) | (UINT64)fs_get_be32(p + 4);
+}
+
+static CHARN fs_hex_digit(UINTN value, BOOLEAN upper)
+{
+    if (value < 10)
+        return (CHARN)('0' + value);
+    return (CHARN)((upper ? 'A' : 'a') + value - 10);
+}
+
+// 16 raw bytes in text order, as 8-4-4-4-12 hex digits
+static VOID fs_set_uuid(FS_INFO *info, UINT8 *bytes)
+{
+    UINTN   i, pos;
+    
+    for (i = 0, pos = 0; i < 16; i++) {
+        if (i == 4 || i == 6 || i == 8 || i == 10)
+            info->uuid[pos++] = '-';
+        info->uuid[pos++] = fs_hex_digit(bytes[i] >> 4, FALSE);
+        info->uuid[pos++] = fs_hex_digit(bytes[i] & 15, FALSE);
+    }
+    info->uuid[pos] = 0;
+}
+
+// volume serial numbers are shown the way their file systems' tools do:
+// 8 digits split in the middle (FAT, exFAT), otherwise all digits
+static VOID fs_set_serial(FS_INFO *info, UINT64 serial, UINTN digits)
+{
+    UINTN   i, pos;
+    
+    for (i = digits, pos = 0; i-- > 0; ) {
+        info->uuid[pos++] = fs_hex_digit((UINTN)(serial >> (i * 4)) & 15, TRUE);
+        if (digits == 8 && i == 4)
+            info->uuid[pos++] = '-';
+    }
+    info->uuid[pos] = 0;
+}
+
+// copies up to length bytes of text, stopping at NUL, dropping trailing blanks
+static VOID fs_set_text(CHARN *dest, UINTN dest_size, UINT8 *text, UINTN length)
+{
+    UINTN   i;
+    
+    for (i = 0; i < length && i + 1 < dest_size && text[i] != 0; i++)
+        dest[i] = (CHARN)text[i];
+    while (i > 0 && dest[i-1] == ' ')
+        i--;
+    dest[i] = 0;
+}
+
+// UTF-16LE labels, characters outside ASCII become '?'
+static VOID fs_set_label16(FS_INFO *info, UINT8 *text, UINTN chars)
+{
+    UINTN   i;
+    UINT16  c;
+    
+    for (i = 0; i < chars && i + 1 < FS_LABEL_SIZE; i++) {
+        c = (UINT16)(text[i*2] | (text[i*2+1] << 8));
+        if (c == 0)
+            break;
+        info->label[i] = (CHARN)((c < 0x80) ? c : '?');
+    }
+    info->label[i] = 0;
+}
+
+static BOOLEAN fs_check_xfs(UINT8 *data, FS_INFO *info)
+{
+    if (*((UINT32 *)(data)) != 0x42534658)
+        return FALSE;
+    info->block_size = fs_get_be32(data + 4);
+    info->size       = fs_get_be64(data + 8) * info->block_size;
+    fs_set_uuid(info, data + 32);
+    fs_set_text(info->label, FS_LABEL_SIZE, data + 108, 12);
+    return TRUE;
+}
+
+static BOOLEAN fs_check_luks(UINT8 *data, FS_INFO *info)
+{
+    if (CompareMem(data, "LUKS\xba\xbe", 6) != 0)
+        return FALSE;
+    fs_set_text(info->uuid, FS_UUID_SIZE, data + 168, 40);
+    if (fs_get_be16(data + 6) >= 2)
+        fs_set_text(info->label, FS_LABEL_SIZE, data + 24, 48);
+    return TRUE;
+}
+
+static BOOLEAN fs_check_squashfs(UINT8 *data, FS_INFO *info)
+{
+    if (CompareMem(data, "hsqs", 4) != 0)
+        return FALSE;
+    info->block_size = *((UINT32 *)(data + 12));
+    info->size       = *((UINT64 *)(data + 40));
+    return TRUE;
+}
+
+static BOOLEAN fs_check_apfs(UINT8 *data, FS_INFO *info)
+{
+    // container superblock, after the 32-byte object header
+    if (CompareMem(data + 32, "NXSB", 4) != 0)
+        return FALSE;
+    info->block_size = *((UINT32 *)(data + 36));
+    info->size       = *((UINT64 *)(data + 40)) * info->block_size;
+    fs_set_uuid(info, data + 72);
+    return TRUE;
+}
+
+static BOOLEAN fs_check_exfat(UINT8 *data, FS_INFO *info)
+{
+    if (CompareMem(data + 3, "EXFAT   ", 8) != 0)
+        return FALSE;
+    // sectors of 512 bytes to 4 KiB, clusters of at most 32 MiB
+    if (data[108] < 9 || data[108] > 12 || data[109] > 25 - data[108])
+        return FALSE;
+    // the label lives in the root directory, out of reach here
+    info->block_size = (1 << data[108]) << data[109];
+    info->size       = *((UINT64 *)(data + 72)) << data[108];
+    fs_set_serial(info, *((UINT32 *)(data + 100)), 8);
+    return TRUE;
+}
+
+static BOOLEAN fs_check_fat_ntfs(UINT8 *data, FS_INFO *info)
+{
+    UINTN   score;
     UINTN   sectsize, clustersize, reserved, fatcount, dirsize, sectcount, fatsize, clustercount;
+    UINTN   ebpb;
     
-    *fsname = STR("Unknown");
-    *parttype = 0;
+    sectsize = *((UINT16 *)(data + 11));
+    clustersize = data[13];
+    if (sectsize < 512 || (sectsize & (sectsize - 1)) != 0 ||
+        clustersize == 0 || (clustersize & (clustersize - 1)) != 0)
+        return FALSE;
+    // preconditions for both FAT and NTFS are now met
     
-    // READ sector 0 / offset 0K
-    status = read_sector(partlba, sector);
-    if (status != 0)
-        return status;
+    if (CompareMem(data + 3, "NTFS    ", 8) == 0) {
+        // the label is in the $Volume file, out of reach here
+        info->mbr_type   = 0x07;
+        info->name       = STR("NTFS");
+        info->block_size = (UINT32)(sectsize * clustersize);
+        info->size       = *((UINT64 *)(data + 0x28)) * sectsize;
+        fs_set_serial(info, *((UINT64 *)(data + 0x48)), 16);
+        return TRUE;
+    }
     
-    // detect XFS
-    signature = *((UINT32 *)(sector));
-    if (signature == 0x42534658) {
-        *parttype = 0x83;
-        *fsname = STR("XFS");
-        return 0;
+    score = 0;
+    // boot jump
+    if ((data[0] == 0xEB && data[2] == 0x90) || 
+        data[0] == 0xE9)
+        score++;
+    // boot signature
+    if (data[510] == 0x55 && data[511] == 0xAA)
+        score++;
+    // reserved sectors
+    reserved = *((UINT16 *)(data + 14));
+    if (reserved == 1 || reserved == 32)
+        score++;
+    // number of FATs
+    fatcount = data[16];
+    if (fatcount == 2)
+        score++;
+    // number of root dir entries
+    dirsize = *((UINT16 *)(data + 17));
+    // sector count (16-bit and 32-bit versions)
+    sectcount = *((UINT16 *)(data + 19));
+    if (sectcount == 0)
+        sectcount = *((UINT32 *)(data + 32));
+    // media byte
+    if (data[21] == 0xF0 || data[21] >= 0xF8)
+        score++;
+    // FAT size in sectors
+    fatsize = *((UINT16 *)(data + 22));
+    ebpb = 36;      // extended BPB of FAT12/16
+    if (fatsize == 0) {
+        fatsize = *((UINT32 *)(data + 36));
+        ebpb = 64;  // extended BPB of FAT32
     }
     
-    // detect FAT and NTFS
-    sectsize = *((UINT16 *)(sector + 11));
-    clustersize = sector[13];
-    if (sectsize >= 512 && (sectsize & (sectsize - 1)) == 0 &&
-        clustersize > 0 && (clustersize & (clustersize - 1)) == 0) {
-        // preconditions for both FAT and NTFS are now met
-        
-        if (CompareMem(sector + 3, "NTFS    ", 8) == 0) {
-            *parttype = 0x07;
-            *fsname = STR("NTFS");
-            return 0;
-        }
-        
-        score = 0;
-        // boot jump
-        if ((sector[0] == 0xEB && sector[2] == 0x90) || 
-            sector[0] == 0xE9)
-            score++;
-        // boot signature
-        if (sector[510] == 0x55 && sector[511] == 0xAA)
-            score++;
-        // reserved sectors
-        reserved = *((UINT16 *)(sector + 14));
-        if (reserved == 1 || reserved == 32)
-            score++;
-        // number of FATs
-        fatcount = sector[16];
-        if (fatcount == 2)
-            score++;
-        // number of root dir entries
-        dirsize = *((UINT16 *)(sector + 17));
-        // sector count (16-bit and 32-bit versions)
-        sectcount = *((UINT16 *)(sector + 19));
-        if (sectcount == 0)
-            sectcount = *((UINT32 *)(sector + 32));
-        // media byte
-        if (sector[21] == 0xF0 || sector[21] >= 0xF8)
-            score++;
-        // FAT size in sectors
-        fatsize = *((UINT16 *)(sector + 22));
-        if (fatsize == 0)
-            fatsize = *((UINT32 *)(sector + 36));
-        
-        // determine FAT type
-        dirsize = ((dirsize * 32) + (sectsize - 1)) / sectsize;
-        clustercount = sectcount - (reserved + (fatcount * fatsize) + dirsize);
-        clustercount /= clustersize;
-        
-        if (score >= 3) {
-            if (clustercount < 4085) {
-                *parttype = 0x01;
-                *fsname = STR("FAT12");
-            } else if (clustercount < 65525) {
-                *parttype = 0x0e;
-                *fsname = STR("FAT16");
-            } else {
-                *parttype = 0x0c;
-                *fsname = STR("FAT32");
-            }
-            // TODO: check if 0e and 0c are okay to use, maybe we should use 06 and 0b instead...
-            return 0;
-        }
+    // determine FAT type
+    dirsize = ((dirsize * 32) + (sectsize - 1)) / sectsize;
+    clustercount = sectcount - (reserved + (fatcount * fatsize) + dirsize);
+    clustercount /= clustersize;
+    
+    if (score < 3)
+        return FALSE;
+    if (clustercount < 4085) {
+        info->mbr_type = 0x01;
+        info->name = STR("FAT12");
+    } else if (clustercount < 65525) {
+        info->mbr_type = 0x0e;
+        info->name = STR("FAT16");
+    } else {
+        info->mbr_type = 0x0c;
+        info->name = STR("FAT32");
     }
+    // TODO: check if 0e and 0c are okay to use, maybe we should use 06 and 0b instead...
     
-    // READ sector 2 / offset 1K
-    status = read_sector(partlba + 2, sector);
-    if (status != 0)
-        return status;
+    info->block_size = (UINT32)(sectsize * clustersize);
+    info->size       = (UINT64)sectcount * sectsize;
+    // serial and label are only valid with the extended boot signature
+    if (data[ebpb + 2] == 0x29) {
+        fs_set_serial(info, *((UINT32 *)(data + ebpb + 3)), 8);
+        fs_set_text(info->label, FS_LABEL_SIZE, data + ebpb + 7, 11);
+        if (CompareMem(data + ebpb + 7, "NO NAME    ", 11) == 0)
+            info->label[0] = 0;
+    }
+    return TRUE;
+}
+
+static BOOLEAN fs_check_swap(UINT8 *data, FS_INFO *info)
+{
+    // header at 1K, magic in the last 10 bytes of the 4K page
+    if (CompareMem(data + 3062, "SWAPSPACE2", 10) != 0 && CompareMem(data + 3062, "SWAP-SPACE", 10) != 0)
+        return FALSE;
+    if (CompareMem(data + 3062, "SWAPSPACE2", 10) == 0) {
+        // version 1 header; also keeps a 64K-page swap from matching here
+        if (*((UINT32 *)(data)) != 1)
+            return FALSE;
+        info->block_size = 4096;
+        info->size       = ((UINT64)*((UINT32 *)(data + 4)) + 1) * 4096;
+        fs_set_uuid(info, data + 12);
+        fs_set_text(info->label, FS_LABEL_SIZE, data + 28, 16);
+    }
+    return TRUE;
+}
+
+static BOOLEAN fs_check_swap_64k(UINT8 *data, FS_INFO *info)
+{
+    return CompareMem(data, "SWAPSPACE2", 10) == 0 || CompareMem(data, "SWAP-SPACE", 10) == 0;
+}
+
+static BOOLEAN fs_check_hfs(UINT8 *data, FS_INFO *info)
+{
+    UINTN   signature;
     
-    // detect HFS+
-    signature = *((UINT16 *)(sector));
+    signature = *((UINT16 *)(data));
     if (signature == 0x4442) {
-        *parttype = 0xaf;
-        if (*((UINT16 *)(sector + 0x7c)) == 0x2B48)
-            *fsname = STR("HFS Extended (HFS+)");
+        // HFS wrapper; the embedded HFS+ volume header is elsewhere
+        if (fs_get_be32(data + 0x14) == 0 || (fs_get_be32(data + 0x14) & 511) != 0)
+            return FALSE;
+        if (*((UINT16 *)(data + 0x7c)) == 0x2B48)
+            info->name = STR("HFS Extended (HFS+)");
         else
-            *fsname = STR("HFS Standard");
-        return 0;
-    } else if (signature == 0x2B48) {
-        *parttype = 0xaf;
-        *fsname = STR("HFS Extended (HFS+)");
-        return 0;
+            info->name = STR("HFS Standard");
+        return TRUE;
     }
+    if (signature != 0x2B48 && signature != 0x5848)
+        return FALSE;
+    // a two-byte signature is weak, also check version and block size
+    if ((fs_get_be16(data + 2) != 4 && fs_get_be16(data + 2) != 5) ||
+        fs_get_be32(data + 40) < 512 || (fs_get_be32(data + 40) & (fs_get_be32(data + 40) - 1)) != 0)
+        return FALSE;
+    // the volume name is in the catalog file, out of reach here
+    info->block_size = fs_get_be32(data + 40);
+    info->size       = (UINT64)fs_get_be32(data + 44) * info->block_size;
+    if (fs_get_be64(data + 104) != 0)
+        fs_set_serial(info, fs_get_be64(data + 104), 16);
+    return TRUE;
+}
+
+static BOOLEAN fs_check_ext(UINT8 *data, FS_INFO *info)
+{
+    UINT64  blocks;
     
-    // detect ext2/ext3/ext4
-    signature = *((UINT16 *)(sector + 56));
-    if (signature == 0xEF53) {
-        *parttype = 0x83;
-        if (*((UINT16 *)(sector + 96)) & 0x02C0 ||
-            *((UINT16 *)(sector + 100)) & 0x0078)
-            *fsname = STR("ext4");
-        else if (*((UINT16 *)(sector + 92)) & 0x0004)
-            *fsname = STR("ext3");
-        else
-            *fsname = STR("ext2");
-        return 0;
+    if (*((UINT16 *)(data + 56)) != 0xEF53)
+        return FALSE;
+    // a two-byte magic is weak, also check block size and revision
+    if (*((UINT32 *)(data + 24)) > 6 || *((UINT32 *)(data + 76)) > 1)
+        return FALSE;
+    if (*((UINT16 *)(data + 96)) & 0x02C0 ||
+        *((UINT16 *)(data + 100)) & 0x0078)
+        info->name = STR("ext4");
+    else if (*((UINT16 *)(data + 92)) & 0x0004)
+        info->name = STR("ext3");
+    else
+        info->name = STR("ext2");
+    
+    info->block_size = 1024 << *((UINT32 *)(data + 24));
+    blocks = *((UINT32 *)(data + 4));
+    if (*((UINT32 *)(data + 96)) & 0x0080)     // 64bit feature
+        blocks |= (UINT64)*((UINT32 *)(data + 0x150)) << 32;
+    info->size = blocks * info->block_size;
+    fs_set_uuid(info, data + 104);
+    fs_set_text(info->label, FS_LABEL_SIZE, data + 120, 16);
+    return TRUE;
+}
+
+static BOOLEAN fs_check_f2fs(UINT8 *data, FS_INFO *info)
+{
+    if (*((UINT32 *)(data)) != 0xF2F52010)
+        return FALSE;
+    // 4 KiB blocks, or the page size on systems with larger pages
+    if (*((UINT32 *)(data + 16)) < 12 || *((UINT32 *)(data + 16)) > 16)
+        return FALSE;
+    info->block_size = 1 << *((UINT32 *)(data + 16));
+    info->size       = *((UINT64 *)(data + 36)) * info->block_size;
+    fs_set_uuid(info, data + 108);
+    fs_set_label16(info, data + 124, FS_LABEL_SIZE - 1);
+    return TRUE;
+}
+
+static BOOLEAN fs_check_bcachefs(UINT8 *data, FS_INFO *info)
+{
+    // magic after the checksum and version fields; the old bcache magic
+    // is shared with bcache, which has versions below 9
+    if (CompareMem(data + 24, "\xc6\x85\x73\xf6\x66\xce\x90\xa9\xd9\x6a\x60\xcf\x80\x3d\xf7\xef", 16) != 0 &&
+        (CompareMem(data + 24, "\xc6\x85\x73\xf6\x4e\x1a\x45\xca\x82\x65\xf5\x7f\x48\xba\x6d\x81", 16) != 0 ||
+         *((UINT16 *)(data + 16)) < 9))
+        return FALSE;
+    // the size is spread over the member devices, only the block size is here
+    info->block_size = (UINT32)*((UINT16 *)(data + 120)) * 512;
+    fs_set_uuid(info, data + 56);
+    fs_set_text(info->label, FS_LABEL_SIZE, data + 72, 32);
+    return TRUE;
+}
+
+static BOOLEAN fs_check_btrfs(UINT8 *data, FS_INFO *info)
+{
+    if (CompareMem(data + 64, "_BHRfS_M", 8) != 0)
+        return FALSE;
+    info->block_size = *((UINT32 *)(data + 0x90));
+    info->size       = *((UINT64 *)(data + 0x70));
+    fs_set_uuid(info, data + 32);
+    fs_set_text(info->label, FS_LABEL_SIZE, data + 0x12b, 256);
+    return TRUE;
+}
+
+static BOOLEAN fs_check_reiserfs(UINT8 *data, FS_INFO *info)
+{
+    if (CompareMem(data + 52, "ReIsErFs", 8) == 0) {
+        // 3.5 format, no UUID or label
+        info->block_size = *((UINT16 *)(data + 44));
+        info->size       = (UINT64)*((UINT32 *)(data)) * info->block_size;
+        return TRUE;
     }
+    if (CompareMem(data + 52, "ReIsEr2Fs", 9) != 0 && CompareMem(data + 52, "ReIsEr3Fs", 9) != 0)
+        return FALSE;
+    info->block_size = *((UINT16 *)(data + 44));
+    info->size       = (UINT64)*((UINT32 *)(data)) * info->block_size;
+    fs_set_uuid(info, data + 84);
+    fs_set_text(info->label, FS_LABEL_SIZE, data + 100, 16);
+    return TRUE;
+}
+
+static BOOLEAN fs_check_reiser4(UINT8 *data, FS_INFO *info)
+{
+    return CompareMem(data, "ReIsEr4", 7) == 0;
+}
+
+static BOOLEAN fs_check_jfs(UINT8 *data, FS_INFO *info)
+{
+    if (CompareMem(data, "JFS1", 4) != 0)
+        return FALSE;
+    // the size counts device blocks of 512 bytes to 4 KiB (log2 at +28);
+    // the file system block size at +16 is what is shown
+    if (*((UINT16 *)(data + 28)) < 9 || *((UINT16 *)(data + 28)) > 12)
+        return FALSE;
+    info->block_size = *((UINT32 *)(data + 16));
+    info->size       = *((UINT64 *)(data + 8)) << *((UINT16 *)(data + 28));
+    fs_set_uuid(info, data + 136);
+    fs_set_text(info->label, FS_LABEL_SIZE, data + 152, 16);
+    return TRUE;
+}
+
+static BOOLEAN fs_check_zfs_label(UINT8 *data, FS_INFO *info)
+{
+    // vdev label nvlist: XDR encoding, NV_UNIQUE_NAME, first pair "version";
+    // the pool name and GUID would need a full nvlist walk
+    return data[0] == 1 && data[2] == 0 && data[3] == 0 &&
+           CompareMem(data + 4, "\0\0\0\0\0\0\0\x01", 8) == 0 &&
+           CompareMem(data + 20, "\0\0\0\x07version", 11) == 0;
+}
+
+static BOOLEAN fs_check_zfs_uberblock(UINT8 *data, FS_INFO *info)
+{
+    // first uberblock of label 0, in either byte order
+    return *((UINT64 *)(data)) == 0x00bab10cULL || *((UINT64 *)(data)) == 0x0cb1ba0000000000ULL;
+}
+
+// checked in this order, the first match wins
+static FS_PROBE fs_probes[] = {
+    { 0,      120,  0x83, STR("XFS"),      fs_check_xfs,        0,    { 'X', 'X' } },
+    { 0,      208,  0xe8, STR("LUKS"),     fs_check_luks,       0,    { 'L', 'L' } },
+    { 0,      48,   0x83, STR("squashfs"), fs_check_squashfs,   0,    { 'h', 'h' } },
+    { 0,      88,   0xaf, STR("APFS"),     fs_check_apfs,       32,   { 'N', 'N' } },
+    { 0,      110,  0x07, STR("exFAT"),    fs_check_exfat,      3,    { 'E', 'E' } },
+    { 0,      512,  0x00, NULL,            fs_check_fat_ntfs,   510,  { 0x55, 0x55 } },
+    { 1024,   3072, 0x82, STR("Linux swap"), fs_check_swap,     3062, { 'S', 'S' } },
+    { 65526,  10,   0x82, STR("Linux swap"), fs_check_swap_64k, 0,    { 'S', 'S' } },
+    { 1024,   128,  0xaf, STR("HFS Extended (HFS+)"), fs_check_hfs, 0, { 'B', 'H' } },
+    { 1024,   340,  0x83, NULL,            fs_check_ext,        57,   { 0xef, 0xef } },
+    { 1024,   252,  0x83, STR("F2FS"),     fs_check_f2fs,       3,    { 0xf2, 0xf2 } },
+    { 4096,   122,  0x83, STR("bcachefs"), fs_check_bcachefs,   24,   { 0xc6, 0xc6 } },
+    { 65536,  555,  0x83, STR("btrfs"),    fs_check_btrfs,      64,   { '_', '_' } },
+    { 65536,  116,  0x83, STR("ReiserFS"), fs_check_reiserfs,   52,   { 'R', 'R' } },
+    { 65536,  7,    0x83, STR("Reiser4"),  fs_check_reiser4,    0,    { 'R', 'R' } },
+    { 32768,  168,  0x83, STR("JFS"),      fs_check_jfs,        0,    { 'J', 'J' } },
+    { 8192,   116,  0x83, STR("ReiserFS"), fs_check_reiserfs,   52,   { 'R', 'R' } },   // old 3.5 layout
+    { 16384,  31,   0xbf, STR("ZFS"),      fs_check_zfs_label,  24,   { 'v', 'v' } },
+    // both byte orders, nothing in common; the label above finds ZFS too
+    { 131072, 8,    0xbf, STR("ZFS"),      fs_check_zfs_uberblock, FS_PROBE_NO_KEY, { 0, 0 } },
+    { 0, 0, 0, NULL, NULL, 0, { 0, 0 } },
+};
+
+// the regions read for every partition, built from fs_probes[] on first use
+static UINT32   fs_region_offset[FS_PROBE_MAX_REGIONS];
+static UINT32   fs_region_length[FS_PROBE_MAX_REGIONS];
+static UINTN    fs_region_count = 0;
+static UINT8    fs_probe_region_of[sizeof(fs_probes) / sizeof(fs_probes[0])];
+
+static VOID fs_probe_init(VOID)
+{
+    UINTN   order[sizeof(fs_probes) / sizeof(fs_probes[0])];
+    UINTN   count, i, k, probe, region;
+    UINT32  region_offset[FS_PROBE_MAX_REGIONS], region_length[FS_PROBE_MAX_REGIONS];
     
-    // READ sector 128 / offset 64K
-    status = read_sector(partlba + 128, sector);
-    if (status != 0)
-        return status;
+    // sort the probes by offset
+    for (count = 0; fs_probes[count].check != NULL; count++) {
+        probe = count;
+        for (k = count; k > 0 && fs_probes[order[k-1]].offset > fs_probes[probe].offset; k--)
+            order[k] = order[k-1];
+        order[k] = probe;
+    }
     
-    // detect btrfs
-    if (CompareMem(sector + 64, "_BHRfS_M", 8) == 0) {
-        *parttype = 0x83;
-        *fsname = STR("btrfs");
-        return 0;
+    // merge ranges that overlap or lie close together; past the region
+    // limit everything goes into the last region
+    region = 0;
+    for (i = 0; i < count; i++) {
+        probe = order[i];
+        if (i > 0 && (fs_probes[probe].offset <= region_offset[region] + region_length[region] + FS_PROBE_MERGE_GAP ||
+                      region + 1 == FS_PROBE_MAX_REGIONS)) {
+            if (fs_probes[probe].offset + fs_probes[probe].length > region_offset[region] + region_length[region])
+                region_length[region] = fs_probes[probe].offset + fs_probes[probe].length - region_offset[region];
+        } else {
+            if (i > 0)
+                region++;
+            region_offset[region] = fs_probes[probe].offset;
+            region_length[region] = fs_probes[probe].length;
+        }
+        fs_probe_region_of[probe] = (UINT8)region;
     }
     
-    // detect ReiserFS
-    if (CompareMem(sector + 52, "ReIsErFs", 8) == 0 ||
-        CompareMem(sector + 52, "ReIsEr2Fs", 9) == 0 ||
-        CompareMem(sector + 52, "ReIsEr3Fs", 9) == 0) {
-        *parttype = 0x83;
-        *fsname = STR("ReiserFS");
+    CopyMem(fs_region_offset, region_offset, sizeof(region_offset));
+    CopyMem(fs_region_length, region_length, sizeof(region_length));
+    fs_region_count = region + 1;
+}
+
+// number of sectors needed to cover a probe region
+static UINTN fs_probe_sectors(SCAN_CONTEXT *ctx, UINTN region)
+{
+    return ((fs_region_offset[region] % ctx->disk->sector_size) + fs_region_length[region] +
+            ctx->disk->sector_size - 1) / ctx->disk->sector_size;
+}
+
+UINTN fs_probe_size(SCAN_CONTEXT *ctx)
+{
+    UINTN   i, size;
+    
+    if (fs_region_count == 0)
+        fs_probe_init();
+    
+    size = 0;
+    for (i = 0; i < fs_region_count; i++)
+        size += fs_probe_sectors(ctx, i) * ctx->disk->sector_size;
+    return size;
+}
+
+// sectors of a partition the probes may look at: up to its last sector
+// (inclusive) and no further than the end of the disk
+static UINT64 fs_probe_limit(SCAN_CONTEXT *ctx, UINT64 partlba, UINT64 end_lba)
+{
+    UINT64  limit;
+    
+    if (end_lba < partlba)
         return 0;
+    limit = (end_lba == FS_PROBE_NO_END) ? end_lba : end_lba + 1;
+    if (ctx->disk->block_count > 0 && limit > ctx->disk->block_count)
+        limit = ctx->disk->block_count;
+    return (limit > partlba) ? limit - partlba : 0;
+}
+
+// Regions are cut off at the end of the partition and of the disk, so no
+// request can fail the batch it is part of. What is cut off reads as zeros
+// and detect_fs_data() skips the probes that need it.
+UINTN fs_probe_requests(SCAN_CONTEXT *ctx, UINT64 partlba, UINT64 end_lba, UINT8 *buffer, IO_REQUEST *requests)
+{
+    UINTN   i, count, sectors, first, n, offset;
+    UINTN   sector_size = ctx->disk->sector_size;
+    UINT64  available;
+    
+    if (fs_region_count == 0)
+        fs_probe_init();
+    
+    available = fs_probe_limit(ctx, partlba, end_lba);
+    offset = 0;
+    count = 0;
+    for (i = 0; i < fs_region_count; i++) {
+        first   = fs_region_offset[i] / sector_size;
+        sectors = fs_probe_sectors(ctx, i);
+        if (first >= available)
+            n = 0;
+        else
+            n = (available - first < sectors) ? (UINTN)(available - first) : sectors;
+        if (buffer != NULL && n < sectors)
+            ZeroMem(buffer + offset + n * sector_size, (sectors - n) * sector_size);
+        if (n > 0) {
+            requests[count].lba    = partlba + first;
+            requests[count].count  = n;
+            requests[count].buffer = (buffer != NULL) ? buffer + offset : NULL;
+            count++;
+        }
+        offset += sectors * sector_size;
     }
+    return count;
+}
+
+// where the data of a probe ended up in the buffer filled by fs_probe_requests()
+static UINT8 * fs_probe_data(SCAN_CONTEXT *ctx, UINT8 *buffer, UINTN probe)
+{
+    UINTN   i, region;
     
-    // detect Reiser4
-    if (CompareMem(sector, "ReIsEr4", 7) == 0) {
-        *parttype = 0x83;
-        *fsname = STR("Reiser4");
-        return 0;
+    region = fs_probe_region_of[probe];
+    for (i = 0; i < region; i++)
+        buffer += fs_probe_sectors(ctx, i) * ctx->disk->sector_size;
+    return buffer + (fs_region_offset[region] % ctx->disk->sector_size) +
+           (fs_probes[probe].offset - fs_region_offset[region]);
+}
+
+UINTN detect_mbrtype_fs(SCAN_CONTEXT *ctx, UINT64 partlba, UINT64 end_lba, UINTN *parttype, CHARN **fsname)
+{
+    UINTN       status, count;
+    IO_REQUEST  requests[FS_PROBE_MAX_REGIONS];
+    
+    if (ctx->probe_buffer == NULL) {
+        ctx->probe_buffer = arena_alloc(&ctx->arena, fs_probe_size(ctx), MAX_SECTOR_SIZE);
+        if (ctx->probe_buffer == NULL)
+            return 1;
     }
     
-    // READ sector 64 / offset 32K
-    status = read_sector(partlba + 64, sector);
+    // READ all probe regions in one batch
+    count = fs_probe_requests(ctx, partlba, end_lba, ctx->probe_buffer, requests);
+    status = disk_read_batch(ctx->disk, requests, count);
     if (status != 0)
         return status;
     
-    // detect JFS
-    if (CompareMem(sector, "JFS1", 4) == 0) {
-        *parttype = 0x83;
-        *fsname = STR("JFS");
-        return 0;
+    return detect_mbrtype_fs_data(ctx, ctx->probe_buffer, partlba, end_lba, parttype, fsname);
+}
+
+UINTN detect_fs_data(SCAN_CONTEXT *ctx, UINT8 *buffer, UINT64 partlba, UINT64 end_lba, FS_INFO *info)
+{
+    UINTN   i;
+    UINT64  available;
+    
+    if (fs_region_count == 0)
+        fs_probe_init();
+    
+    available = fs_probe_limit(ctx, partlba, end_lba) * ctx->disk->sector_size;
+    for (i = 0; fs_probes[i].check != NULL; i++) {
+        if ((UINT64)fs_probes[i].offset + fs_probes[i].length > available)
+            continue;   // doesn't fit, the data wasn't read
+        ZeroMem(info, sizeof(FS_INFO));
+        info->mbr_type = fs_probes[i].mbr_type;
+        info->name     = fs_probes[i].name;
+        if (fs_probes[i].check(fs_probe_data(ctx, buffer, i), info))
+            return 0;
     }
     
-    // READ sector 16 / offset 8K
-    status = read_sector(partlba + 16, sector);
-    if (status != 0)
-        return status;
+    ZeroMem(info, sizeof(FS_INFO));
+    info->name = STR("Unknown");
+    return 0;
+}
+
+UINTN detect_mbrtype_fs_data(SCAN_CONTEXT *ctx, UINT8 *buffer, UINT64 partlba, UINT64 end_lba,
+                             UINTN *parttype, CHARN **fsname)
+{
+    UINTN   status;
+    FS_INFO info;
     
-    // detect ReiserFS
-    if (CompareMem(sector + 52, "ReIsErFs", 8) == 0 ||
-        CompareMem(sector + 52, "ReIsEr2Fs", 9) == 0 ||
-        CompareMem(sector + 52, "ReIsEr3Fs", 9) == 0) {
-        *parttype = 0x83;
-        *fsname = STR("ReiserFS");
-        return 0;
+    status = detect_fs_data(ctx, buffer, partlba, end_lba, &info);
+    *parttype = info.mbr_type;
+    *fsname   = info.name;
+    return status;
+}
+
+//
+// lookup tables
+//
+
+// Builds the tables that would otherwise be built on first use. The
+// tables are published through plain globals, so this has to run before
+// a second thread is started.
+VOID lib_init(VOID)
+{
+    crc32_init();
+    gpt_type_index_init();
+    fs_probe_init();
+}
+
+//
+// lost partition recovery
+//
+// The recovery scan runs the probes at every sector-aligned position of a
+// disk. For a partition starting at p, probe i finds its key byte at
+// p + offset + key_offset. p is a multiple of the sector size, so that
+// byte is at the same place in every sector: one compare per probe and
+// sector rules out nearly all positions before a full check runs.
+//
+
+#define FS_PROBE_COUNT      (sizeof(fs_probes) / sizeof(fs_probes[0]) - 1)
+
+// fails to compile when a sector could yield more candidates than promised
+typedef char recover_per_sector_check[(FS_PROBE_COUNT <= RECOVER_MAX_PER_SECTOR) ? 1 : -1];
+
+VOID recover_margins(UINTN *before, UINTN *after)
+{
+    UINTN   i;
+    
+    *before = 0;
+    *after  = 0;
+    for (i = 0; i < FS_PROBE_COUNT; i++) {
+        if (fs_probes[i].key_offset == FS_PROBE_NO_KEY)
+            continue;
+        if (fs_probes[i].key_offset > *before)
+            *before = fs_probes[i].key_offset;
+        if (fs_probes[i].length > *after)
+            *after = fs_probes[i].length;
+    }
+}
+
+// Looks at the count sectors at lba for key bytes and checks the
+// partitions they point to. data holds those sectors and stays valid for
+// recover_margins() bytes before and after them (zeros past the ends of
+// the disk). Matches are appended to found; it stops early when fewer than
+// RECOVER_MAX_PER_SECTOR entries are free and returns the sectors done.
+UINTN recover_scan_sectors(UINTN sector_size, UINT64 lba, UINTN count, UINT8 *data,
+                           RECOVER_CANDIDATE *found, UINTN max_found, UINTN *found_count)
+{
+    UINTN               probe[FS_PROBE_COUNT], key_pos[FS_PROBE_COUNT], back[FS_PROBE_COUNT];
+    UINTN               probe_count, i, k, s;
+    UINT8               *sector, byte;
+    RECOVER_CANDIDATE   *candidate;
+    
+    probe_count = 0;
+    for (i = 0; i < FS_PROBE_COUNT; i++) {
+        if (fs_probes[i].key_offset == FS_PROBE_NO_KEY)
+            continue;
+        probe[probe_count]   = i;
+        key_pos[probe_count] = (fs_probes[i].offset + fs_probes[i].key_offset) % sector_size;
+        back[probe_count]    = (fs_probes[i].offset + fs_probes[i].key_offset) / sector_size;
+        probe_count++;
     }
     
+    for (s = 0; s < count; s++) {
+        if (max_found - *found_count < RECOVER_MAX_PER_SECTOR)
+            break;
+        sector = data + s * sector_size;
+        for (k = 0; k < probe_count; k++) {
+            i = probe[k];
+            byte = sector[key_pos[k]];
+            if ((byte != fs_probes[i].key[0] && byte != fs_probes[i].key[1]) || lba + s < back[k])
+                continue;
+            
+            candidate = &found[*found_count];
+            ZeroMem(candidate, sizeof(RECOVER_CANDIDATE));
+            candidate->fs.mbr_type = fs_probes[i].mbr_type;
+            candidate->fs.name     = fs_probes[i].name;
+            if (!fs_probes[i].check(sector + key_pos[k] - fs_probes[i].key_offset, &candidate->fs))
+                continue;
+            candidate->start_lba    = lba + s - back[k];
+            candidate->sector_count = (candidate->fs.size + sector_size - 1) / sector_size;
+            candidate->key_position = (lba + s) * sector_size + key_pos[k];
+            candidate->probe        = i;
+            (*found_count)++;
+        }
+    }
+    return s;
+}
+
+#ifndef CONFIG_EFI
+
+//
+// boot code fingerprints, see bootdb.h
+//
+
+static BOOTDB_ENTRY     *boot_db_entries;
+static UINT32           *boot_db_index;
+static UINTN            boot_db_index_size;
+static CHARN            *boot_db_names;
+
+// Checks a database image (usually a read-only mapping that stays in place)
+// and makes bootcode_fingerprint() use it. Nothing is copied.
+UINTN bootcode_load_db(UINT8 *data, UINTN size)
+{
+    BOOTDB_HEADER   *header = (BOOTDB_HEADER *)data;
+    BOOTDB_ENTRY    *entries;
+    UINT32          *index;
+    CHARN           *names;
+    UINT64          needed;
+    UINTN           i;
+    
+    if (size < sizeof(BOOTDB_HEADER) || CompareMem(header->magic, BOOTDB_MAGIC, 8) != 0 ||
+        header->version != BOOTDB_VERSION) {
+        error("not a boot code database (or an unsupported version)");
+        return 1;
+    }
+    needed = sizeof(BOOTDB_HEADER) + (UINT64)header->entry_count * sizeof(BOOTDB_ENTRY) +
+             (UINT64)header->index_size * sizeof(UINT32) + header->names_size;
+    if (header->index_size == 0 || (header->index_size & (header->index_size - 1)) != 0 ||
+        header->entry_count > header->index_size / 2 || header->names_size == 0 || needed > size) {
+        error("boot code database is damaged (bad sizes)");
+        return 1;
+    }
+    entries = (BOOTDB_ENTRY *)(data + sizeof(BOOTDB_HEADER));
+    index   = (UINT32 *)(entries + header->entry_count);
+    names   = (CHARN *)(index + header->index_size);
+    if (names[header->names_size - 1] != 0) {
+        error("boot code database is damaged (bad name table)");
+        return 1;
+    }
+    for (i = 0; i < header->index_size; i++) {
+        if (index[i] > header->entry_count) {
+            error("boot code database is damaged (bad index)");
+            return 1;
+        }
+    }
+    for (i = 0; i < header->entry_count; i++) {
+        if (entries[i].name_offset >= header->names_size || entries[i].version_offset >= header->names_size) {
+            error("boot code database is damaged (entry %d)", i);
+            return 1;
+        }
+    }
+    
+    boot_db_entries    = entries;
+    boot_db_index      = index;
+    boot_db_index_size = header->index_size;
+    boot_db_names      = names;
     return 0;
 }
+
+// Hashes the code region of a boot sector and looks it up in the loaded
+// database. Returns FALSE if there is no database; otherwise *name and
+// *version are the matching loader, or NULL if the code is not known.
+BOOLEAN bootcode_fingerprint(UINT8 *sector, BOOLEAN is_mbr, UINT64 *hash, CHARN **name, CHARN **version)
+{
+    UINTN           start, end, slot;
+    BOOTDB_ENTRY    *entry;
+    
+    if (boot_db_index == NULL)
+        return FALSE;
+    
+    bootdb_code_region(sector, is_mbr, &start, &end);
+    *hash    = bootdb_hash(sector + start, end - start);
+    *name    = NULL;
+    *version = NULL;
+    for (slot = (UINTN)*hash & (boot_db_index_size - 1); boot_db_index[slot] != 0;
+         slot = (slot + 1) & (boot_db_index_size - 1)) {
+        entry = &boot_db_entries[boot_db_index[slot] - 1];
+        if (entry->hash == *hash) {
+            *name    = boot_db_names + entry->name_offset;
+            *version = boot_db_names + entry->version_offset;
+            break;
+        }
+    }
+    return TRUE;
+}
+
+#endif
+
+//
+// partition contents
+//
+// Tells apart ranges that were never written (the backend reports nothing
+// allocated), ranges that hold only zeros and ranges with data. Allocated
+// runs are read in large batched chunks around the sector cache and
+// checked block by block, stopping at the first block that is not zero.
+//
+
+#if defined(__SSE2__)
+#include <emmintrin.h>
+#elif defined(__ARM_NEON) && defined(__aarch64__)
+#include <arm_neon.h>
+#endif
+
+// chunks of this size are read in batches of CONTENTS_CHUNKS
+#define CONTENTS_CHUNK_SIZE (1024*1024)
+#define CONTENTS_CHUNKS     (8)
+// granularity of the zero test, a multiple of 64
+#define CONTENTS_BLOCK_SIZE (4096)
+
+// TRUE if all length bytes are zero; data is 16-byte aligned and length a
+// multiple of 64, both hold for sector buffers from alloc_io_buffer()
+static BOOLEAN is_zero(UINT8 *data, UINTN length)
+{
+    UINTN       i;
+#if defined(__SSE2__)
+    __m128i     acc = _mm_setzero_si128();
+    
+    for (i = 0; i < length; i += 64) {
+        acc = _mm_or_si128(acc, _mm_or_si128(_mm_load_si128((__m128i *)(data + i)),
+                                             _mm_load_si128((__m128i *)(data + i + 16))));
+        acc = _mm_or_si128(acc, _mm_or_si128(_mm_load_si128((__m128i *)(data + i + 32)),
+                                             _mm_load_si128((__m128i *)(data + i + 48))));
+    }
+    return _mm_movemask_epi8(_mm_cmpeq_epi8(acc, _mm_setzero_si128())) == 0xffff;
+#elif defined(__ARM_NEON) && defined(__aarch64__)
+    uint8x16_t  acc = vdupq_n_u8(0);
+    
+    for (i = 0; i < length; i += 64) {
+        acc = vorrq_u8(acc, vorrq_u8(vld1q_u8(data + i), vld1q_u8(data + i + 16)));
+        acc = vorrq_u8(acc, vorrq_u8(vld1q_u8(data + i + 32), vld1q_u8(data + i + 48)));
+    }
+    return vmaxvq_u8(acc) == 0;
+#else
+    UINT64      acc = 0, *words = (UINT64 *)data;
+    
+    for (i = 0; i < length / 8; i += 8)
+        acc |= words[i] | words[i+1] | words[i+2] | words[i+3] |
+               words[i+4] | words[i+5] | words[i+6] | words[i+7];
+    return acc == 0;
+#endif
+}
+
+// Classifies the sectors start_lba to end_lba (inclusive, as in partition
+// tables) into CONTENTS_*. For CONTENTS_DATA, *data_lba is the first sector
+// that is not zero. The part of the range beyond the end of the disk is
+// left out.
+UINTN scan_contents(SCAN_CONTEXT *ctx, UINT64 start_lba, UINT64 end_lba, UINTN *contents, UINT64 *data_lba)
+{
+    DISK_DEVICE *disk = ctx->raw_disk;
+    UINTN       sector_size = disk->sector_size;
+    UINTN       chunk_sectors, block_sectors, count, i, k, n, status;
+    UINT64      lba, run_start, run_end, next;
+    IO_REQUEST  requests[CONTENTS_CHUNKS];
+    UINT8       *buffer;
+    
+    if (disk->sequential) {
+        error("Checking partition contents needs a seekable device");
+        return 1;
+    }
+    end_lba++;
+    if (disk->block_count > 0 && end_lba > disk->block_count)
+        end_lba = disk->block_count;
+    
+    chunk_sectors = CONTENTS_CHUNK_SIZE / sector_size;
+    block_sectors = (sector_size < CONTENTS_BLOCK_SIZE) ? CONTENTS_BLOCK_SIZE / sector_size : 1;
+    buffer = alloc_io_buffer(CONTENTS_CHUNKS * chunk_sectors * sector_size);
+    if (buffer == NULL) {
+        error("Out of memory");
+        return 1;
+    }
+    
+    *contents = CONTENTS_SPARSE;
+    for (lba = start_lba; lba < end_lba; lba = run_end) {
+        status = disk_find_data(disk, lba, end_lba, &run_start, &run_end);
+        if (status != 0)
+            goto done;
+        if (run_start >= end_lba)
+            break;
+        *contents = CONTENTS_ZERO;
+        
+        for (next = run_start; next < run_end; ) {
+            for (count = 0; count < CONTENTS_CHUNKS && next < run_end; count++) {
+                requests[count].lba    = next;
+                requests[count].count  = (run_end - next < chunk_sectors) ? (UINTN)(run_end - next) : chunk_sectors;
+                requests[count].buffer = buffer + count * chunk_sectors * sector_size;
+                next += requests[count].count;
+            }
+            status = disk_read_batch(disk, requests, count);
+            if (status != 0)
+                goto done;
+            
+            for (i = 0; i < count; i++) {
+                for (k = 0; k < requests[i].count; k += n) {
+                    n = (requests[i].count - k < block_sectors) ? requests[i].count - k : block_sectors;
+                    if (is_zero(requests[i].buffer + k * sector_size, n * sector_size))
+                        continue;
+                    // narrow it down to the sector
+                    while (is_zero(requests[i].buffer + k * sector_size, sector_size))
+                        k++;
+                    *contents = CONTENTS_DATA;
+                    *data_lba = requests[i].lba + k;
+                    goto done;
+                }
+            }
+        }
+    }
+    status = 0;
+    
+done:
+    free_io_buffer(buffer);
+    return status;
+}
+
+//
+// I/O planning
+//
+
+// on rotational media, runs closer than this are merged into one read
+#define PLAN_MERGE_GAP      (262144)
+// upper bound for a single merged read
+#define PLAN_MAX_RUN        (262144)
+// at most this much is prefetched, so the data stays in the sector cache
+#define PLAN_MAX_TOTAL      (SECTOR_CACHE_SIZE / 2)
+
+static UINTN plan_add_partition(SCAN_CONTEXT *ctx, IO_REQUEST *plan, UINTN plan_count, PARTITION_INFO *part)
+{
+    return plan_count + fs_probe_requests(ctx, part->start_lba, part->end_lba, NULL, plan + plan_count);
+}
+
+// Collects every sector the later stages will look at (boot sectors, file
+// system probe regions, backup GPT header), merges them into as few reads
+// as possible and runs those through the sector cache. Without all_parts,
+// only the GPT partitions gptsync looks into (Basic Data and ESP) are
+// planned. Read errors are left for the real reads to report.
+VOID plan_reads(SCAN_CONTEXT *ctx, BOOLEAN all_parts)
+{
+    IO_REQUEST  *plan, req;
+    UINTN       plan_count, run_count, i, k;
+    UINTN       sector_size = ctx->disk->sector_size;
+    UINTN       merge_gap, max_run, total;
+    UINT64      end_lba;
+    BOOLEAN     is_dupe;
+    UINT8       *buffer;
+    
+    plan = arena_alloc(&ctx->arena, (2 + (ctx->gpt_part_count + ctx->mbr_part_count) * FS_PROBE_MAX_REGIONS) *
+                       sizeof(IO_REQUEST), 0);
+    if (plan == NULL)
+        return;
+    
+    // MBR boot sector, backup GPT header, probe regions of all partitions
+    plan_count = 0;
+    plan[plan_count].lba   = 0;
+    plan[plan_count].count = 1;
+    plan_count++;
+    if (ctx->gpt_backup_lba > 1) {
+        plan[plan_count].lba   = ctx->gpt_backup_lba;
+        plan[plan_count].count = 1;
+        plan_count++;
+    }
+    for (i = 0; i < ctx->gpt_part_count; i++) {
+        if (!all_parts && ctx->gpt_parts[i].gpt_parttype->kind != GPT_KIND_BASIC_DATA &&
+            ctx->gpt_parts[i].gpt_parttype->mbr_type != 0xef)
+            continue;
+        plan_count = plan_add_partition(ctx, plan, plan_count, &ctx->gpt_parts[i]);
+    }
+    for (i = 0; i < ctx->mbr_part_count && all_parts; i++) {
+        if (ctx->mbr_parts[i].start_lba == 1 && ctx->mbr_parts[i].mbr_type == 0xee)
+            continue;   // skip EFI Protective entry
+        
+        is_dupe = FALSE;
+        for (k = 0; k < ctx->gpt_part_count; k++)
+            if (ctx->gpt_parts[k].start_lba == ctx->mbr_parts[i].start_lba)
+                is_dupe = TRUE;
+        
+        if (!is_dupe)
+            plan_count = plan_add_partition(ctx, plan, plan_count, &ctx->mbr_parts[i]);
+    }
+    
+    // drop anything beyond the end of the device, the real reads will complain
+    if (ctx->disk->block_count > 0) {
+        for (i = 0, k = 0; i < plan_count; i++)
+            if (plan[i].lba + plan[i].count <= ctx->disk->block_count)
+                plan[k++] = plan[i];
+        plan_count = k;
+    }
+    
+    // sort by LBA; partitions are usually listed in disk order, so insertion
+    // sort is close to linear here
+    for (i = 1; i < plan_count; i++) {
+        req = plan[i];
+        for (k = i; k > 0 && plan[k-1].lba > req.lba; k--)
+            plan[k] = plan[k-1];
+        plan[k] = req;
+    }
+    
+    // merge overlapping and adjacent requests; on rotational media also
+    // bridge small gaps, reading a few extra sectors is cheaper than a seek
+    merge_gap = (ctx->disk->rotational && !ctx->disk->sequential) ? PLAN_MERGE_GAP / sector_size : 0;
+    max_run   = PLAN_MAX_RUN / sector_size;
+    run_count = 0;
+    for (i = 0; i < plan_count; i++) {
+        if (run_count > 0) {
+            end_lba = plan[run_count-1].lba + plan[run_count-1].count;
+            if (plan[i].lba <= end_lba + merge_gap &&
+                plan[i].lba + plan[i].count - plan[run_count-1].lba <= max_run) {
+                if (plan[i].lba + plan[i].count > end_lba)
+                    plan[run_count-1].count = (UINTN)(plan[i].lba + plan[i].count - plan[run_count-1].lba);
+                continue;
+            }
+        }
+        plan[run_count++] = plan[i];
+    }
+    
+    // the prefetch is only a hint, trim it to what the cache can hold;
+    // a sequential device can't go back, so there it is the only chance
+    total = 0;
+    for (i = 0; i < run_count; i++) {
+        if (total + plan[i].count > PLAN_MAX_TOTAL / sector_size && !ctx->disk->sequential)
+            break;
+        total += plan[i].count;
+    }
+    run_count = i;
+    if (run_count == 0)
+        return;
+    
+    buffer = alloc_io_buffer(total * sector_size);
+    if (buffer == NULL)
+        return;
+    for (i = 0, k = 0; i < run_count; i++) {
+        plan[i].buffer = buffer + k * sector_size;
+        k += plan[i].count;
+    }
+    
+    if (ctx->disk->rotational || ctx->disk->sequential) {
+        // one sweep across the disk in ascending order
+        for (i = 0; i < run_count; i++)
+            if (disk_read(ctx->disk, plan[i].lba, plan[i].count, plan[i].buffer) != 0)
+                break;
+    } else {
+        // no seek penalty, let the device work on all runs at once
+        disk_read_batch(ctx->disk, plan, run_count);
+    }
+    
+    free_io_buffer(buffer);
+}
@@ -0,0 +1,271 @@
+/*
+ * gptsync/mkbootdb.c
+ * Builds a boot code database from a directory of known boot sectors
+ *
+ * Copyright (c) 2006 Christoph Pfisterer
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are
+ * met:
+ *
+ *  * Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ *
+ *  * Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the
+ *    distribution.
+ *
+ *  * Neither the name of Christoph Pfisterer nor the names of the
+ *    contributors may be used to endorse or promote products derived
+ *    from this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+ * A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT
+ * OWNER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+ * SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT
+ * LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+ * DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+ * THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+ * OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+//
+// Usage: mkbootdb DIRECTORY OUTPUT
+//
+// DIRECTORY holds one subdirectory per loader, named after it, with one
+// sector dump per known version of its boot code:
+//
+//   bootcode/GRUB/2.06.mbr
+//   bootcode/Windows/7.mbr
+//   bootcode/Windows/7.vbr
+//
+// The file name without its .mbr or .vbr suffix is the version; the suffix
+// tells whether the sector is a master boot record or a volume boot record,
+// which have their code in different places (see bootdb_code_region). Each
+// file is a raw copy of at least the first 512 bytes of the sector, e.g.
+// from dd if=/dev/sda bs=512 count=1. Builds on its own:
+//
+//   cc -o mkbootdb mkbootdb.c
+//
+// The output is written in host byte order; like the rest of gptsync this
+// assumes a little-endian host.
+//
+
+#include "gptsync.h"
+#include "bootdb.h"
+
+#include <dirent.h>
+
+#define MAX_ENTRIES     (65536)
+#define MAX_PATH        (4096)
+
+static BOOTDB_ENTRY entries[MAX_ENTRIES];
+static UINTN        entry_count;
+static char         *names;
+static UINTN        names_size, names_capacity;
+
+static int add_name(char *name, UINT32 *offset)
+{
+    UINTN   length = strlen(name) + 1;
+    char    *grown;
+    
+    while (names_size + length > names_capacity) {
+        names_capacity = names_capacity ? names_capacity * 2 : 4096;
+        grown = realloc(names, names_capacity);
+        if (grown == NULL) {
+            fprintf(stderr, "mkbootdb: out of memory\n");
+            return 1;
+        }
+        names = grown;
+    }
+    CopyMem(names + names_size, name, length);
+    *offset = (UINT32)names_size;
+    names_size += length;
+    return 0;
+}
+
+static int visible(const struct dirent *d)
+{
+    return d->d_name[0] != '.';
+}
+
+static int add_sector(char *path, char *loader, char *filename)
+{
+    FILE            *f;
+    UINT8           sector[512];
+    char            version[MAX_PATH];
+    UINTN           length, start, end, k;
+    BOOLEAN         is_mbr;
+    UINT64          hash;
+    BOOTDB_ENTRY    *entry;
+    
+    length = strlen(filename);
+    if (length > 4 && strcmp(filename + length - 4, ".mbr") == 0)
+        is_mbr = TRUE;
+    else if (length > 4 && strcmp(filename + length - 4, ".vbr") == 0)
+        is_mbr = FALSE;
+    else {
+        fprintf(stderr, "%s: not a .mbr or .vbr file, skipped\n", path);
+        return 0;
+    }
+    snprintf(version, sizeof(version), "%.*s", (int)(length - 4), filename);
+    
+    f = fopen(path, "rb");
+    if (f == NULL) {
+        fprintf(stderr, "mkbootdb: can't open %s: %s\n", path, strerror(errno));
+        return 1;
+    }
+    length = fread(sector, 1, 512, f);
+    fclose(f);
+    if (length != 512 || sector[510] != 0x55 || sector[511] != 0xaa) {
+        fprintf(stderr, "%s: not a boot sector\n", path);
+        return 1;
+    }
+    
+    bootdb_code_region(sector, is_mbr, &start, &end);
+    hash = bootdb_hash(sector + start, end - start);
+    for (k = 0; k < entry_count; k++) {
+        if (entries[k].hash != hash)
+            continue;
+        if (strcmp(names + entries[k].name_offset, loader) == 0 &&
+            strcmp(names + entries[k].version_offset, version) == 0)
+            return 0;   // the same code filed twice
+        fprintf(stderr, "%s: same code as %s %s\n", path,
+                names + entries[k].name_offset, names + entries[k].version_offset);
+        return 1;
+    }
+    if (entry_count >= MAX_ENTRIES) {
+        fprintf(stderr, "%s: more than %d entries\n", path, MAX_ENTRIES);
+        return 1;
+    }
+    
+    entry = &entries[entry_count];
+    entry->hash = hash;
+    if (add_name(loader, &entry->name_offset) != 0 || add_name(version, &entry->version_offset) != 0)
+        return 1;
+    entry_count++;
+    return 0;
+}
+
+// walks the directory in sorted order, so the same input gives the same file
+static int scan_directory(char *dirname)
+{
+    struct dirent   **loaders, **files;
+    int             loader_count, file_count, i, k, status;
+    char            path[MAX_PATH];
+    struct stat     sb;
+    
+    loader_count = scandir(dirname, &loaders, visible, alphasort);
+    if (loader_count < 0) {
+        fprintf(stderr, "mkbootdb: can't read %s: %s\n", dirname, strerror(errno));
+        return 1;
+    }
+    
+    status = 0;
+    for (i = 0; i < loader_count && status == 0; i++) {
+        snprintf(path, sizeof(path), "%s/%s", dirname, loaders[i]->d_name);
+        if (stat(path, &sb) != 0 || !S_ISDIR(sb.st_mode))
+            continue;
+        file_count = scandir(path, &files, visible, alphasort);
+        if (file_count < 0) {
+            fprintf(stderr, "mkbootdb: can't read %s: %s\n", path, strerror(errno));
+            status = 1;
+            break;
+        }
+        for (k = 0; k < file_count; k++) {
+            if (status == 0) {
+                snprintf(path, sizeof(path), "%s/%s/%s", dirname, loaders[i]->d_name, files[k]->d_name);
+                status = add_sector(path, loaders[i]->d_name, files[k]->d_name);
+            }
+            free(files[k]);
+        }
+        free(files);
+    }
+    
+    for (i = 0; i < loader_count; i++)
+        free(loaders[i]);
+    free(loaders);
+    return status;
+}
+
+static int write_db(char *filename)
+{
+    BOOTDB_HEADER   header;
+    UINT32          *index;
+    UINTN           index_size, i, slot;
+    char            tmpname[MAX_PATH];
+    FILE            *f;
+    int             ok;
+    
+    // keep the index at most half full
+    for (index_size = 16; index_size < 2 * entry_count; index_size *= 2)
+        ;
+    index = calloc(index_size, sizeof(UINT32));
+    if (index == NULL) {
+        fprintf(stderr, "mkbootdb: out of memory\n");
+        return 1;
+    }
+    for (i = 0; i < entry_count; i++) {
+        for (slot = (UINTN)entries[i].hash & (index_size - 1); index[slot] != 0;
+             slot = (slot + 1) & (index_size - 1))
+            ;
+        index[slot] = (UINT32)(i + 1);
+    }
+    
+    ZeroMem(&header, sizeof(header));
+    CopyMem(header.magic, BOOTDB_MAGIC, 8);
+    header.version     = BOOTDB_VERSION;
+    header.entry_count = (UINT32)entry_count;
+    header.index_size  = (UINT32)index_size;
+    header.names_size  = (UINT32)names_size;
+    
+    // write next to the target and rename, readers never see a partial file
+    snprintf(tmpname, sizeof(tmpname), "%s.tmp", filename);
+    f = fopen(tmpname, "wb");
+    if (f == NULL) {
+        fprintf(stderr, "mkbootdb: can't create %s: %s\n", tmpname, strerror(errno));
+        free(index);
+        return 1;
+    }
+    ok = fwrite(&header, sizeof(header), 1, f) == 1 &&
+         (entry_count == 0 || fwrite(entries, sizeof(BOOTDB_ENTRY), entry_count, f) == entry_count) &&
+         fwrite(index, sizeof(UINT32), index_size, f) == index_size &&
+         (names_size == 0 || fwrite(names, 1, names_size, f) == names_size);
+    if (fclose(f) != 0)
+        ok = 0;
+    free(index);
+    if (!ok || rename(tmpname, filename) != 0) {
+        fprintf(stderr, "mkbootdb: can't write %s: %s\n", filename, strerror(errno));
+        unlink(tmpname);
+        return 1;
+    }
+    return 0;
+}
+
+int main(int argc, char *argv[])
+{
+    UINT32  offset;
+    
+    if (argc != 3) {
+        fprintf(stderr, "Usage: mkbootdb DIRECTORY OUTPUT\n");
+        return 1;
+    }
+    
+    if (scan_directory(argv[1]) != 0)
+        return 1;
+    // the loader needs a non-empty name table
+    if (names_size == 0 && add_name("", &offset) != 0)
+        return 1;
+    if (write_db(argv[2]) != 0)
+        return 1;
+    
+    printf("%s: %d boot sectors\n", argv[2], (int)entry_count);
+    return 0;
+}
+
+/* EOF */
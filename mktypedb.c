@@ -0,0 +1,276 @@
+/*
+ * gptsync/mktypedb.c
+ * Compiles a text list of partition types into a type database
+ *
+ * Copyright (c) 2006 Christoph Pfisterer
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are
+ * met:
+ *
+ *  * Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ *
+ *  * Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the
+ *    distribution.
+ *
+ *  * Neither the name of Christoph Pfisterer nor the names of the
+ *    contributors may be used to endorse or promote products derived
+ *    from this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+ * A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT
+ * OWNER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+ * SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT
+ * LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+ * DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+ * THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+ * OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+//
+// Usage: mktypedb SOURCE OUTPUT
+//
+// Each non-empty line of SOURCE that does not start with '#' describes one
+// GPT partition type:
+//
+//   GUID                                  MBR  KIND        NAME
+//   0FC63DAF-8483-4772-8E79-3D69D8477DE4  83   data        Linux Filesystem
+//
+// MBR is the hexadecimal type used for the hybrid MBR (00 for none), KIND
+// is one of system, data, basic-data or fatal (see GPT_KIND_* in
+// gptsync.h), NAME is the rest of the line. Builds on its own:
+//
+//   cc -o mktypedb mktypedb.c
+//
+// The output is written in host byte order; like the rest of gptsync this
+// assumes a little-endian host.
+//
+
+#include "gptsync.h"
+#include "typedb.h"
+
+#define MAX_TYPES       (65536)
+#define MAX_LINE        (1024)
+
+static TYPEDB_ENTRY entries[MAX_TYPES];
+static UINTN        entry_count;
+static char         *names;
+static UINTN        names_size, names_capacity;
+
+static struct {
+    char    *word;
+    UINT8   kind;
+} kinds[] = {
+    { "system",     GPT_KIND_SYSTEM },
+    { "data",       GPT_KIND_DATA },
+    { "basic-data", GPT_KIND_BASIC_DATA },
+    { "fatal",      GPT_KIND_FATAL },
+    { NULL, 0 },
+};
+
+static int hex_value(char c)
+{
+    if (c >= '0' && c <= '9')
+        return c - '0';
+    if (c >= 'a' && c <= 'f')
+        return c - 'a' + 10;
+    if (c >= 'A' && c <= 'F')
+        return c - 'A' + 10;
+    return -1;
+}
+
+// parses the text form of a GUID into on-disk byte order
+static int parse_guid(char *text, UINT8 *guid)
+{
+    // the first three fields are stored little-endian
+    static const int order[16] = { 3, 2, 1, 0, 5, 4, 7, 6, 8, 9, 10, 11, 12, 13, 14, 15 };
+    int              i, pos, high, low;
+    
+    if (strlen(text) != 36 || text[8] != '-' || text[13] != '-' || text[18] != '-' || text[23] != '-')
+        return 1;
+    for (i = 0, pos = 0; i < 16; i++, pos += 2) {
+        if (text[pos] == '-')
+            pos++;
+        high = hex_value(text[pos]);
+        low  = hex_value(text[pos+1]);
+        if (high < 0 || low < 0)
+            return 1;
+        guid[order[i]] = (UINT8)((high << 4) | low);
+    }
+    return 0;
+}
+
+static int add_name(char *name, UINT32 *offset)
+{
+    UINTN   length = strlen(name) + 1;
+    char    *grown;
+    
+    while (names_size + length > names_capacity) {
+        names_capacity = names_capacity ? names_capacity * 2 : 4096;
+        grown = realloc(names, names_capacity);
+        if (grown == NULL) {
+            fprintf(stderr, "mktypedb: out of memory\n");
+            return 1;
+        }
+        names = grown;
+    }
+    CopyMem(names + names_size, name, length);
+    *offset = (UINT32)names_size;
+    names_size += length;
+    return 0;
+}
+
+static int parse_source(char *filename)
+{
+    FILE            *f;
+    char            line[MAX_LINE], guid_text[64], mbr_text[16], kind_text[32];
+    int             line_number, name_start, i;
+    unsigned int    mbr_type;
+    char            *name, *end;
+    TYPEDB_ENTRY    *entry;
+    UINTN           k;
+    
+    f = fopen(filename, "r");
+    if (f == NULL) {
+        fprintf(stderr, "mktypedb: can't open %s: %s\n", filename, strerror(errno));
+        return 1;
+    }
+    
+    for (line_number = 1; fgets(line, MAX_LINE, f) != NULL; line_number++) {
+        end = line + strlen(line);
+        while (end > line && (end[-1] == '\n' || end[-1] == '\r' || end[-1] == ' ' || end[-1] == '\t'))
+            *--end = 0;
+        for (name = line; *name == ' ' || *name == '\t'; name++)
+            ;
+        if (*name == 0 || *name == '#')
+            continue;
+        
+        name_start = 0;
+        if (sscanf(name, "%63s %15s %31s %n", guid_text, mbr_text, kind_text, &name_start) != 3 ||
+            name_start == 0 || name[name_start] == 0) {
+            fprintf(stderr, "%s:%d: expected GUID, MBR type, kind and name\n", filename, line_number);
+            goto fail;
+        }
+        if (entry_count >= MAX_TYPES) {
+            fprintf(stderr, "%s:%d: more than %d types\n", filename, line_number, MAX_TYPES);
+            goto fail;
+        }
+        
+        entry = &entries[entry_count];
+        if (parse_guid(guid_text, entry->guid) != 0) {
+            fprintf(stderr, "%s:%d: invalid GUID '%s'\n", filename, line_number, guid_text);
+            goto fail;
+        }
+        if (sscanf(mbr_text, "%x", &mbr_type) != 1 || mbr_type > 0xff) {
+            fprintf(stderr, "%s:%d: invalid MBR type '%s'\n", filename, line_number, mbr_text);
+            goto fail;
+        }
+        entry->mbr_type = (UINT8)mbr_type;
+        for (i = 0; kinds[i].word; i++)
+            if (strcmp(kinds[i].word, kind_text) == 0)
+                break;
+        if (kinds[i].word == NULL) {
+            fprintf(stderr, "%s:%d: unknown kind '%s'\n", filename, line_number, kind_text);
+            goto fail;
+        }
+        entry->kind = kinds[i].kind;
+        for (k = 0; k < entry_count; k++) {
+            if (guids_are_equal(entries[k].guid, entry->guid)) {
+                fprintf(stderr, "%s:%d: duplicate GUID %s\n", filename, line_number, guid_text);
+                goto fail;
+            }
+        }
+        if (add_name(name + name_start, &entry->name_offset) != 0)
+            goto fail;
+        entry_count++;
+    }
+    
+    fclose(f);
+    return 0;
+    
+fail:
+    fclose(f);
+    return 1;
+}
+
+static int write_db(char *filename)
+{
+    TYPEDB_HEADER   header;
+    UINT32          *index;
+    UINTN           index_size, i, slot;
+    char            tmpname[4096];
+    FILE            *f;
+    int             ok;
+    
+    // keep the index at most half full
+    for (index_size = 16; index_size < 2 * entry_count; index_size *= 2)
+        ;
+    index = calloc(index_size, sizeof(UINT32));
+    if (index == NULL) {
+        fprintf(stderr, "mktypedb: out of memory\n");
+        return 1;
+    }
+    for (i = 0; i < entry_count; i++) {
+        for (slot = typedb_guid_hash(entries[i].guid) & (index_size - 1); index[slot] != 0;
+             slot = (slot + 1) & (index_size - 1))
+            ;
+        index[slot] = (UINT32)(i + 1);
+    }
+    
+    ZeroMem(&header, sizeof(header));
+    CopyMem(header.magic, TYPEDB_MAGIC, 8);
+    header.version     = TYPEDB_VERSION;
+    header.entry_count = (UINT32)entry_count;
+    header.index_size  = (UINT32)index_size;
+    header.names_size  = (UINT32)names_size;
+    
+    // write next to the target and rename, readers never see a partial file
+    snprintf(tmpname, sizeof(tmpname), "%s.tmp", filename);
+    f = fopen(tmpname, "wb");
+    if (f == NULL) {
+        fprintf(stderr, "mktypedb: can't create %s: %s\n", tmpname, strerror(errno));
+        free(index);
+        return 1;
+    }
+    ok = fwrite(&header, sizeof(header), 1, f) == 1 &&
+         (entry_count == 0 || fwrite(entries, sizeof(TYPEDB_ENTRY), entry_count, f) == entry_count) &&
+         fwrite(index, sizeof(UINT32), index_size, f) == index_size &&
+         (names_size == 0 || fwrite(names, 1, names_size, f) == names_size);
+    if (fclose(f) != 0)
+        ok = 0;
+    free(index);
+    if (!ok || rename(tmpname, filename) != 0) {
+        fprintf(stderr, "mktypedb: can't write %s: %s\n", filename, strerror(errno));
+        unlink(tmpname);
+        return 1;
+    }
+    return 0;
+}
+
+int main(int argc, char *argv[])
+{
+    if (argc != 3) {
+        fprintf(stderr, "Usage: mktypedb SOURCE OUTPUT\n");
+        return 1;
+    }
+    
+    if (parse_source(argv[1]) != 0)
+        return 1;
+    // the loader needs a non-empty name table
+    if (names_size == 0 && add_name("", &entries[0].name_offset) != 0)
+        return 1;
+    if (write_db(argv[2]) != 0)
+        return 1;
+    
+    printf("%s: %d types\n", argv[2], (int)entry_count);
+    return 0;
+}
+
+/* EOF */
@@ -36,19 +36,48 @@
 
 #include "gptsync.h"
 
-// variables
+//
+// I/O buffers, aligned for the sector size and the devices' IoAlign
+//
 
-EFI_BLOCK_IO    *BlockIO = NULL;
+// raised by disk_open_blockio() for devices that need more
+static UINTN io_align = MAX_SECTOR_SIZE;
+
+// pool memory is only 8-byte aligned, so the buffer is placed inside a
+// larger allocation whose address is kept just in front of it
+VOID * alloc_io_buffer(UINTN size)
+{
+    UINT8   *pool, *buffer;
+    
+    pool = AllocatePool(size + io_align + sizeof(VOID *));
+    if (pool == NULL)
+        return NULL;
+    buffer = (UINT8 *)(((UINTN)pool + sizeof(VOID *) + io_align - 1) & ~(io_align - 1));
+    ((VOID **)buffer)[-1] = pool;
+    return buffer;
+}
+
+VOID free_io_buffer(VOID *buffer)
+{
+    if (buffer != NULL)
+        FreePool(((VOID **)buffer)[-1]);
+}
 
 //
-// sector I/O functions
+// Block I/O backend
 //
 
-UINTN read_sector(UINT64 lba, UINT8 *buffer)
+typedef struct {
+    DISK_DEVICE     disk;
+    EFI_BLOCK_IO    *BlockIO;
+} EFI_DISK;
+
+static UINTN blockio_read(DISK_DEVICE *disk, UINT64 lba, UINTN count, UINT8 *buffer)
 {
+    EFI_BLOCK_IO        *BlockIO = ((EFI_DISK *)disk->data)->BlockIO;
     EFI_STATUS          Status;
     
-    Status = BlockIO->ReadBlocks(BlockIO, BlockIO->Media->MediaId, lba, 512, buffer);
+    Status = BlockIO->ReadBlocks(BlockIO, BlockIO->Media->MediaId, lba, count * disk->sector_size, buffer);
     if (EFI_ERROR(Status)) {
         // TODO: report error
         return 1;
@@ -56,11 +85,12 @@ UINTN read_sector(UINT64 lba, UINT8 *buffer)
     return 0;
 }
 
-UINTN write_sector(UINT64 lba, UINT8 *buffer)
+static UINTN blockio_write(DISK_DEVICE *disk, UINT64 lba, UINTN count, UINT8 *buffer)
 {
+    EFI_BLOCK_IO        *BlockIO = ((EFI_DISK *)disk->data)->BlockIO;
     EFI_STATUS          Status;
     
-    Status = BlockIO->WriteBlocks(BlockIO, BlockIO->Media->MediaId, lba, 512, buffer);
+    Status = BlockIO->WriteBlocks(BlockIO, BlockIO->Media->MediaId, lba, count * disk->sector_size, buffer);
     if (EFI_ERROR(Status)) {
         // TODO: report error
         return 1;
@@ -68,6 +98,58 @@ UINTN write_sector(UINT64 lba, UINT8 *buffer)
     return 0;
 }
 
+static UINTN blockio_flush(DISK_DEVICE *disk)
+{
+    EFI_BLOCK_IO        *BlockIO = ((EFI_DISK *)disk->data)->BlockIO;
+    EFI_STATUS          Status;
+    
+    Status = BlockIO->FlushBlocks(BlockIO);
+    if (EFI_ERROR(Status))
+        return 1;
+    return 0;
+}
+
+static VOID blockio_close(DISK_DEVICE *disk)
+{
+    FreePool(disk->data);
+}
+
+static DISK_OPS blockio_ops = {
+    STR("blockio"),
+    blockio_read,
+    blockio_write,
+    NULL,               // Block I/O is synchronous, requests are issued in order
+    blockio_flush,
+    NULL,
+    blockio_close,
+};
+
+static DISK_DEVICE * disk_open_blockio(EFI_BLOCK_IO *BlockIO)
+{
+    EFI_DISK            *efi;
+    
+#ifdef EFI_BLOCK_IO_PROTOCOL_REVISION2
+    // IoAlign is only there from revision 2 on; 0 and 1 mean any address
+    if (BlockIO->Revision >= EFI_BLOCK_IO_PROTOCOL_REVISION2 && BlockIO->Media->IoAlign > io_align &&
+        (BlockIO->Media->IoAlign & (BlockIO->Media->IoAlign - 1)) == 0)
+        io_align = BlockIO->Media->IoAlign;
+#endif
+    
+    efi = AllocatePool(sizeof(EFI_DISK));
+    if (efi == NULL)
+        return NULL;
+    ZeroMem(efi, sizeof(EFI_DISK));
+    efi->BlockIO                   = BlockIO;
+    efi->disk.ops                  = &blockio_ops;
+    efi->disk.data                 = efi;
+    efi->disk.sector_size          = BlockIO->Media->BlockSize;
+    efi->disk.block_count          = BlockIO->Media->LastBlock + 1;
+    efi->disk.physical_sector_size = BlockIO->Media->BlockSize;
+    efi->disk.rotational           = TRUE;
+    efi->disk.read_only            = BlockIO->Media->ReadOnly;
+    return &efi->disk;
+}
+
 //
 // Keyboard input
 //
@@ -154,6 +236,9 @@ efi_main    (IN EFI_HANDLE           ImageHandle,
     EFI_HANDLE          DeviceHandle;
     EFI_DEVICE_PATH     *DevicePath, *NextDevicePath;
     BOOLEAN             Usable;
+    EFI_BLOCK_IO        *BlockIO = NULL;
+    DISK_DEVICE         *Device;
+    SCAN_CONTEXT        *Context;
 
     InitializeLib(ImageHandle, SystemTable);
     
@@ -193,7 +278,7 @@ efi_main    (IN EFI_HANDLE           ImageHandle,
             // TODO: report error
             BlockIO = NULL;
         } else {
-            if (BlockIO->Media->BlockSize != 512)
+            if (BlockIO->Media->BlockSize != 512 && BlockIO->Media->BlockSize != 4096)
                 BlockIO = NULL;    // optical media
             else
                 break;
@@ -209,7 +294,21 @@ efi_main    (IN EFI_HANDLE           ImageHandle,
     }
     
     
-    SyncStatus = gptsync();
+    if (gptsync_init() != 0)
+        return EFI_OUT_OF_RESOURCES;
+    Device = disk_open_blockio(BlockIO);
+    if (Device == NULL)
+        return EFI_OUT_OF_RESOURCES;
+    Context = scan_create(Device);
+    if (Context == NULL) {
+        disk_close(Device);
+        return EFI_OUT_OF_RESOURCES;
+    }
+    
+    SyncStatus = gptsync(Context, 0, 0, NULL);
+    
+    scan_destroy(Context);
+    disk_close(Device);
     
     if (SyncStatus == 0)
         PauseForKey();
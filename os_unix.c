@@ -38,20 +38,133 @@
 
 #include "gptsync.h"
 
+#ifdef __linux__
+#include <sys/ioctl.h>
+#include <sys/sysmacros.h>
+#include <linux/fs.h>
+#else
 #include <sys/disk.h>
+#endif
+#include <sys/mman.h>
 #include <stdarg.h>
+#include <aio.h>
 #include <getopt.h>
+#include <glob.h>
+#include <pthread.h>
 
 #define STRINGIFY(s) #s
 #define STRINGIFY2(s) STRINGIFY(s)
 #define PROGNAME_S STRINGIFY2(PROGNAME)
+#define CONCAT(a, b) a##b
+#define CONCAT2(a, b) CONCAT(a, b)
+#define PROGNAME_INIT CONCAT2(PROGNAME, _init)
+
+#ifndef O_SHLOCK
+#define O_SHLOCK 0
+#endif
 
 // variables
 
-static int      fd;
 char* progname = 0;
-BOOLEAN fill_mbr;
-BOOLEAN create_empty_mbr;
+
+//
+// per-device output
+//
+
+// while several devices are scanned at once, each one's output is collected
+// here and written out in command line order once the device is done
+typedef struct {
+    char    *data;
+    size_t  length;
+    size_t  size;
+} OUTPUT_BUFFER;
+
+typedef struct {
+    pthread_mutex_t lock;       // the device's helper threads write here too
+    OUTPUT_BUFFER   out;
+    OUTPUT_BUFFER   err;
+} DEVICE_OUTPUT;
+
+static pthread_key_t output_key;            // DEVICE_OUTPUT of the calling thread, if any
+static BOOLEAN       output_key_ready = FALSE;
+
+static void output_open(DEVICE_OUTPUT *output)
+{
+    ZeroMem(output, sizeof(DEVICE_OUTPUT));
+    pthread_mutex_init(&output->lock, NULL);
+}
+
+static void output_write(FILE *stream, const char *text)
+{
+    DEVICE_OUTPUT *output;
+    OUTPUT_BUFFER *b;
+    size_t        length, size;
+    char          *data;
+    
+    output = output_key_ready ? pthread_getspecific(output_key) : NULL;
+    if (output == NULL) {
+        fputs(text, stream);
+        return;
+    }
+    
+    b = (stream == stderr) ? &output->err : &output->out;
+    length = strlen(text);
+    pthread_mutex_lock(&output->lock);
+    if (b->length + length > b->size) {
+        size = (b->size == 0) ? 4096 : b->size;
+        while (size < b->length + length)
+            size *= 2;
+        data = realloc(b->data, size);
+        if (data == NULL) {
+            pthread_mutex_unlock(&output->lock);
+            fputs(text, stream);        // out of order beats lost
+            return;
+        }
+        b->data = data;
+        b->size = size;
+    }
+    memcpy(b->data + b->length, text, length);
+    b->length += length;
+    pthread_mutex_unlock(&output->lock);
+}
+
+// threads a device scan starts write to the same place as the thread
+// that started them
+VOID * output_get_target(VOID)
+{
+    return output_key_ready ? pthread_getspecific(output_key) : NULL;
+}
+
+VOID output_set_target(VOID *target)
+{
+    if (output_key_ready)
+        pthread_setspecific(output_key, target);
+}
+
+static int output_init(void)
+{
+    if (!output_key_ready) {
+        if (pthread_key_create(&output_key, NULL) != 0) {
+            error("Can't set up the per-device output");
+            return 1;
+        }
+        output_key_ready = TRUE;
+    }
+    return 0;
+}
+
+static void output_flush(DEVICE_OUTPUT *output)
+{
+    fwrite(output->out.data, 1, output->out.length, stdout);
+    fflush(stdout);
+    fwrite(output->err.data, 1, output->err.length, stderr);
+    fflush(stderr);
+    
+    free(output->out.data);
+    free(output->err.data);
+    pthread_mutex_destroy(&output->lock);
+    ZeroMem(output, sizeof(DEVICE_OUTPUT));
+}
 
 //
 // error functions
@@ -61,91 +174,844 @@ void error(const char *msg, ...)
 {
     va_list par;
     char buf[4096];
+    char line[4200];
     
     va_start(par, msg);
     vsnprintf(buf, 4096, msg, par);
     va_end(par);
     
-    fprintf(stderr, "ERROR: %s\n", buf);
+    snprintf(line, sizeof(line), "ERROR: %s\n", buf);
+    output_write(stderr, line);
 }
 
 void errore(const char *msg, ...)
 {
     va_list par;
     char buf[4096];
+    char line[4200];
     
     va_start(par, msg);
     vsnprintf(buf, 4096, msg, par);
     va_end(par);
     
-    fprintf(stderr, "ERROR: %s: %s\n", buf, strerror(errno));
+    snprintf(line, sizeof(line), "ERROR: %s: %s\n", buf, strerror(errno));
+    output_write(stderr, line);
+}
+
+//
+// get the logical sector size of device (in bytes)
+//
+static UINTN device_block_size(int dev_fd) {
+#ifdef __linux__
+	int           block_size;
+	if (ioctl (dev_fd, BLKSSZGET, &block_size))
+		return 512;
+#else
+	UINT32        block_size;
+	if (ioctl (dev_fd, DKIOCGETBLOCKSIZE, &block_size))
+		return 512;
+#endif
+	return block_size;
 }
 
 //
 // get the size of device (in blockcount)
 //
-UINT64 get_disk_size(void) {
+static UINT64 device_block_count(int dev_fd, UINTN block_size) {
+#ifdef __linux__
+	UINT64        byte_count;
+	if (ioctl (dev_fd, BLKGETSIZE64, &byte_count))
+		return 0;
+	else
+		return byte_count / block_size;
+#else
 	UINT64        block_count;
-	if (ioctl (fd, DKIOCGETBLOCKCOUNT, &block_count))
+	if (ioctl (dev_fd, DKIOCGETBLOCKCOUNT, &block_count))
 		return 0;
 	else
 		return block_count;
+#endif
+}
+
+//
+// get the physical layout of device
+//
+static void device_topology(int dev_fd, DISK_DEVICE *disk) {
+#ifdef __linux__
+	int           value;
+	struct stat   sb;
+	char          path[128];
+	FILE          *f;
+	
+	if (ioctl (dev_fd, BLKPBSZGET, &value) == 0)
+		disk->physical_sector_size = value;
+	if (ioctl (dev_fd, BLKIOOPT, &value) == 0)
+		disk->optimal_io_size = value;
+	
+	// the queue attributes live on the whole disk, one level up for partitions
+	if (fstat (dev_fd, &sb) == 0) {
+		snprintf (path, sizeof(path), "/sys/dev/block/%u:%u/queue/rotational",
+				  major(sb.st_rdev), minor(sb.st_rdev));
+		f = fopen (path, "r");
+		if (f == NULL) {
+			snprintf (path, sizeof(path), "/sys/dev/block/%u:%u/../queue/rotational",
+					  major(sb.st_rdev), minor(sb.st_rdev));
+			f = fopen (path, "r");
+		}
+		if (f != NULL) {
+			disk->rotational = (fgetc (f) == '1') ? TRUE : FALSE;
+			fclose (f);
+		}
+	}
+#else
+	UINT32        value;
+	
+	if (ioctl (dev_fd, DKIOCGETPHYSICALBLOCKSIZE, &value) == 0)
+		disk->physical_sector_size = value;
+#endif
+}
+
+//
+// I/O buffers, aligned for uncached device access
+//
+
+VOID * alloc_io_buffer(UINTN size)
+{
+    VOID    *buffer;
+    
+    if (posix_memalign(&buffer, sysconf(_SC_PAGESIZE), size) != 0)
+        return NULL;
+    return buffer;
+}
+
+VOID free_io_buffer(VOID *buffer)
+{
+    free(buffer);
 }
 
 //
-// sector I/O functions
+// file backend: devices and image files accessed through a descriptor
 //
+// All device access is positional (pread/pwrite), so there is no shared
+// file offset and one descriptor can safely be used from several threads.
+//
+
+typedef struct {
+    DISK_DEVICE disk;
+    int         fd;
+    UINT8       *map;           // mapping of an image file (mmap backend)
+    UINT64      map_size;
+    UINTN       queue_depth;    // reads kept in flight by read_batch
+} UNIX_DISK;
 
-UINTN read_sector(UINT64 lba, UINT8 *buffer)
+static UINTN pread_sectors(UNIX_DISK *u, UINT64 lba, UINTN count, UINT8 *buffer)
 {
     off_t   offset;
-    off_t   result_seek;
+    size_t  length, done;
     ssize_t result_read;
     
-    offset = lba * 512;
-    result_seek = lseek(fd, offset, SEEK_SET);
-    if (result_seek != offset) {
-        errore("Seek to %llu failed", offset);
-        return 1;
+    offset = lba * u->disk.sector_size;
+    length = (size_t)count * u->disk.sector_size;
+    for (done = 0; done < length; done += result_read) {
+        result_read = pread(u->fd, buffer + done, length - done, offset + done);
+        if (result_read < 0) {
+            if (errno == EINTR) {
+                result_read = 0;
+                continue;
+            }
+            errore("Data read failed at position %llu", offset + done);
+            return 1;
+        }
+        if (result_read == 0) {
+            error("Data read fell short at position %llu", offset + done);
+            return 1;
+        }
     }
+    return 0;
+}
+
+static UINTN pwrite_sectors(UNIX_DISK *u, UINT64 lba, UINTN count, UINT8 *buffer)
+{
+    off_t   offset;
+    size_t  length, done;
+    ssize_t result_write;
+    
+    offset = lba * u->disk.sector_size;
+    length = (size_t)count * u->disk.sector_size;
+    for (done = 0; done < length; done += result_write) {
+        result_write = pwrite(u->fd, buffer + done, length - done, offset + done);
+        if (result_write < 0) {
+            if (errno == EINTR) {
+                result_write = 0;
+                continue;
+            }
+            errore("Data write failed at position %llu", offset + done);
+            return 1;
+        }
+        if (result_write == 0) {
+            error("Data write fell short at position %llu", offset + done);
+            return 1;
+        }
+    }
+    return 0;
+}
+
+static UINTN file_read(DISK_DEVICE *disk, UINT64 lba, UINTN count, UINT8 *buffer)
+{
+    return pread_sectors(disk->data, lba, count, buffer);
+}
+
+static UINTN file_write(DISK_DEVICE *disk, UINT64 lba, UINTN count, UINT8 *buffer)
+{
+    return pwrite_sectors(disk->data, lba, count, buffer);
+}
+
+//
+// batched reads: all requests are submitted to the kernel together
+// (POSIX AIO, up to queue_depth at a time) instead of one after another
+//
+
+static UINTN file_read_batch(DISK_DEVICE *disk, IO_REQUEST *requests, UINTN count)
+{
+    UNIX_DISK       *u = disk->data;
+    struct aiocb    *cbs, **list;
+    UINTN           depth, first, n, i;
+    ssize_t         result;
+    UINTN           status;
+    
+    if (count == 1)
+        return pread_sectors(u, requests[0].lba, requests[0].count, requests[0].buffer);
+    if (count == 0)
+        return 0;
     
-    result_read = read(fd, buffer, 512);
-    if (result_read < 0) {
-        errore("Data read failed at position %llu", offset);
+    depth = u->queue_depth;
+#ifdef AIO_LISTIO_MAX
+    if (depth > AIO_LISTIO_MAX)
+        depth = AIO_LISTIO_MAX;
+#endif
+    if (depth > count)
+        depth = count;
+    
+    cbs = AllocatePool(depth * sizeof(struct aiocb));
+    list = AllocatePool(depth * sizeof(struct aiocb *));
+    if (cbs == NULL || list == NULL) {
+        FreePool(cbs);
+        FreePool(list);
+        error("Out of memory");
         return 1;
     }
-    if (result_read != 512) {
-        errore("Data read fell short at position %llu", offset);
+    
+    status = 0;
+    for (first = 0; first < count && status == 0; first += n) {
+        n = count - first;
+        if (n > depth)
+            n = depth;
+        
+        ZeroMem(cbs, n * sizeof(struct aiocb));
+        for (i = 0; i < n; i++) {
+            cbs[i].aio_fildes     = u->fd;
+            cbs[i].aio_offset     = requests[first + i].lba * disk->sector_size;
+            cbs[i].aio_buf        = requests[first + i].buffer;
+            cbs[i].aio_nbytes     = requests[first + i].count * disk->sector_size;
+            cbs[i].aio_lio_opcode = LIO_READ;
+            list[i] = &cbs[i];
+        }
+        
+        // lio_listio() may report EAGAIN/EIO/EINTR with some requests
+        // queued or done, so the outcome of every request is checked
+        // individually below; the ones that failed or never got queued
+        // are read again synchronously
+        if (lio_listio(LIO_WAIT, list, (int)n, NULL) != 0 &&
+            errno != EAGAIN && errno != EIO && errno != EINTR) {
+            errore("Batched read submission failed");
+            status = 1;
+            break;
+        }
+        
+        for (i = 0; i < n; i++) {
+            while (aio_error(&cbs[i]) == EINPROGRESS)
+                aio_suspend((const struct aiocb * const *)&list[i], 1, NULL);
+            result = aio_return(&cbs[i]);
+            if (result == (ssize_t)cbs[i].aio_nbytes)
+                continue;
+            // error or short transfer: redo this request synchronously
+            status = pread_sectors(u, requests[first + i].lba, requests[first + i].count,
+                                   requests[first + i].buffer);
+            if (status != 0)
+                break;
+        }
+    }
+    
+    FreePool(cbs);
+    FreePool(list);
+    return status;
+}
+
+static UINTN file_flush(DISK_DEVICE *disk)
+{
+    UNIX_DISK *u = disk->data;
+    
+    if (fsync(u->fd) != 0) {
+        errore("Data sync failed");
         return 1;
     }
     return 0;
 }
 
-UINTN write_sector(UINT64 lba, UINT8 *buffer)
+// Asks the file system where the allocated extents of an image file are.
+// Devices and file systems without SEEK_DATA report the whole range. The
+// file offset this moves is not used by anything else.
+static UINTN file_find_data(DISK_DEVICE *disk, UINT64 lba, UINT64 end_lba, UINT64 *data_lba, UINT64 *data_end)
 {
-    off_t   offset;
-    off_t   result_seek;
-    ssize_t result_write;
+    UNIX_DISK   *u = disk->data;
+    UINT64      sector_size = disk->sector_size;
+#ifdef SEEK_DATA
+    off_t       data, hole;
+    
+    data = lseek(u->fd, (off_t)(lba * sector_size), SEEK_DATA);
+    if (data < 0 && errno == ENXIO) {
+        // only holes from here to the end of the file
+        *data_lba = end_lba;
+        *data_end = end_lba;
+        return 0;
+    }
+    if (data >= 0) {
+        hole = lseek(u->fd, data, SEEK_HOLE);
+        *data_lba = (UINT64)data / sector_size;
+        if (*data_lba >= end_lba) {
+            *data_lba = end_lba;
+            *data_end = end_lba;
+            return 0;
+        }
+        *data_end = end_lba;
+        if (hole >= 0 && ((UINT64)hole + sector_size - 1) / sector_size < end_lba)
+            *data_end = ((UINT64)hole + sector_size - 1) / sector_size;
+        return 0;
+    }
+#endif
     
-    offset = lba * 512;
-    result_seek = lseek(fd, offset, SEEK_SET);
-    if (result_seek != offset) {
-        errore("Seek to %llu failed", offset);
+    *data_lba = lba;
+    *data_end = end_lba;
+    return 0;
+}
+
+static VOID file_close(DISK_DEVICE *disk)
+{
+    UNIX_DISK *u = disk->data;
+    
+    if (u->map != NULL)
+        munmap(u->map, (size_t)u->map_size);
+    if (close(u->fd) != 0)
+        errore("Error while closing device");
+    FreePool(u);
+}
+
+static DISK_OPS file_ops = {
+    STR("file"),
+    file_read,
+    file_write,
+    file_read_batch,
+    file_flush,
+    file_find_data,
+    file_close,
+};
+
+//
+// mmap backend: regular image files accessed through a memory mapping
+//
+
+static BOOLEAN map_range_ok(UNIX_DISK *u, UINT64 lba, UINTN count)
+{
+    UINT64 offset = lba * u->disk.sector_size;
+    UINT64 length = (UINT64)count * u->disk.sector_size;
+    
+    if (offset > u->map_size || length > u->map_size - offset) {
+        error("Data access beyond end of image at position %llu", offset);
+        return FALSE;
+    }
+    return TRUE;
+}
+
+static UINTN map_read(DISK_DEVICE *disk, UINT64 lba, UINTN count, UINT8 *buffer)
+{
+    UNIX_DISK *u = disk->data;
+    
+    if (!map_range_ok(u, lba, count))
         return 1;
+    CopyMem(buffer, u->map + lba * disk->sector_size, (size_t)count * disk->sector_size);
+    return 0;
+}
+
+static UINTN map_write(DISK_DEVICE *disk, UINT64 lba, UINTN count, UINT8 *buffer)
+{
+    UNIX_DISK *u = disk->data;
+    
+    if (!map_range_ok(u, lba, count))
+        return 1;
+    CopyMem(u->map + lba * disk->sector_size, buffer, (size_t)count * disk->sector_size);
+    return 0;
+}
+
+static UINTN map_flush(DISK_DEVICE *disk)
+{
+    UNIX_DISK *u = disk->data;
+    
+    if (msync(u->map, (size_t)u->map_size, MS_SYNC) != 0) {
+        errore("Data sync failed");
+        return 1;
+    }
+    return 0;
+}
+
+static DISK_OPS map_ops = {
+    STR("mmap"),
+    map_read,
+    map_write,
+    NULL,
+    map_flush,
+    file_find_data,
+    file_close,
+};
+
+// a read-only mapping serves the reads, writes still go through pwrite
+static DISK_OPS map_read_ops = {
+    STR("mmap"),
+    map_read,
+    file_write,
+    NULL,
+    file_flush,
+    file_find_data,
+    file_close,
+};
+
+// try to switch an image file over to the mmap backend
+static void map_image(UNIX_DISK *u, UINT64 size, BOOLEAN writable)
+{
+    int prot;
+    
+    if (size == 0 || (UINT64)(size_t)size != size)
+        return;
+    
+    // the mapping is read-only unless writable mode was asked for
+    prot = PROT_READ;
+    if (writable && !u->disk.read_only)
+        prot |= PROT_WRITE;
+    
+    u->map = mmap(NULL, (size_t)size, prot, MAP_SHARED, u->fd, 0);
+    if (u->map == MAP_FAILED) {
+        // not fatal, we just stay with pread/pwrite
+        u->map = NULL;
+        return;
     }
+    u->map_size = size;
+    u->disk.ops = (prot & PROT_WRITE) ? &map_ops : &map_read_ops;
+}
+
+//
+// stream backend: pipes and standard input, read strictly forward
+//
+// The first STREAM_HEAD_SIZE bytes are kept, they hold the MBR and the GPT.
+// Beyond that only the sectors that were asked for are kept as they pass;
+// plan_reads() asks for everything in one ascending sweep, so later reads
+// are served from memory and the rest of the stream is discarded.
+//
+
+#define STREAM_HEAD_SIZE    (1024*1024)
+#define STREAM_SKIP_SIZE    (65536)
+
+typedef struct {
+    UINT64  lba;
+    UINTN   count;
+    UINT8   *data;
+} STREAM_EXTENT;
+
+typedef struct {
+    DISK_DEVICE     disk;
+    int             fd;
+    UINT64          position;           // bytes consumed from the stream
+    UINT8           *head;
+    UINTN           head_length;        // valid bytes in head
+    STREAM_EXTENT   *extents;           // kept sectors, ascending
+    UINTN           extent_count, extent_alloc;
+} STREAM_DISK;
+
+// reads exactly length bytes from the stream
+static UINTN stream_consume(STREAM_DISK *st, UINT8 *buffer, UINTN length)
+{
+    ssize_t r;
+    UINTN   done;
     
-    result_write = write(fd, buffer, 512);
-    if (result_write < 0) {
-        errore("Data write failed at position %llu", offset);
+    for (done = 0; done < length; ) {
+        r = read(st->fd, buffer + done, length - done);
+        if (r < 0 && errno == EINTR)
+            continue;
+        if (r < 0) {
+            errore("Stream read failed at position %llu", st->position);
+            return 1;
+        }
+        if (r == 0) {
+            error("Data access beyond end of stream at position %llu", st->position);
+            return 1;
+        }
+        done += r;
+        st->position += r;
+    }
+    return 0;
+}
+
+// moves forward to offset, filling the head buffer on the way
+static UINTN stream_skip_to(STREAM_DISK *st, UINT64 offset)
+{
+    UINT8   scratch[STREAM_SKIP_SIZE];
+    UINT64  chunk;
+    UINTN   status;
+    
+    if (st->position < STREAM_HEAD_SIZE) {
+        chunk = (offset < STREAM_HEAD_SIZE ? offset : STREAM_HEAD_SIZE) - st->position;
+        status = stream_consume(st, st->head + st->head_length, (UINTN)chunk);
+        st->head_length = (UINTN)st->position;
+        if (status != 0)
+            return status;
+    }
+    while (st->position < offset) {
+        chunk = offset - st->position;
+        if (chunk > STREAM_SKIP_SIZE)
+            chunk = STREAM_SKIP_SIZE;
+        status = stream_consume(st, scratch, (UINTN)chunk);
+        if (status != 0)
+            return status;
+    }
+    return 0;
+}
+
+static UINT8 * stream_find(STREAM_DISK *st, UINT64 lba)
+{
+    UINTN   low, high, mid;
+    
+    low = 0;
+    high = st->extent_count;
+    while (low < high) {
+        mid = (low + high) / 2;
+        if (lba < st->extents[mid].lba)
+            high = mid;
+        else if (lba >= st->extents[mid].lba + st->extents[mid].count)
+            low = mid + 1;
+        else
+            return st->extents[mid].data + (lba - st->extents[mid].lba) * st->disk.sector_size;
+    }
+    return NULL;
+}
+
+// reads the next count sectors from the stream and keeps them
+static UINTN stream_keep(STREAM_DISK *st, UINT64 lba, UINTN count, UINT8 *buffer)
+{
+    STREAM_EXTENT   *extents;
+    UINT8           *data;
+    UINTN           status;
+    
+    if (st->extent_count == st->extent_alloc) {
+        st->extent_alloc = st->extent_alloc ? 2 * st->extent_alloc : 64;
+        extents = realloc(st->extents, st->extent_alloc * sizeof(STREAM_EXTENT));
+        if (extents == NULL) {
+            error("Out of memory");
+            return 1;
+        }
+        st->extents = extents;
+    }
+    data = AllocatePool(count * st->disk.sector_size);
+    if (data == NULL) {
+        error("Out of memory");
         return 1;
     }
-    if (result_write != 512) {
-        errore("Data write fell short at position %llu", offset);
+    status = stream_consume(st, data, count * st->disk.sector_size);
+    if (status != 0) {
+        FreePool(data);
+        return status;
+    }
+    st->extents[st->extent_count].lba   = lba;
+    st->extents[st->extent_count].count = count;
+    st->extents[st->extent_count].data  = data;
+    st->extent_count++;
+    CopyMem(buffer, data, count * st->disk.sector_size);
+    return 0;
+}
+
+static UINTN stream_read(DISK_DEVICE *disk, UINT64 lba, UINTN count, UINT8 *buffer)
+{
+    STREAM_DISK *st = disk->data;
+    UINTN   sector_size = disk->sector_size;
+    UINTN   i, status;
+    UINT64  offset;
+    UINT8   *data;
+    
+    for (i = 0; i < count; i++, buffer += sector_size) {
+        offset = (lba + i) * sector_size;
+        
+        // inside the head
+        if (offset + sector_size <= STREAM_HEAD_SIZE) {
+            if (offset + sector_size > st->head_length) {
+                status = stream_skip_to(st, offset + sector_size);
+                if (status != 0)
+                    return status;
+            }
+            CopyMem(buffer, st->head + offset, sector_size);
+            continue;
+        }
+        
+        // passed before and kept
+        data = stream_find(st, lba + i);
+        if (data != NULL) {
+            CopyMem(buffer, data, sector_size);
+            continue;
+        }
+        
+        // still ahead, take the rest of the request in one go
+        if (offset >= st->position) {
+            status = stream_skip_to(st, offset);
+            if (status == 0)
+                status = stream_keep(st, lba + i, count - i, buffer);
+            return status;
+        }
+        
+        error("Stream has already passed position %llu", offset);
         return 1;
     }
     return 0;
 }
 
+static VOID stream_close(DISK_DEVICE *disk)
+{
+    STREAM_DISK *st = disk->data;
+    UINTN   i;
+    
+    for (i = 0; i < st->extent_count; i++)
+        FreePool(st->extents[i].data);
+    if (st->extents != NULL)
+        FreePool(st->extents);
+    FreePool(st->head);
+    if (st->fd != STDIN_FILENO)
+        close(st->fd);
+    FreePool(st);
+}
+
+static DISK_OPS stream_ops = {
+    STR("stream"),
+    stream_read,
+    NULL,
+    NULL,
+    NULL,
+    NULL,
+    stream_close,
+};
+
+static DISK_DEVICE * disk_open_stream(int fd, UINTN sector_size)
+{
+    STREAM_DISK *st;
+    
+    st = AllocatePool(sizeof(STREAM_DISK));
+    if (st == NULL) {
+        error("Out of memory");
+        return NULL;
+    }
+    ZeroMem(st, sizeof(STREAM_DISK));
+    st->head = AllocatePool(STREAM_HEAD_SIZE);
+    if (st->head == NULL) {
+        error("Out of memory");
+        FreePool(st);
+        return NULL;
+    }
+    st->fd                          = fd;
+    st->disk.ops                    = &stream_ops;
+    st->disk.data                   = st;
+    st->disk.sector_size            = sector_size;
+    st->disk.physical_sector_size   = sector_size;
+    st->disk.block_count            = 0;        // not known up front
+    st->disk.sequential             = TRUE;
+    st->disk.read_only              = TRUE;
+    return &st->disk;
+}
+
+//
+// open a device or image file
+//
+
+typedef struct {
+    UINTN   image_sector_size;      // logical sector size assumed for image files
+    BOOLEAN mmap_write;             // write to image files through the mapping
+    BOOLEAN read_only;              // never open for writing; closing a device
+                                    // opened for writing makes udev re-read it
+    UINTN   queue_depth;
+} UNIX_OPEN_OPTIONS;
+
+static DISK_DEVICE * disk_open_unix(char *filename, UNIX_OPEN_OPTIONS *options)
+{
+    struct stat sb;
+    int    filekind;
+    UINT64 filesize;
+    char   *reason;
+    int    fd, open_flags;
+    BOOLEAN read_only;
+    UNIX_DISK *u;
+    DISK_DEVICE *image, *device;
+    
+    if (options->image_sector_size < MIN_SECTOR_SIZE || options->image_sector_size > MAX_SECTOR_SIZE ||
+        (options->image_sector_size & (options->image_sector_size - 1)) != 0) {
+        error("Unsupported sector size %d", (int)options->image_sector_size);
+        return NULL;
+    }
+    
+    // standard input is streamed
+    if (strcmp(filename, "-") == 0)
+        return disk_open_stream(STDIN_FILENO, options->image_sector_size);
+    
+    // stat check
+    if (stat(filename, &sb) < 0) {
+        errore("Can't stat %.300s", filename);
+        return NULL;
+    }
+    
+    filekind = 0;
+    filesize = 0;
+    reason = NULL;
+    if (S_ISREG(sb.st_mode))
+        filesize = sb.st_size;
+    else if (S_ISBLK(sb.st_mode))
+        filekind = 1;
+    else if (S_ISCHR(sb.st_mode))
+        filekind = 2;
+    else if (S_ISDIR(sb.st_mode))
+        reason = "Is a directory";
+    else if (S_ISFIFO(sb.st_mode))
+        filekind = 3;
+#ifdef S_ISSOCK
+    else if (S_ISSOCK(sb.st_mode))
+        reason = "Is a socket";
+#endif
+    else
+        reason = "Is an unknown kind of special file";
+    
+    if (reason != NULL) {
+        error("%.300s: %s", filename, reason);
+        return NULL;
+    }
+    
+    // pipes are read front to back, once
+    if (filekind == 3) {
+        fd = open(filename, O_RDONLY);
+        if (fd < 0) {
+            errore("Can't open %.300s", filename);
+            return NULL;
+        }
+        device = disk_open_stream(fd, options->image_sector_size);
+        if (device == NULL)
+            close(fd);
+        return device;
+    }
+    
+    // gzip and zstd compressed images are read through their index
+    if (filekind == 0) {
+        if (disk_open_compressed(filename, options->image_sector_size, &image) != 0)
+            return NULL;
+        if (image != NULL)
+            return image;
+    }
+    
+    // open file; devices are read uncached where the OS supports it
+    open_flags = 0;
+#ifdef O_DIRECT
+    if (filekind == 1)
+        open_flags |= O_DIRECT;
+#endif
+    read_only = options->read_only;
+    fd = open(filename, (read_only ? O_RDONLY : O_RDWR|O_SHLOCK)|open_flags);
+    if (fd < 0 && errno == EINVAL && open_flags != 0) {
+        // direct I/O not supported here, use the page cache after all
+        open_flags = 0;
+        fd = open(filename, read_only ? O_RDONLY : O_RDWR|O_SHLOCK);
+    }
+    if (fd < 0 && errno == EBUSY && !read_only) {
+        fd = open(filename, O_RDONLY|open_flags);
+        read_only = TRUE;
+#ifndef NOREADONLYWARN
+        if (fd >= 0)
+            Print(L"Warning: %.300s opened read-only\n", filename);
+#endif
+    }
+    if (fd < 0) {
+        errore("Can't open %.300s", filename);
+        return NULL;
+    }
+#ifdef F_NOCACHE
+    if (filekind != 0)
+        fcntl(fd, F_NOCACHE, 1);
+#endif
+    
+    // (try to) guard against TTY character devices
+    if (filekind == 2) {
+        if (isatty(fd)) {
+            error("%.300s: Is a TTY device", filename);
+            close(fd);
+            return NULL;
+        }
+    }
+    
+    u = AllocatePool(sizeof(UNIX_DISK));
+    if (u == NULL) {
+        error("Out of memory");
+        close(fd);
+        return NULL;
+    }
+    ZeroMem(u, sizeof(UNIX_DISK));
+    u->fd               = fd;
+    u->queue_depth      = options->queue_depth;
+    u->disk.ops         = &file_ops;
+    u->disk.data        = u;
+    u->disk.read_only   = read_only;
+    u->disk.thread_safe = TRUE;
+    
+    // determine geometry; image files are first looked at in units of 512
+    // bytes, container formats are parsed at byte granularity
+    if (filekind == 0) {
+        u->disk.sector_size = MIN_SECTOR_SIZE;
+        u->disk.rotational  = FALSE;
+    } else {
+        u->disk.sector_size = device_block_size(fd);
+        u->disk.rotational  = TRUE;     // unless the OS tells otherwise
+    }
+    if (u->disk.sector_size < MIN_SECTOR_SIZE || u->disk.sector_size > MAX_SECTOR_SIZE ||
+        (u->disk.sector_size & (u->disk.sector_size - 1)) != 0) {
+        error("%.300s: Unsupported sector size %d", filename, (int)u->disk.sector_size);
+        file_close(&u->disk);
+        return NULL;
+    }
+    u->disk.physical_sector_size = u->disk.sector_size;
+    if (filekind == 0)
+        u->disk.block_count = filesize / u->disk.sector_size;
+    else {
+        u->disk.block_count = device_block_count(fd, u->disk.sector_size);
+        device_topology(fd, &u->disk);
+    }
+    
+    if (filekind == 0) {
+        // image files are accessed through a memory mapping
+        map_image(u, filesize, options->mmap_write);
+        
+        // qcow2, VHD(X) and VMDK images are read through their block maps
+        if (disk_open_image(&u->disk, options->image_sector_size, &image) != 0) {
+            file_close(&u->disk);
+            return NULL;
+        }
+        if (image != NULL)
+            return image;
+        
+        u->disk.sector_size          = options->image_sector_size;
+        u->disk.physical_sector_size = options->image_sector_size;
+        u->disk.block_count          = filesize / u->disk.sector_size;
+    }
+    
+    return &u->disk;
+}
+
 //
 // keyboard input
 //
@@ -191,7 +1057,47 @@ void Print(wchar_t *format, ...)
     vsnprintf(buf, 4096, formatbuf, par);
     va_end(par);
     
-    printf("%s", buf);
+    output_write(stdout, buf);
+}
+
+//
+// external databases (partition types, boot code fingerprints)
+//
+
+// the mapping stays in place for the lifetime of the process
+static int load_db(char *filename, char *what, UINTN (*load)(UINT8 *data, UINTN size))
+{
+    int         fd;
+    struct stat sb;
+    UINT8       *map;
+    
+    fd = open(filename, O_RDONLY);
+    if (fd < 0) {
+        errore("Can't open %s %s", what, filename);
+        return 1;
+    }
+    if (fstat(fd, &sb) < 0) {
+        errore("Can't stat %s %s", what, filename);
+        close(fd);
+        return 1;
+    }
+    if (sb.st_size == 0) {
+        error("%s: not a %s", filename, what);
+        close(fd);
+        return 1;
+    }
+    map = mmap(NULL, (size_t)sb.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (map == MAP_FAILED) {
+        errore("Can't map %s %s", what, filename);
+        return 1;
+    }
+    
+    if (load(map, (UINTN)sb.st_size) != 0) {
+        munmap(map, (size_t)sb.st_size);
+        return 1;
+    }
+    return 0;
 }
 
 //
@@ -227,15 +1133,36 @@ usage (int status)
 Usage: %s [OPTION]... DEVICE [PARTITION[+/-[TYPE]]] ...\n\
 \n\
 %s fill hybrid MBR of GPT drive DEVICE.\n\
+DEVICE may also be an image file, a pipe, or - for standard input.\n\
+showpart takes any number of DEVICEs and scans them at the same time; quoted\n\
+wildcards are expanded.\n\
 \n\
 Specified partitions will be a part of hybrid MBR. Up to 3 partitions are allowed.\n\
 + means that partition is active (only one partition can be active).\n\
 TYPE is an MBR hexadecimal type (use -t option to list recognized types).\n\
 \n\
 Valid options:\n\
+  -b, --sector-size=N     logical sector size of image files (default 512)\n\
+  -d, --type-db=FILE      look up GPT partition types in FILE first (built with\n\
+                          mktypedb; default $GPTSYNC_TYPE_DB if set)\n\
   -e, --empty             create an MBR containing only the EFI Protective partition\n\
+  -f, --boot-db=FILE      identify boot code versions by the fingerprints in FILE\n\
+                          (built with mkbootdb; default $GPTSYNC_BOOT_DB if set)\n\
+  -i, --inventory=SOCKET  keep scanning the DEVICEs, or all disks if none are\n\
+                          given, and answer list, show [DEVICE] and rescan\n\
+                          [DEVICE] requests on the Unix SOCKET (showpart)\n\
+  -j, --jobs=N            scan up to N devices at once (showpart; default from\n\
+                          the number of CPUs and the queue depth)\n\
+  -l, --device-list       read more devices from standard input, one per line\n\
+                          (showpart)\n\
+  -m, --mmap-write        update image files through a writable shared mapping\n\
+  -q, --queue-depth=N     keep up to N reads in flight when probing (default 32)\n\
+  -r, --recover           scan the whole disk for lost file systems (showpart)\n\
+  -s, --stats             report sector cache hits and misses\n\
   -n, --nofill            don't try to protect unused partition\n\
   -t, --types             list the MBR recognized type codes\n\
+  -z, --contents          tell which partitions are sparse, all zeros or hold\n\
+                          data (showpart)\n\
   -h, --help              display this message and exit\n\
   -V, --version           print version information and exit\n\
 \n\
@@ -251,49 +1178,404 @@ example: sudo ./%s /dev/disk1 1 2+af\n",
 static struct option options[] =
 {
 {"nofill",  no_argument, 0, 'n'},
+{"sector-size", required_argument, 0, 'b'},
+{"type-db", required_argument, 0, 'd'},
 {"empty",   no_argument, 0, 'e'},
+{"boot-db", required_argument, 0, 'f'},
+{"inventory", required_argument, 0, 'i'},
+{"jobs",    required_argument, 0, 'j'},
+{"device-list", no_argument, 0, 'l'},
+{"mmap-write", no_argument, 0, 'm'},
+{"queue-depth", required_argument, 0, 'q'},
+{"recover", no_argument, 0, 'r'},
+{"stats",   no_argument, 0, 's'},
 {"types",   no_argument, 0, 't'},
+{"contents", no_argument, 0, 'z'},
 {"help",    no_argument, 0, 'h'},
 {"version", no_argument, 0, 'V'},
 {0, 0, 0, 0}
 };
 
+//
+// run the program on one device
+//
+
+typedef struct {
+    UNIX_OPEN_OPTIONS open_options;
+    BOOLEAN fill_mbr;
+    BOOLEAN create_empty_mbr;
+    BOOLEAN check_contents;
+    BOOLEAN show_stats;
+    UINTN   recover_threads;
+    BOOLEAN recover_progress;
+    int     optind;                 // program arguments following the device
+    int     argc;
+    char    **argv;
+} RUN_OPTIONS;
+
+static int run_device(char *filename, RUN_OPTIONS *run)
+{
+    int    status;
+    DISK_DEVICE *device;
+    SCAN_CONTEXT *ctx;
+    UINT64 hits, misses;
+    
+    // open device
+    device = disk_open_unix(filename, &run->open_options);
+    if (device == NULL)
+        return 1;
+    ctx = scan_create(device);
+    if (ctx == NULL) {
+        disk_close(device);
+        return 1;
+    }
+    ctx->fill_mbr         = run->fill_mbr;
+    ctx->create_empty_mbr = run->create_empty_mbr;
+    ctx->check_contents   = run->check_contents;
+    ctx->recover_threads  = run->recover_threads;
+    ctx->recover_progress = run->recover_progress;
+    
+    // run sync algorithm
+    status = PROGNAME(ctx, run->optind, run->argc, run->argv);
+    Print(L"\n");
+    
+    if (run->show_stats) {
+        disk_cache_stats(ctx->disk, &hits, &misses);
+        Print(L"Sector cache: %llu hits, %llu misses\n", (unsigned long long)hits, (unsigned long long)misses);
+    }
+    
+    // close device
+    scan_destroy(ctx);
+    disk_close(device);
+    
+    return status;
+}
+
+//
+// scan several devices at once
+//
+
+// reads worth keeping in flight per CPU: a worker with a shallow queue spends
+// most of its time waiting, so more of them share a CPU
+#define INFLIGHT_PER_CPU (64)
+
+typedef struct {
+    char            *filename;
+    DEVICE_OUTPUT   output;
+    int             status;
+    BOOLEAN         done;
+} DEVICE_JOB;
+
+typedef struct {
+    RUN_OPTIONS     *run;
+    DEVICE_JOB      *jobs;
+    UINTN           job_count;
+    UINTN           next_job;       // first job no worker has taken yet
+    pthread_mutex_t lock;
+    pthread_cond_t  job_done;
+} DEVICE_POOL;
+
+// idle workers take the next device in line, so a slow disk never holds up
+// the ones behind it
+static void * device_worker(void *arg)
+{
+    DEVICE_POOL *pool = arg;
+    DEVICE_JOB  *job;
+    
+    for (;;) {
+        pthread_mutex_lock(&pool->lock);
+        job = (pool->next_job < pool->job_count) ? &pool->jobs[pool->next_job++] : NULL;
+        pthread_mutex_unlock(&pool->lock);
+        if (job == NULL)
+            break;
+        
+        pthread_setspecific(output_key, &job->output);
+        Print(L"==> %s <==\n", job->filename);
+        job->status = run_device(job->filename, pool->run);
+        pthread_setspecific(output_key, NULL);
+        
+        pthread_mutex_lock(&pool->lock);
+        job->done = TRUE;
+        pthread_cond_broadcast(&pool->job_done);
+        pthread_mutex_unlock(&pool->lock);
+    }
+    return NULL;
+}
+
+// returns the highest status of all devices
+static int run_devices(char **filenames, UINTN count, UINTN worker_count, RUN_OPTIONS *run)
+{
+    DEVICE_POOL pool;
+    pthread_t   *workers;
+    UINTN       i, started;
+    int         status;
+    
+    if (output_init() != 0)
+        return 1;
+    
+    ZeroMem(&pool, sizeof(pool));
+    pool.run       = run;
+    pool.job_count = count;
+    pool.jobs      = calloc(count, sizeof(DEVICE_JOB));
+    workers        = calloc(worker_count, sizeof(pthread_t));
+    if (pool.jobs == NULL || workers == NULL) {
+        error("Out of memory");
+        free(pool.jobs);
+        free(workers);
+        return 1;
+    }
+    for (i = 0; i < count; i++) {
+        pool.jobs[i].filename = filenames[i];
+        output_open(&pool.jobs[i].output);
+    }
+    pthread_mutex_init(&pool.lock, NULL);
+    pthread_cond_init(&pool.job_done, NULL);
+    
+    for (started = 0; started < worker_count; started++)
+        if (pthread_create(&workers[started], NULL, device_worker, &pool) != 0)
+            break;
+    if (started == 0)
+        device_worker(&pool);       // no threads to spare, go through the devices here
+    
+    // print each device's output as soon as it and all before it are done
+    status = 0;
+    for (i = 0; i < count; i++) {
+        pthread_mutex_lock(&pool.lock);
+        while (!pool.jobs[i].done)
+            pthread_cond_wait(&pool.job_done, &pool.lock);
+        pthread_mutex_unlock(&pool.lock);
+        
+        output_flush(&pool.jobs[i].output);
+        if (pool.jobs[i].status > status)
+            status = pool.jobs[i].status;
+    }
+    
+    for (i = 0; i < started; i++)
+        pthread_join(workers[i], NULL);
+    pthread_cond_destroy(&pool.job_done);
+    pthread_mutex_destroy(&pool.lock);
+    free(workers);
+    free(pool.jobs);
+    return status;
+}
+
+//
+// keep the reports of all devices at hand
+//
+
+// the report is what showpart prints for the device, its errors last
+static UINTN report_device(VOID *context, char *filename, char **report, UINTN *length)
+{
+    DEVICE_OUTPUT output;
+    char          *data;
+    UINTN         status;
+    
+    output_open(&output);
+    pthread_setspecific(output_key, &output);
+    status = run_device(filename, (RUN_OPTIONS *)context);
+    pthread_setspecific(output_key, NULL);
+    pthread_mutex_destroy(&output.lock);
+    
+    data = realloc(output.out.data, output.out.length + output.err.length + 1);
+    if (data == NULL) {
+        free(output.out.data);
+        free(output.err.data);
+        return 1;
+    }
+    if (output.err.length > 0)
+        memcpy(data + output.out.length, output.err.data, output.err.length);
+    free(output.err.data);
+    
+    *report = data;
+    *length = output.out.length + output.err.length;
+    return status;
+}
+
+//
+// collect the devices to scan
+//
+
+typedef struct {
+    char    **names;
+    UINTN   count;
+    UINTN   capacity;
+} DEVICE_LIST;
+
+static int device_list_add(DEVICE_LIST *list, const char *name)
+{
+    char    **names;
+    UINTN   capacity;
+    
+    if (list->count == list->capacity) {
+        capacity = (list->capacity == 0) ? 16 : list->capacity * 2;
+        names = realloc(list->names, capacity * sizeof(char *));
+        if (names == NULL) {
+            error("Out of memory");
+            return 1;
+        }
+        list->names    = names;
+        list->capacity = capacity;
+    }
+    list->names[list->count] = strdup(name);
+    if (list->names[list->count] == NULL) {
+        error("Out of memory");
+        return 1;
+    }
+    list->count++;
+    return 0;
+}
+
+// wildcards the shell left alone; without a match the name is kept as is
+static int device_list_add_glob(DEVICE_LIST *list, const char *pattern)
+{
+    glob_t  g;
+    size_t  i;
+    int     status;
+    
+    if (strpbrk(pattern, "*?[") == NULL || glob(pattern, 0, NULL, &g) != 0)
+        return device_list_add(list, pattern);
+    
+    status = 0;
+    for (i = 0; i < g.gl_pathc && status == 0; i++)
+        status = device_list_add(list, g.gl_pathv[i]);
+    globfree(&g);
+    return status;
+}
+
+static int device_list_read(DEVICE_LIST *list, FILE *stream)
+{
+    char    line[4096];
+    size_t  length;
+    
+    while (fgets(line, sizeof(line), stream) != NULL) {
+        length = strlen(line);
+        while (length > 0 && (line[length-1] == '\n' || line[length-1] == '\r'))
+            line[--length] = 0;
+        if (length == 0)
+            continue;
+        if (strcmp(line, "-") == 0) {
+            error("standard input can't be both the device list and a device");
+            return 1;
+        }
+        if (device_list_add(list, line) != 0)
+            return 1;
+    }
+    if (ferror(stream)) {
+        errore("Can't read the device list");
+        return 1;
+    }
+    return 0;
+}
+
+static void device_list_free(DEVICE_LIST *list)
+{
+    UINTN   i;
+    
+    for (i = 0; i < list->count; i++)
+        free(list->names[i]);
+    free(list->names);
+}
+
 //
 // main entry point
 //
 
 int main(int argc, char *argv[])
 {
-    char   *filename;
-    struct stat sb;
-    int    filekind;
-    UINT64 filesize;
-    char   *reason;
-    int    status;
+    char   *type_db, *boot_db, *inventory_socket;
+    int    i, status;
+    RUN_OPTIONS run;
+    DEVICE_LIST devices;
+    BOOLEAN many_devices, read_device_list, recover;
+    UINTN  cpu_count, job_count;
     
     progname         = PROGNAME_S;
-	fill_mbr         = TRUE;
-	create_empty_mbr = FALSE;
+	many_devices     = (strcmp(progname, "showpart") == 0);     // gptsync takes partitions after its device
+	read_device_list = FALSE;
+	inventory_socket = NULL;
+	recover          = FALSE;
+	job_count        = 0;
+	type_db          = getenv("GPTSYNC_TYPE_DB");
+	boot_db          = getenv("GPTSYNC_BOOT_DB");
+	ZeroMem(&run, sizeof(run));
+	ZeroMem(&devices, sizeof(devices));
+	run.fill_mbr                       = TRUE;
+	run.open_options.image_sector_size = 512;
+	run.open_options.mmap_write        = FALSE;
+	run.open_options.read_only         = many_devices;  // showpart only reads
+	run.open_options.queue_depth       = 32;
 
 	/* Check for options.  */
 	while (1) {
-		int c = getopt_long (argc, argv, "nethV", options, 0);
+		int c = getopt_long (argc, argv, "nb:d:ef:i:j:lmq:rstzhV", options, 0);
 		if (c == -1)
 			break;
 		else
 			switch (c) {
 				case 'n':
-					fill_mbr = FALSE;
+					run.fill_mbr = FALSE;
+					break;
+
+				case 'b':
+					run.open_options.image_sector_size = atoi(optarg);
+					break;
+
+				case 'd':
+					type_db = optarg;
 					break;
 
 				case 'e':
-					create_empty_mbr = TRUE;
+					run.create_empty_mbr = TRUE;
+					break;
+
+				case 'f':
+					boot_db = optarg;
+					break;
+
+				case 'i':
+					inventory_socket = optarg;
+					break;
+
+				case 'j':
+					if (atoi(optarg) < 1) {
+						error("invalid number of jobs '%s' !", optarg);
+						return 1;
+					}
+					job_count = atoi(optarg);
+					break;
+
+				case 'l':
+					read_device_list = TRUE;
+					break;
+
+				case 'm':
+					run.open_options.mmap_write = TRUE;
+					break;
+
+				case 'q':
+					if (atoi(optarg) < 1) {
+						error("invalid queue depth '%s' !", optarg);
+						return 1;
+					}
+					run.open_options.queue_depth = atoi(optarg);
+					break;
+
+				case 'r':
+					recover = TRUE;
+					break;
+
+				case 's':
+					run.show_stats = TRUE;
 					break;
 					
 				case 't':
 					list_types();
 					return 0;
 
+				case 'z':
+					run.check_contents = TRUE;
+					break;
+
 				case 'h':
 					usage (0);
 					break;
@@ -309,84 +1591,79 @@ int main(int argc, char *argv[])
 	}
 	
 	/* 1 parameters minimum needed.  */
-	if (optind >= argc) {
+	if (optind >= argc && !(many_devices && (read_device_list || inventory_socket != NULL))) {
 		fprintf (stderr, "No enough parameters.\n");
 		usage (1);
     }
 
-	if (argc - optind > 4) {
+	if (!many_devices && inventory_socket != NULL) {
+		error("only showpart can keep an inventory.");
+		return 1;
+	}
+
+	if (!many_devices && argc - optind > 4) {
 		error("only 3 partitions can be in hybrid MBR.");
 		return 1;
 	}
-		
-    filename = argv[optind];
-    
-    // set input to unbuffered
-    fflush(NULL);
-    setvbuf(stdin, NULL, _IONBF, 0);
     
-    // stat check
-    if (stat(filename, &sb) < 0) {
-        errore("Can't stat %.300s", filename);
-        return 1;
+    if (many_devices) {
+        for (i = optind; i < argc; i++)
+            if (device_list_add_glob(&devices, argv[i]) != 0)
+                return 1;
+        if (read_device_list && device_list_read(&devices, stdin) != 0)
+            return 1;
+        if (devices.count == 0 && inventory_socket == NULL) {
+            error("no devices to scan");
+            return 1;
+        }
+        run.optind = argc;
+    } else {
+        if (device_list_add(&devices, argv[optind]) != 0)
+            return 1;
+        run.optind = optind+1;
     }
+    run.argc = argc;
+    run.argv = argv;
     
-    filekind = 0;
-    filesize = 0;
-    reason = NULL;
-    if (S_ISREG(sb.st_mode))
-        filesize = sb.st_size;
-    else if (S_ISBLK(sb.st_mode))
-        filekind = 1;
-    else if (S_ISCHR(sb.st_mode))
-        filekind = 2;
-    else if (S_ISDIR(sb.st_mode))
-        reason = "Is a directory";
-    else if (S_ISFIFO(sb.st_mode))
-        reason = "Is a FIFO";
-#ifdef S_ISSOCK
-    else if (S_ISSOCK(sb.st_mode))
-        reason = "Is a socket";
-#endif
-    else
-        reason = "Is an unknown kind of special file";
-    
-    if (reason != NULL) {
-        error("%.300s: %s", filename, reason);
+    if (type_db != NULL && type_db[0] != 0 && load_db(type_db, "type database", gpt_load_type_db) != 0)
+        return 1;
+    if (boot_db != NULL && boot_db[0] != 0 && load_db(boot_db, "boot code database", bootcode_load_db) != 0)
         return 1;
-    }
     
-    // open file
-    fd = open(filename, O_RDWR|O_SHLOCK);
-    if (fd < 0 && errno == EBUSY) {
-        fd = open(filename, O_RDONLY);
-#ifndef NOREADONLYWARN
-        if (fd >= 0)
-            printf("Warning: %.300s opened read-only\n", filename);
-#endif
-    }
-    if (fd < 0) {
-        errore("Can't open %.300s", filename);
+    // build the lookup tables before any worker thread exists
+    if (PROGNAME_INIT() != 0)
         return 1;
-    }
     
-    // (try to) guard against TTY character devices
-    if (filekind == 2) {
-        if (isatty(fd)) {
-            error("%.300s: Is a TTY device", filename);
-            return 1;
-        }
-    }
+    // set input to unbuffered
+    fflush(NULL);
+    setvbuf(stdin, NULL, _IONBF, 0);
     
-    // run sync algorithm
-    status = PROGNAME(optind+1, argc, argv);
-    printf("\n");
+    cpu_count = (UINTN)sysconf(_SC_NPROCESSORS_ONLN);
+    if (cpu_count < 1)
+        cpu_count = 1;
     
-    // close file
-    if (close(fd) != 0) {
-        errore("Error while closing %.300s", filename);
-        return 1;
+    if (devices.count == 1 && inventory_socket == NULL) {
+        run.recover_threads  = recover ? cpu_count : 0;
+        run.recover_progress = TRUE;
+        status = run_device(devices.names[0], &run);
+    } else {
+        // the CPUs are shared out among the devices being scanned; progress
+        // lines from several devices would only garble each other
+        if (job_count == 0) {
+            job_count = cpu_count * INFLIGHT_PER_CPU / run.open_options.queue_depth;
+            if (job_count < cpu_count)
+                job_count = cpu_count;
+        }
+        if (job_count > devices.count && inventory_socket == NULL)
+            job_count = devices.count;
+        run.recover_threads = recover ? (cpu_count > job_count ? cpu_count / job_count : 1) : 0;
+        if (inventory_socket != NULL)
+            status = (output_init() == 0) ?
+                     inventory_serve(inventory_socket, devices.names, devices.count, job_count, report_device, &run) : 1;
+        else
+            status = run_devices(devices.names, devices.count, job_count, &run);
     }
     
+    device_list_free(&devices);
     return status;
 }
@@ -0,0 +1,157 @@
+/*
+ * gptsync/parttypes.h
+ * Partition type tables, the single source for the lookup tables in lib.c
+ *
+ * Copyright (c) 2006 Christoph Pfisterer
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are
+ * met:
+ *
+ *  * Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ *
+ *  * Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the
+ *    distribution.
+ *
+ *  * Neither the name of Christoph Pfisterer nor the names of the
+ *    contributors may be used to endorse or promote products derived
+ *    from this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+ * A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT
+ * OWNER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+ * SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT
+ * LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+ * DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+ * THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+ * OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+//
+// Included several times, each time with MBR_TYPE(type, name) and/or
+// GPT_TYPE(guid, mbr_type, name, kind) defined to expand the entries into
+// one table. Undefined macros expand to nothing, both are undefined at the
+// end. GUIDs are given in on-disk byte order.
+//
+
+#ifndef MBR_TYPE
+#define MBR_TYPE(type, name)
+#endif
+#ifndef GPT_TYPE
+#define GPT_TYPE(guid, mbr_type, name, kind)
+#endif
+
+//
+// MBR partition types
+//
+
+MBR_TYPE(0x01, "FAT12 (CHS)")
+MBR_TYPE(0x04, "FAT16 <32M (CHS)")
+MBR_TYPE(0x05, "Extended (CHS)")
+MBR_TYPE(0x06, "FAT16 (CHS)")
+MBR_TYPE(0x07, "NTFS/HPFS")
+MBR_TYPE(0x0b, "FAT32 (CHS)")
+MBR_TYPE(0x0c, "FAT32 (LBA)")
+MBR_TYPE(0x0e, "FAT16 (LBA)")
+MBR_TYPE(0x0f, "Extended (LBA)")
+MBR_TYPE(0x11, "Hidden FAT12 (CHS)")
+MBR_TYPE(0x14, "Hidden FAT16 <32M (CHS)")
+MBR_TYPE(0x16, "Hidden FAT16 (CHS)")
+MBR_TYPE(0x17, "Hidden NTFS/HPFS")
+MBR_TYPE(0x1b, "Hidden FAT32 (CHS)")
+MBR_TYPE(0x1c, "Hidden FAT32 (LBA)")
+MBR_TYPE(0x1e, "Hidden FAT16 (LBA)")
+MBR_TYPE(0x82, "Linux swap / Solaris")
+MBR_TYPE(0x83, "Linux")
+MBR_TYPE(0x85, "Linux Extended")
+MBR_TYPE(0x86, "NT FAT volume set")
+MBR_TYPE(0x87, "NTFS volume set")
+MBR_TYPE(0x8e, "Linux LVM")
+MBR_TYPE(0xa5, "FreeBSD")
+MBR_TYPE(0xa6, "OpenBSD")
+MBR_TYPE(0xa7, "NeXTSTEP")
+MBR_TYPE(0xa8, "Mac OS X UFS")
+MBR_TYPE(0xa9, "NetBSD")
+MBR_TYPE(0xab, "Mac OS X Boot")
+MBR_TYPE(0xac, "Apple RAID")
+MBR_TYPE(0xaf, "Mac OS X HFS+")
+MBR_TYPE(0xbe, "Solaris Boot")
+MBR_TYPE(0xbf, "Solaris")
+MBR_TYPE(0xeb, "BeOS")
+MBR_TYPE(0xee, "EFI Protective")
+MBR_TYPE(0xef, "EFI System (FAT)")
+MBR_TYPE(0xfd, "Linux RAID")
+
+//
+// GPT partition types
+//
+
+// Defined by EFI/UEFI specification
+GPT_TYPE("\x28\x73\x2A\xC1\x1F\xF8\xD2\x11\xBA\x4B\x00\xA0\xC9\x3E\xC9\x3B", 0xef, "EFI System (FAT)", GPT_KIND_SYSTEM)
+GPT_TYPE("\x41\xEE\x4D\x02\xE7\x33\xD3\x11\x9D\x69\x00\x08\xC7\x81\xF3\x9F", 0x00, "MBR partition scheme", GPT_KIND_FATAL)
+// Generally well-known
+GPT_TYPE("\x16\xE3\xC9\xE3\x5C\x0B\xB8\x4D\x81\x7D\xF9\x2D\xF0\x02\x15\xAE", 0x00, "MS Reserved", GPT_KIND_SYSTEM)
+GPT_TYPE("\xA2\xA0\xD0\xEB\xE5\xB9\x33\x44\x87\xC0\x68\xB6\xB7\x26\x99\xC7", 0x00, "Basic Data", GPT_KIND_BASIC_DATA)
+// From Wikipedia
+GPT_TYPE("\xAA\xC8\x08\x58\x8F\x7E\xE0\x42\x85\xD2\xE1\xE9\x04\x34\xCF\xB3", 0x00, "MS LDM Metadata", GPT_KIND_FATAL)
+GPT_TYPE("\xA0\x60\x9B\xAF\x31\x14\x62\x4F\xBC\x68\x33\x11\x71\x4A\x69\xAD", 0x00, "MS LDM Data", GPT_KIND_FATAL)
+GPT_TYPE("\x1E\x4C\x89\x75\xEB\x3A\xD3\x11\xB7\xC1\x7B\x03\xA0\x00\x00\x00", 0x00, "HP/UX Data", GPT_KIND_DATA)
+GPT_TYPE("\x28\xE7\xA1\xE2\xE3\x32\xD6\x11\xA6\x82\x7B\x03\xA0\x00\x00\x00", 0x00, "HP/UX Service", GPT_KIND_SYSTEM)
+// From Linux repository, fs/partitions/efi.h
+GPT_TYPE("\x0F\x88\x9D\xA1\xFC\x05\x3B\x4D\xA0\x06\x74\x3F\x0F\x84\x91\x1E", 0xfd, "Linux RAID", GPT_KIND_DATA)
+GPT_TYPE("\x6D\xFD\x57\x06\xAB\xA4\xC4\x43\x84\xE5\x09\x33\xC8\x4B\x4F\x4F", 0x82, "Linux Swap", GPT_KIND_SYSTEM)
+GPT_TYPE("\x79\xD3\xD6\xE6\x07\xF5\xC2\x44\xA2\x3C\x23\x8F\x2A\x3D\xF9\x28", 0x8e, "Linux LVM", GPT_KIND_DATA)
+// From Wikipedia
+GPT_TYPE("\x39\x33\xA6\x8D\x07\x00\xC0\x60\xC4\x36\x08\x3A\xC8\x23\x09\x08", 0x00, "Linux Reserved", GPT_KIND_SYSTEM)
+// From grub2 repository, grub/include/grub/gpt_partition.h
+GPT_TYPE("\x48\x61\x68\x21\x49\x64\x6F\x6E\x74\x4E\x65\x65\x64\x45\x46\x49", 0x00, "GRUB2 BIOS Boot", GPT_KIND_SYSTEM)
+// From FreeBSD repository, sys/sys/gpt.h
+GPT_TYPE("\xB4\x7C\x6E\x51\xCF\x6E\xD6\x11\x8F\xF8\x00\x02\x2D\x09\x71\x2B", 0xa5, "FreeBSD Data", GPT_KIND_DATA)
+GPT_TYPE("\xB5\x7C\x6E\x51\xCF\x6E\xD6\x11\x8F\xF8\x00\x02\x2D\x09\x71\x2B", 0x00, "FreeBSD Swap", GPT_KIND_SYSTEM)
+GPT_TYPE("\xB6\x7C\x6E\x51\xCF\x6E\xD6\x11\x8F\xF8\x00\x02\x2D\x09\x71\x2B", 0xa5, "FreeBSD UFS", GPT_KIND_DATA)
+GPT_TYPE("\xB8\x7C\x6E\x51\xCF\x6E\xD6\x11\x8F\xF8\x00\x02\x2D\x09\x71\x2B", 0x00, "FreeBSD Vinum", GPT_KIND_DATA)
+GPT_TYPE("\xBA\x7C\x6E\x51\xCF\x6E\xD6\x11\x8F\xF8\x00\x02\x2D\x09\x71\x2B", 0xa5, "FreeBSD ZFS", GPT_KIND_DATA)
+GPT_TYPE("\x9D\x6B\xBD\x83\x41\x7F\xDC\x11\xBE\x0B\x00\x15\x60\xB8\x4F\x0F", 0xa5, "FreeBSD Boot", GPT_KIND_DATA)
+// From NetBSD repository, sys/sys/disklabel_gpt.h
+GPT_TYPE("\x32\x8D\xF4\x49\x0E\xB1\xDC\x11\xB9\x9B\x00\x19\xD1\x87\x96\x48", 0x00, "NetBSD Swap", GPT_KIND_SYSTEM)
+GPT_TYPE("\x5A\x8D\xF4\x49\x0E\xB1\xDC\x11\xB9\x9B\x00\x19\xD1\x87\x96\x48", 0xa9, "NetBSD FFS", GPT_KIND_DATA)
+GPT_TYPE("\x82\x8D\xF4\x49\x0E\xB1\xDC\x11\xB9\x9B\x00\x19\xD1\x87\x96\x48", 0xa9, "NetBSD LFS", GPT_KIND_DATA)
+GPT_TYPE("\xAA\x8D\xF4\x49\x0E\xB1\xDC\x11\xB9\x9B\x00\x19\xD1\x87\x96\x48", 0xa9, "NetBSD RAID", GPT_KIND_DATA)
+GPT_TYPE("\xC4\x19\xB5\x2D\x0E\xB1\xDC\x11\xB9\x9B\x00\x19\xD1\x87\x96\x48", 0xa9, "NetBSD CCD", GPT_KIND_DATA)
+GPT_TYPE("\xEC\x19\xB5\x2D\x0E\xB1\xDC\x11\xB9\x9B\x00\x19\xD1\x87\x96\x48", 0xa9, "NetBSD CGD", GPT_KIND_DATA)
+// From http://developer.apple.com/mac/library/technotes/tn2006/tn2166.html
+GPT_TYPE("\x00\x53\x46\x48\x00\x00\xAA\x11\xAA\x11\x00\x30\x65\x43\xEC\xAC", 0xaf, "Mac OS X HFS+", GPT_KIND_DATA)
+GPT_TYPE("\x00\x53\x46\x55\x00\x00\xAA\x11\xAA\x11\x00\x30\x65\x43\xEC\xAC", 0xa8, "Mac OS X UFS", GPT_KIND_DATA)
+GPT_TYPE("\x74\x6F\x6F\x42\x00\x00\xAA\x11\xAA\x11\x00\x30\x65\x43\xEC\xAC", 0xab, "Mac OS X Boot", GPT_KIND_DATA)
+GPT_TYPE("\x44\x49\x41\x52\x00\x00\xAA\x11\xAA\x11\x00\x30\x65\x43\xEC\xAC", 0xac, "Apple RAID", GPT_KIND_DATA)
+GPT_TYPE("\x44\x49\x41\x52\x4F\x5F\xAA\x11\xAA\x11\x00\x30\x65\x43\xEC\xAC", 0xac, "Apple RAID (Offline)", GPT_KIND_DATA)
+GPT_TYPE("\x65\x62\x61\x4C\x00\x6C\xAA\x11\xAA\x11\x00\x30\x65\x43\xEC\xAC", 0x00, "Apple Label", GPT_KIND_SYSTEM)
+// From Wikipedia
+GPT_TYPE("\x6F\x63\x65\x52\x65\x76\xAA\x11\xAA\x11\x00\x30\x65\x43\xEC\xAC", 0x00, "Apple TV Recovery", GPT_KIND_BASIC_DATA)
+GPT_TYPE("\x72\x6f\x74\x53\x67\x61\xAA\x11\xAA\x11\x00\x30\x65\x43\xEC\xAC", 0xaf, "Apple Core Storage", GPT_KIND_DATA)
+// From OpenSolaris repository, usr/src/uts/common/sys/efi_partition.h
+GPT_TYPE("\x7f\x23\x96\x6A\xD2\x1D\xB2\x11\x99\xa6\x08\x00\x20\x73\x66\x31", 0x00, "Solaris Reserved", GPT_KIND_SYSTEM)
+GPT_TYPE("\x45\xCB\x82\x6A\xD2\x1D\xB2\x11\x99\xa6\x08\x00\x20\x73\x66\x31", 0xbf, "Solaris Boot", GPT_KIND_DATA)
+GPT_TYPE("\x4D\xCF\x85\x6A\xD2\x1D\xB2\x11\x99\xa6\x08\x00\x20\x73\x66\x31", 0xbf, "Solaris Root", GPT_KIND_DATA)
+GPT_TYPE("\x6F\xC4\x87\x6A\xD2\x1D\xB2\x11\x99\xa6\x08\x00\x20\x73\x66\x31", 0x00, "Solaris Swap", GPT_KIND_SYSTEM)
+GPT_TYPE("\xC3\x8C\x89\x6A\xD2\x1D\xB2\x11\x99\xa6\x08\x00\x20\x73\x66\x31", 0xbf, "Solaris Usr / Apple ZFS", GPT_KIND_DATA)
+GPT_TYPE("\x2B\x64\x8B\x6A\xD2\x1D\xB2\x11\x99\xa6\x08\x00\x20\x73\x66\x31", 0x00, "Solaris Backup", GPT_KIND_SYSTEM)
+GPT_TYPE("\xC7\x2A\x8D\x6A\xD2\x1D\xB2\x11\x99\xa6\x08\x00\x20\x73\x66\x31", 0x00, "Solaris Reserved (Stand)", GPT_KIND_SYSTEM)
+GPT_TYPE("\xE9\xF2\x8E\x6A\xD2\x1D\xB2\x11\x99\xa6\x08\x00\x20\x73\x66\x31", 0xbf, "Solaris Var", GPT_KIND_DATA)
+GPT_TYPE("\x39\xBA\x90\x6A\xD2\x1D\xB2\x11\x99\xa6\x08\x00\x20\x73\x66\x31", 0xbf, "Solaris Home", GPT_KIND_DATA)
+GPT_TYPE("\xA5\x83\x92\x6A\xD2\x1D\xB2\x11\x99\xa6\x08\x00\x20\x73\x66\x31", 0x00, "Solaris Alternate Sector", GPT_KIND_SYSTEM)
+GPT_TYPE("\x3B\x5A\x94\x6A\xD2\x1D\xB2\x11\x99\xa6\x08\x00\x20\x73\x66\x31", 0x00, "Solaris Reserved (Cache)", GPT_KIND_SYSTEM)
+GPT_TYPE("\xD1\x30\x96\x6A\xD2\x1D\xB2\x11\x99\xa6\x08\x00\x20\x73\x66\x31", 0x00, "Solaris Reserved", GPT_KIND_SYSTEM)
+GPT_TYPE("\x67\x07\x98\x6A\xD2\x1D\xB2\x11\x99\xa6\x08\x00\x20\x73\x66\x31", 0x00, "Solaris Reserved", GPT_KIND_SYSTEM)
+
+#undef MBR_TYPE
+#undef GPT_TYPE
+
+/* EOF */
@@ -0,0 +1,370 @@
+/*
+ * gptsync/recover.c
+ * Multi-threaded scan of a whole disk for lost partitions, Unix only
+ *
+ * Copyright (c) 2006-2007 Christoph Pfisterer
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are
+ * met:
+ *
+ *  * Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ *
+ *  * Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the
+ *    distribution.
+ *
+ *  * Neither the name of Christoph Pfisterer nor the names of the
+ *    contributors may be used to endorse or promote products derived
+ *    from this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+ * A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT
+ * OWNER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+ * SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT
+ * LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+ * DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+ * THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+ * OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include "gptsync.h"
+
+#include <pthread.h>
+
+// the disk is handed to the workers in chunks of this size
+#define RECOVER_CHUNK_SIZE  (8*1024*1024)
+// candidates a worker collects before handing them over
+#define RECOVER_BATCH       (256)
+#define RECOVER_MAX_THREADS (64)
+
+typedef struct {
+    DISK_DEVICE         *disk;
+    VOID                *output;            // where the workers' messages go
+    UINTN               chunk_sectors;
+    UINTN               before, after;      // margins around a chunk, in sectors
+    
+    pthread_mutex_t     lock;               // protects everything below
+    pthread_mutex_t     io_lock;            // serializes disks that aren't thread-safe
+    pthread_cond_t      finished;           // a worker is done
+    UINT64              next_lba;           // next sector to hand out
+    UINT64              run_end;            // end of the allocated run next_lba is in
+    UINT64              end_lba;
+    UINT64              done_sectors;       // scanned or skipped as holes
+    UINT64              hole_sectors;
+    UINTN               failed_chunks;
+    UINTN               running;            // workers still going
+    UINTN               status;             // nonzero stops all workers
+    RECOVER_CANDIDATE   *found;
+    UINTN               found_count, found_capacity;
+} RECOVER_SCAN;
+
+//
+// work distribution
+//
+
+// Hands out the next chunk of allocated sectors, skipping holes. The disk
+// is read front to back, so the device sees mostly sequential requests.
+static BOOLEAN recover_next_chunk(RECOVER_SCAN *scan, UINT64 *lba, UINTN *count)
+{
+    UINT64  run_start;
+    UINTN   status;
+    BOOLEAN have_chunk = FALSE;
+    
+    pthread_mutex_lock(&scan->lock);
+    while (scan->status == 0 && scan->next_lba < scan->end_lba) {
+        if (scan->next_lba < scan->run_end) {
+            *lba = scan->next_lba;
+            *count = (scan->run_end - scan->next_lba < scan->chunk_sectors) ?
+                     (UINTN)(scan->run_end - scan->next_lba) : scan->chunk_sectors;
+            scan->next_lba += *count;
+            have_chunk = TRUE;
+            break;
+        }
+        
+        if (!scan->disk->thread_safe)
+            pthread_mutex_lock(&scan->io_lock);
+        status = disk_find_data(scan->disk, scan->next_lba, scan->end_lba, &run_start, &scan->run_end);
+        if (!scan->disk->thread_safe)
+            pthread_mutex_unlock(&scan->io_lock);
+        if (status != 0) {
+            scan->status = status;
+            break;
+        }
+        scan->hole_sectors += run_start - scan->next_lba;
+        scan->done_sectors += run_start - scan->next_lba;
+        scan->next_lba = run_start;
+    }
+    pthread_mutex_unlock(&scan->lock);
+    return have_chunk;
+}
+
+static UINTN recover_add(RECOVER_SCAN *scan, RECOVER_CANDIDATE *found, UINTN count)
+{
+    RECOVER_CANDIDATE   *grown;
+    UINTN               status = 0;
+    
+    pthread_mutex_lock(&scan->lock);
+    if (scan->found_count + count > scan->found_capacity) {
+        scan->found_capacity = (scan->found_capacity + count) * 2;
+        grown = realloc(scan->found, scan->found_capacity * sizeof(RECOVER_CANDIDATE));
+        if (grown == NULL) {
+            error("Out of memory");
+            scan->status = status = 1;
+        } else
+            scan->found = grown;
+    }
+    if (status == 0) {
+        CopyMem(scan->found + scan->found_count, found, count * sizeof(RECOVER_CANDIDATE));
+        scan->found_count += count;
+    }
+    pthread_mutex_unlock(&scan->lock);
+    return status;
+}
+
+//
+// worker threads
+//
+
+static void * recover_worker(void *arg)
+{
+    RECOVER_SCAN        *scan = arg;
+    UINTN               sector_size = scan->disk->sector_size;
+    UINT8               *buffer, *data;
+    RECOVER_CANDIDATE   *found;
+    UINT64              lba, read_lba, read_end;
+    UINTN               count, done, found_count, status;
+    BOOLEAN             read_ok;
+    
+    output_set_target(scan->output);
+    
+    // each chunk is read with enough of its neighbours for every probe
+    // whose key byte lies inside the chunk
+    buffer = alloc_io_buffer((scan->before + scan->chunk_sectors + scan->after) * sector_size);
+    found  = AllocatePool(RECOVER_BATCH * sizeof(RECOVER_CANDIDATE));
+    if (buffer == NULL || found == NULL) {
+        error("Out of memory");
+        pthread_mutex_lock(&scan->lock);
+        scan->status = 1;
+        pthread_mutex_unlock(&scan->lock);
+    }
+    
+    while (buffer != NULL && found != NULL && recover_next_chunk(scan, &lba, &count)) {
+        data = buffer + scan->before * sector_size;
+        read_lba = (lba > scan->before) ? lba - scan->before : 0;
+        read_end = lba + count + scan->after;
+        if (read_end > scan->end_lba)
+            read_end = scan->end_lba;
+        ZeroMem(buffer, (scan->before + scan->chunk_sectors + scan->after) * sector_size);
+        
+        if (!scan->disk->thread_safe)
+            pthread_mutex_lock(&scan->io_lock);
+        status = disk_read(scan->disk, read_lba, (UINTN)(read_end - read_lba), data - (lba - read_lba) * sector_size);
+        if (!scan->disk->thread_safe)
+            pthread_mutex_unlock(&scan->io_lock);
+        
+        read_ok = (status == 0);
+        status = 0;
+        for (done = 0; read_ok && done < count && status == 0; ) {
+            found_count = 0;
+            done += recover_scan_sectors(sector_size, lba + done, count - done, data + done * sector_size,
+                                         found, RECOVER_BATCH, &found_count);
+            if (found_count > 0)
+                status = recover_add(scan, found, found_count);
+        }
+        
+        pthread_mutex_lock(&scan->lock);
+        if (!read_ok)
+            scan->failed_chunks++;      // an unreadable stretch, carry on after it
+        scan->done_sectors += count;
+        pthread_mutex_unlock(&scan->lock);
+    }
+    
+    if (buffer != NULL)
+        free_io_buffer(buffer);
+    if (found != NULL)
+        FreePool(found);
+    pthread_mutex_lock(&scan->lock);
+    scan->running--;
+    pthread_cond_signal(&scan->finished);
+    pthread_mutex_unlock(&scan->lock);
+    return NULL;
+}
+
+//
+// results
+//
+
+static int recover_compare_key(const void *a, const void *b)
+{
+    const RECOVER_CANDIDATE *ca = a, *cb = b;
+    
+    if (ca->key_position != cb->key_position)
+        return (ca->key_position < cb->key_position) ? -1 : 1;
+    if (ca->probe != cb->probe)
+        return (ca->probe < cb->probe) ? -1 : 1;
+    return 0;
+}
+
+static int recover_compare(const void *a, const void *b)
+{
+    const RECOVER_CANDIDATE *ca = a, *cb = b;
+    
+    if (ca->start_lba != cb->start_lba)
+        return (ca->start_lba < cb->start_lba) ? -1 : 1;
+    if (ca->probe != cb->probe)
+        return (ca->probe < cb->probe) ? -1 : 1;
+    return 0;
+}
+
+// Sorts the candidates by start and drops the ones that are part of an
+// earlier file system (backup superblocks, images stored inside it),
+// start where another probe already matched, or read a signature another
+// probe already explains (the same swap magic fits 4K and 64K pages).
+static UINTN recover_filter(RECOVER_CANDIDATE *found, UINTN count, UINT64 block_count)
+{
+    UINTN   i, kept;
+    UINT64  covered_end;
+    
+    qsort(found, count, sizeof(RECOVER_CANDIDATE), recover_compare_key);
+    kept = 0;
+    for (i = 0; i < count; i++) {
+        if (kept > 0 && found[i].key_position == found[kept-1].key_position)
+            continue;
+        found[kept++] = found[i];
+    }
+    count = kept;
+    
+    qsort(found, count, sizeof(RECOVER_CANDIDATE), recover_compare);
+    kept = 0;
+    covered_end = 0;
+    for (i = 0; i < count; i++) {
+        if (kept > 0 && found[i].start_lba == found[kept-1].start_lba)
+            continue;
+        if (found[i].start_lba < covered_end)
+            continue;
+        found[kept] = found[i];
+        // a size that runs past the end of the disk can't be trusted to
+        // hide anything
+        if (found[i].sector_count > 0 && found[i].sector_count <= block_count - found[i].start_lba &&
+            found[i].start_lba + found[i].sector_count > covered_end)
+            covered_end = found[i].start_lba + found[i].sector_count;
+        kept++;
+    }
+    return kept;
+}
+
+static VOID recover_progress(RECOVER_SCAN *scan, struct timeval *start, BOOLEAN final)
+{
+    struct timeval  now;
+    double          elapsed, done_mb, total_mb;
+    
+    gettimeofday(&now, NULL);
+    elapsed  = (now.tv_sec - start->tv_sec) + (now.tv_usec - start->tv_usec) / 1e6;
+    done_mb  = (double)scan->done_sectors * scan->disk->sector_size / (1024 * 1024);
+    total_mb = (double)scan->end_lba * scan->disk->sector_size / (1024 * 1024);
+    fprintf(stderr, "\rRecovery scan: %.0f of %.0f MiB (%.0f%%), %.0f MiB/s, %d candidates%s",
+            done_mb, total_mb, total_mb > 0 ? 100 * done_mb / total_mb : 100.0,
+            elapsed > 0 ? done_mb / elapsed : 0.0, (int)scan->found_count, final ? "\n" : "   ");
+    fflush(stderr);
+}
+
+//
+// entry point
+//
+
+// Scans the whole disk for file systems with thread_count workers. The
+// candidates are returned sorted by start LBA; the caller frees them.
+UINTN recover_scan(SCAN_CONTEXT *ctx, UINTN thread_count, RECOVER_CANDIDATE **found, UINTN *found_count)
+{
+    RECOVER_SCAN    scan;
+    pthread_t       threads[RECOVER_MAX_THREADS];
+    UINTN           i, started, before, after;
+    UINTN           sector_size = ctx->raw_disk->sector_size;
+    BOOLEAN         show_progress;
+    struct timeval  start, now;
+    struct timespec deadline;
+    
+    *found = NULL;
+    *found_count = 0;
+    if (ctx->raw_disk->sequential || ctx->raw_disk->block_count == 0) {
+        error("The recovery scan needs a seekable device of known size");
+        return 1;
+    }
+    if (thread_count < 1)
+        thread_count = 1;
+    if (thread_count > RECOVER_MAX_THREADS)
+        thread_count = RECOVER_MAX_THREADS;
+    
+    ZeroMem(&scan, sizeof(scan));
+    scan.disk          = ctx->raw_disk;
+    scan.output        = output_get_target();
+    scan.chunk_sectors = RECOVER_CHUNK_SIZE / sector_size;
+    scan.end_lba       = ctx->raw_disk->block_count;
+    recover_margins(&before, &after);
+    scan.before = (before + sector_size - 1) / sector_size;
+    scan.after  = (after + sector_size - 1) / sector_size;
+    pthread_mutex_init(&scan.lock, NULL);
+    pthread_mutex_init(&scan.io_lock, NULL);
+    pthread_cond_init(&scan.finished, NULL);
+    
+    gettimeofday(&start, NULL);
+    show_progress = ctx->recover_progress && isatty(fileno(stderr));
+    
+    for (started = 0; started < thread_count; started++) {
+        pthread_mutex_lock(&scan.lock);
+        scan.running++;
+        pthread_mutex_unlock(&scan.lock);
+        if (pthread_create(&threads[started], NULL, recover_worker, &scan) != 0) {
+            pthread_mutex_lock(&scan.lock);
+            scan.running--;
+            pthread_mutex_unlock(&scan.lock);
+            break;
+        }
+    }
+    if (started == 0) {
+        error("Can't start the recovery scan");
+        scan.status = 1;
+    }
+    
+    // report progress about once a second until the workers are done
+    pthread_mutex_lock(&scan.lock);
+    while (scan.running > 0) {
+        gettimeofday(&now, NULL);
+        deadline.tv_sec  = now.tv_sec + 1;
+        deadline.tv_nsec = now.tv_usec * 1000;
+        if (pthread_cond_timedwait(&scan.finished, &scan.lock, &deadline) != 0 && show_progress)
+            recover_progress(&scan, &start, FALSE);
+    }
+    pthread_mutex_unlock(&scan.lock);
+    for (i = 0; i < started; i++)
+        pthread_join(threads[i], NULL);
+    if (show_progress)
+        recover_progress(&scan, &start, TRUE);
+    
+    pthread_cond_destroy(&scan.finished);
+    pthread_mutex_destroy(&scan.io_lock);
+    pthread_mutex_destroy(&scan.lock);
+    
+    if (scan.hole_sectors > 0)
+        Print(L"Skipped %lld unallocated sectors.\n", scan.hole_sectors);
+    if (scan.failed_chunks > 0)
+        Print(L"Warning: %d chunks of %d MiB could not be read and were skipped.\n",
+              scan.failed_chunks, RECOVER_CHUNK_SIZE / (1024 * 1024));
+    if (scan.status != 0) {
+        free(scan.found);
+        return scan.status;
+    }
+    
+    *found       = scan.found;
+    *found_count = recover_filter(scan.found, scan.found_count, scan.end_lba);
+    return 0;
+}
+
+/* EOF */
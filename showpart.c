@@ -37,99 +37,190 @@
 #include "gptsync.h"
 
 //
-// memory string search
+// detect boot code
+//
+// Signatures that may appear anywhere in the sector are found in one pass
+// by an Aho-Corasick automaton. It is compiled into a full transition
+// table on first use, so the scan is one table lookup per byte no matter
+// how many signatures there are. Every match is recorded.
 //
 
-static INTN FindMem(VOID *Buffer, UINTN BufferLength, VOID *SearchString, UINTN SearchStringLength)
+// boot loaders, in order of precedence for the name that is shown
+#define BOOT_LILO           (0)
+#define BOOT_SYSLINUX       (1)
+#define BOOT_ISOLINUX       (2)
+#define BOOT_GRUB           (3)
+#define BOOT_FREEBSD        (4)
+#define BOOT_OPENBSD        (5)
+#define BOOT_NETBSD         (6)
+#define BOOT_NTLDR          (7)
+#define BOOT_BOOTMGR        (8)
+#define BOOT_FREEDOS        (9)
+#define BOOT_ECS            (10)
+#define BOOT_BEOS           (11)
+#define BOOT_ZETA           (12)
+#define BOOT_HAIKU          (13)
+#define BOOT_NONSYSTEM      (14)    // dummy FAT boot sector, overrides the others
+#define BOOT_LOADERS        (15)    // at most 32, matches are kept in a bit mask
+
+static CHARN *bootcode_names[BOOT_LOADERS] = {
+    STR("LILO"),
+    STR("SYSLINUX"),
+    STR("ISOLINUX"),
+    STR("GRUB"),
+    STR("FreeBSD"),
+    STR("OpenBSD"),
+    STR("NetBSD"),
+    STR("Windows NTLDR"),
+    STR("Windows BOOTMGR (Vista)"),
+    STR("FreeDOS"),
+    STR("eComStation"),
+    STR("BeOS"),
+    STR("ZETA"),
+    STR("Haiku"),
+    STR("None (Non-system disk message)"),
+};
+
+// signatures found anywhere in the sector
+static struct {
+    UINTN   loader;
+    char    *pattern;
+    UINTN   length;
+} bootcode_patterns[] = {
+    { BOOT_ISOLINUX,  "ISOLINUX", 8 },
+    { BOOT_GRUB,      "Geom\0Hard Disk\0Read\0 Error\0", 27 },
+    { BOOT_FREEBSD,   "Starting the BTX loader", 23 },
+    { BOOT_OPENBSD,   "!Loading", 8 },
+    { BOOT_OPENBSD,   "/cdboot\0/CDBOOT\0", 16 },
+    { BOOT_NETBSD,    "Not a bootxx image", 18 },
+    { BOOT_NTLDR,     "NTLDR", 5 },
+    { BOOT_BOOTMGR,   "BOOTMGR", 7 },
+    { BOOT_FREEDOS,   "CPUBOOT SYS", 11 },
+    { BOOT_FREEDOS,   "KERNEL  SYS", 11 },
+    { BOOT_ECS,       "OS2LDR", 6 },
+    { BOOT_ECS,       "OS2BOOT", 7 },
+    { BOOT_BEOS,      "Be Boot Loader", 14 },
+    { BOOT_ZETA,      "yT Boot Loader", 14 },
+    { BOOT_HAIKU,     "\x04" "beos\x06" "system\x05" "zbeos", 18 },
+    { BOOT_NONSYSTEM, "Non-system disk", 15 },
+    { 0, NULL, 0 },
+};
+
+static UINT16   *bootcode_next = NULL;      // [state * 256 + byte], state 0 is the root
+static UINT32   *bootcode_out = NULL;       // loaders matched on reaching a state
+
+static UINTN bootcode_compile(VOID)
 {
-    UINT8 *BufferPtr;
-    UINTN Offset;
-    
-    BufferPtr = Buffer;
-    BufferLength -= SearchStringLength;
-    for (Offset = 0; Offset < BufferLength; Offset++, BufferPtr++) {
-        if (CompareMem(BufferPtr, SearchString, SearchStringLength) == 0)
-            return (INTN)Offset;
+    UINTN   max_states, state_count, i, k, state, c, child, head, tail;
+    UINT16  *next, *fail, *queue;
+    UINT32  *out;
+    
+    max_states = 1;
+    for (i = 0; bootcode_patterns[i].pattern != NULL; i++)
+        max_states += bootcode_patterns[i].length;
+    if (max_states > 65536) {
+        error("Too many boot code signatures");
+        return 1;
+    }
+    next  = AllocatePool(max_states * 256 * sizeof(UINT16));
+    out   = AllocatePool(max_states * sizeof(UINT32));
+    fail  = AllocatePool(max_states * sizeof(UINT16));
+    queue = AllocatePool(max_states * sizeof(UINT16));
+    if (next == NULL || out == NULL || fail == NULL || queue == NULL) {
+        error("Out of memory");
+        return 1;
+    }
+    ZeroMem(next, max_states * 256 * sizeof(UINT16));
+    ZeroMem(out, max_states * sizeof(UINT32));
+    
+    // trie of all patterns; no state but the root has an edge back to 0
+    state_count = 1;
+    for (i = 0; bootcode_patterns[i].pattern != NULL; i++) {
+        state = 0;
+        for (k = 0; k < bootcode_patterns[i].length; k++) {
+            c = (UINT8)bootcode_patterns[i].pattern[k];
+            if (next[state * 256 + c] == 0)
+                next[state * 256 + c] = (UINT16)state_count++;
+            state = next[state * 256 + c];
+        }
+        out[state] |= 1UL << bootcode_patterns[i].loader;
     }
     
-    return -1;
+    // breadth-first: a state's failure link is known before its children's,
+    // missing edges take the transition of the failure state
+    head = tail = 0;
+    for (c = 0; c < 256; c++) {
+        child = next[c];
+        if (child != 0) {
+            fail[child] = 0;
+            queue[tail++] = (UINT16)child;
+        }
+    }
+    while (head < tail) {
+        state = queue[head++];
+        for (c = 0; c < 256; c++) {
+            child = next[state * 256 + c];
+            if (child != 0) {
+                fail[child] = next[fail[state] * 256 + c];
+                out[child] |= out[fail[child]];
+                queue[tail++] = (UINT16)child;
+            } else {
+                next[state * 256 + c] = next[fail[state] * 256 + c];
+            }
+        }
+    }
+    
+    FreePool(fail);
+    FreePool(queue);
+    bootcode_out  = out;
+    bootcode_next = next;
+    return 0;
 }
 
-//
-// detect boot code
-//
-
-static UINTN detect_bootcode(UINT64 partlba, CHARN **bootcodename)
+// returns the name to show and the set of all loaders found
+static UINTN detect_bootcode(UINT8 *data, CHARN **bootcodename, UINT32 *matches)
 {
-    UINTN   status;
     BOOLEAN bootable;
-    
-    // read MBR data
-    status = read_sector(partlba, sector);
-    if (status != 0)
-        return status;
+    UINTN   i, state, status;
     
     // check bootable signature
-    if (*((UINT16 *)(sector + 510)) == 0xaa55 && sector[0] != 0)
+    if (*((UINT16 *)(data + 510)) == 0xaa55 && data[0] != 0)
         bootable = TRUE;
     else
         bootable = FALSE;
     *bootcodename = NULL;
+    *matches = 0;
     
-    // detect specific boot codes
-    if (CompareMem(sector + 2, "LILO", 4) == 0 ||
-        CompareMem(sector + 6, "LILO", 4) == 0) {
-        *bootcodename = STR("LILO");
-        
-    } else if (CompareMem(sector + 3, "SYSLINUX", 8) == 0) {
-        *bootcodename = STR("SYSLINUX");
-        
-    } else if (FindMem(sector, 512, "ISOLINUX", 8) >= 0) {
-        *bootcodename = STR("ISOLINUX");
-        
-    } else if (FindMem(sector, 512, "Geom\0Hard Disk\0Read\0 Error\0", 27) >= 0) {
-        *bootcodename = STR("GRUB");
-        
-    } else if ((*((UINT32 *)(sector + 502)) == 0 &&
-                *((UINT32 *)(sector + 506)) == 50000 &&
-                *((UINT16 *)(sector + 510)) == 0xaa55) ||
-               FindMem(sector, 512, "Starting the BTX loader", 23) >= 0) {
-        *bootcodename = STR("FreeBSD");
-        
-    } else if (FindMem(sector, 512, "!Loading", 8) >= 0 ||
-               FindMem(sector, 512, "/cdboot\0/CDBOOT\0", 16) >= 0) {
-        *bootcodename = STR("OpenBSD");
-        
-    } else if (FindMem(sector, 512, "Not a bootxx image", 18) >= 0) {
-        *bootcodename = STR("NetBSD");
-        
-    } else if (FindMem(sector, 512, "NTLDR", 5) >= 0) {
-        *bootcodename = STR("Windows NTLDR");
-        
-    } else if (FindMem(sector, 512, "BOOTMGR", 7) >= 0) {
-        *bootcodename = STR("Windows BOOTMGR (Vista)");
-        
-    } else if (FindMem(sector, 512, "CPUBOOT SYS", 11) >= 0 ||
-               FindMem(sector, 512, "KERNEL  SYS", 11) >= 0) {
-        *bootcodename = STR("FreeDOS");
-        
-    } else if (FindMem(sector, 512, "OS2LDR", 6) >= 0 ||
-               FindMem(sector, 512, "OS2BOOT", 7) >= 0) {
-        *bootcodename = STR("eComStation");
-        
-    } else if (FindMem(sector, 512, "Be Boot Loader", 14) >= 0) {
-        *bootcodename = STR("BeOS");
-        
-    } else if (FindMem(sector, 512, "yT Boot Loader", 14) >= 0) {
-        *bootcodename = STR("ZETA");
-        
-    } else if (FindMem(sector, 512, "\x04" "beos\x06" "system\x05" "zbeos", 18) >= 0) {
-        *bootcodename = STR("Haiku");
-        
+    // signatures at fixed offsets
+    if (CompareMem(data + 2, "LILO", 4) == 0 ||
+        CompareMem(data + 6, "LILO", 4) == 0)
+        *matches |= 1UL << BOOT_LILO;
+    if (CompareMem(data + 3, "SYSLINUX", 8) == 0)
+        *matches |= 1UL << BOOT_SYSLINUX;
+    if (*((UINT32 *)(data + 502)) == 0 &&
+        *((UINT32 *)(data + 506)) == 50000 &&
+        *((UINT16 *)(data + 510)) == 0xaa55)
+        *matches |= 1UL << BOOT_FREEBSD;
+    
+    // everything else in one pass over the sector
+    if (bootcode_next == NULL) {
+        status = bootcode_compile();
+        if (status != 0)
+            return status;
+    }
+    state = 0;
+    for (i = 0; i < 512; i++) {
+        state = bootcode_next[state * 256 + data[i]];
+        *matches |= bootcode_out[state];
     }
     
-    if (FindMem(sector, 512, "Non-system disk", 15) >= 0)   // dummy FAT boot sector
-        *bootcodename = STR("None (Non-system disk message)");
+    // the first loader in order of precedence names the code, but a dummy
+    // FAT boot sector overrides all
+    for (i = 0; i < BOOT_LOADERS && *bootcodename == NULL; i++)
+        if (*matches & (1UL << i))
+            *bootcodename = bootcode_names[i];
+    if (*matches & (1UL << BOOT_NONSYSTEM))
+        *bootcodename = bootcode_names[BOOT_NONSYSTEM];
     
     // TODO: Add a note if a specific code was detected, but the sector is not bootable?
     
@@ -147,13 +238,17 @@ static UINTN detect_bootcode(UINT64 partlba, CHARN **bootcodename)
 // check one partition
 //
 
-static UINTN analyze_part(UINT64 partlba)
+static UINTN analyze_part(SCAN_CONTEXT *ctx, UINT64 partlba, UINT64 end_lba, UINT8 *probe)
 {
     UINTN   status;
     UINTN   i;
     CHARN   *bootcodename;
-    UINTN   parttype;
-    CHARN   *fsname;
+    UINT32  bootmatches;
+    FS_INFO fs;
+#ifndef CONFIG_EFI
+    UINT64  boothash;
+    CHARN   *bootname, *bootversion;
+#endif
     
     if (partlba == 0)
         Print(L"\nMBR contents:\n");
@@ -161,33 +256,53 @@ static UINTN analyze_part(UINT64 partlba)
         Print(L"\nPartition at LBA %lld:\n", partlba);
     
     // detect boot code
-    status = detect_bootcode(partlba, &bootcodename);
+    status = detect_bootcode(probe, &bootcodename, &bootmatches);
     if (status)
         return status;
     Print(L" Boot Code: %s\n", bootcodename);
+    for (i = 0; i < BOOT_LOADERS; i++) {
+        if ((bootmatches & (1UL << i)) && bootcode_names[i] != bootcodename)
+            Print(L" Also found: %s signature\n", bootcode_names[i]);
+    }
+#ifndef CONFIG_EFI
+    if (bootcode_fingerprint(probe, partlba == 0, &boothash, &bootname, &bootversion)) {
+        if (bootname != NULL)
+            Print(L" Boot Code Fingerprint: %016llx, %s %s\n", boothash, bootname, bootversion);
+        else
+            Print(L" Boot Code Fingerprint: %016llx, not in database\n", boothash);
+    }
+#endif
     
     if (partlba == 0)
         return 0;   // short-circuit MBR analysis
     
     // detect file system
-    status = detect_mbrtype_fs(partlba, &parttype, &fsname);
+    status = detect_fs_data(ctx, probe, partlba, end_lba, &fs);
     if (status)
         return status;
-    Print(L" File System: %s\n", fsname);
+    Print(L" File System: %s\n", fs.name);
+    if (fs.uuid[0])
+        Print(L" UUID: %s\n", fs.uuid);
+    if (fs.label[0])
+        Print(L" Label: %s\n", fs.label);
+    if (fs.size > 0)
+        Print(L" Size: %lld bytes\n", fs.size);
+    if (fs.block_size > 0)
+        Print(L" Block Size: %d bytes\n", fs.block_size);
     
     // cross-reference with partition table
-    for (i = 0; i < gpt_part_count; i++) {
-        if (gpt_parts[i].start_lba == partlba) {
+    for (i = 0; i < ctx->gpt_part_count; i++) {
+        if (ctx->gpt_parts[i].start_lba == partlba) {
             Print(L" Listed in GPT as partition %d, type %s\n", i+1,
-                  gpt_parts[i].gpt_parttype->name);
+                  ctx->gpt_parts[i].gpt_parttype->name);
         }
     }
-    for (i = 0; i < mbr_part_count; i++) {
-        if (mbr_parts[i].start_lba == partlba) {
+    for (i = 0; i < ctx->mbr_part_count; i++) {
+        if (ctx->mbr_parts[i].start_lba == partlba) {
             Print(L" Listed in MBR as partition %d, type %02x  %s%s\n", i+1,
-                  mbr_parts[i].mbr_type,
-                  mbr_parttype_name(mbr_parts[i].mbr_type),
-                  mbr_parts[i].active ? STR(", active") : STR(""));
+                  ctx->mbr_parts[i].mbr_type,
+                  mbr_parttype_name(ctx->mbr_parts[i].mbr_type),
+                  ctx->mbr_parts[i].active ? STR(", active") : STR(""));
         }
     }
     
@@ -198,63 +313,213 @@ static UINTN analyze_part(UINT64 partlba)
 // check all partitions
 //
 
-static UINTN analyze_parts(VOID)
+static UINTN analyze_parts(SCAN_CONTEXT *ctx)
 {
     UINTN   i, k;
     UINTN   status;
     BOOLEAN is_dupe;
+    UINT64  *part_lbas, *part_ends;
+    UINTN   part_count, request_count, probe_size;
+    UINT8   *probe_buffer;
+    IO_REQUEST *requests;
     
-    // check MBR (bootcode only)
-    status = analyze_part(0);
-    if (status)
-        return status;
-    
-    // check partitions listed in GPT
-    for (i = 0; i < gpt_part_count; i++) {
-        status = analyze_part(gpt_parts[i].start_lba);
-        if (status)
-            return status;
+    // collect the start LBAs to check: the MBR itself (boot code only),
+    // partitions listed in GPT, and partitions listed in MBR but not in GPT
+    part_lbas = arena_alloc(&ctx->arena, (1 + ctx->gpt_part_count + ctx->mbr_part_count) * sizeof(UINT64), 0);
+    part_ends = arena_alloc(&ctx->arena, (1 + ctx->gpt_part_count + ctx->mbr_part_count) * sizeof(UINT64), 0);
+    if (part_lbas == NULL || part_ends == NULL)
+        return 1;
+    part_count = 0;
+    part_lbas[part_count] = 0;
+    part_ends[part_count++] = FS_PROBE_NO_END;
+    for (i = 0; i < ctx->gpt_part_count; i++) {
+        part_lbas[part_count] = ctx->gpt_parts[i].start_lba;
+        part_ends[part_count++] = ctx->gpt_parts[i].end_lba;
     }
-    
-    // check partitions listed in MBR, but not in GPT
-    for (i = 0; i < mbr_part_count; i++) {
-        if (mbr_parts[i].start_lba == 1 && mbr_parts[i].mbr_type == 0xee)
+    for (i = 0; i < ctx->mbr_part_count; i++) {
+        if (ctx->mbr_parts[i].start_lba == 1 && ctx->mbr_parts[i].mbr_type == 0xee)
             continue;   // skip EFI Protective entry
         
         is_dupe = FALSE;
-        for (k = 0; k < gpt_part_count; k++)
-            if (gpt_parts[k].start_lba == mbr_parts[i].start_lba)
+        for (k = 0; k < ctx->gpt_part_count; k++)
+            if (ctx->gpt_parts[k].start_lba == ctx->mbr_parts[i].start_lba)
                 is_dupe = TRUE;
         
         if (!is_dupe) {
-            status = analyze_part(mbr_parts[i].start_lba);
-            if (status)
-                return status;
+            part_lbas[part_count] = ctx->mbr_parts[i].start_lba;
+            part_ends[part_count++] = ctx->mbr_parts[i].end_lba;
         }
     }
     
+    // read the probe regions of all partitions in one batch
+    probe_size = fs_probe_size(ctx);
+    probe_buffer = arena_alloc(&ctx->arena, part_count * probe_size, MAX_SECTOR_SIZE);
+    requests = arena_alloc(&ctx->arena, part_count * FS_PROBE_MAX_REGIONS * sizeof(IO_REQUEST), 0);
+    if (probe_buffer == NULL || requests == NULL)
+        return 1;
+    request_count = 0;
+    for (i = 0; i < part_count; i++) {
+        k = fs_probe_requests(ctx, part_lbas[i], part_ends[i], probe_buffer + i * probe_size,
+                              requests + request_count);
+        if (part_lbas[i] == 0 && k > 1)
+            request_count += 1;     // MBR: boot sector only
+        else
+            request_count += k;
+    }
+    status = disk_read_batch(ctx->disk, requests, request_count);
+    if (status != 0)
+        return status;
+    
+    // evaluate the probes
+    for (i = 0; i < part_count; i++) {
+        status = analyze_part(ctx, part_lbas[i], part_ends[i], probe_buffer + i * probe_size);
+        if (status)
+            return status;
+    }
+    
     return 0;
 }
 
+//
+// classify the contents of all partitions
+//
+
+static UINTN show_contents(SCAN_CONTEXT *ctx)
+{
+    PARTITION_INFO  *parts;
+    UINTN           part_count, i, status, contents;
+    UINT64          data_lba;
+    
+    // the GPT if there is one, the MBR otherwise
+    parts      = ctx->gpt_parts;
+    part_count = ctx->gpt_part_count;
+    if (part_count == 0) {
+        parts      = ctx->mbr_parts;
+        part_count = ctx->mbr_part_count;
+    }
+    if (part_count == 0)
+        return 0;
+    if (ctx->raw_disk->sequential) {
+        error("Checking partition contents needs a seekable device");
+        return 1;
+    }
+    
+    Print(L"\nPartition contents:\n");
+    Print(L" #      Start LBA      End LBA  Contents\n");
+    for (i = 0; i < part_count; i++) {
+        if (parts[i].mbr_type == 0xee)
+            continue;   // skip EFI Protective entry
+        
+        status = scan_contents(ctx, parts[i].start_lba, parts[i].end_lba, &contents, &data_lba);
+        if (status != 0)
+            return status;
+        Print(L" %d   %12lld %12lld  ", parts[i].index + 1, parts[i].start_lba, parts[i].end_lba);
+        if (contents == CONTENTS_SPARSE)
+            Print(L"sparse, nothing allocated\n");
+        else if (contents == CONTENTS_ZERO)
+            Print(L"all zeros\n");
+        else
+            Print(L"data from LBA %lld\n", data_lba);
+    }
+    
+    return 0;
+}
+
+#ifndef CONFIG_EFI
+
+//
+// look for lost partitions
+//
+
+static UINTN show_recovered(SCAN_CONTEXT *ctx)
+{
+    RECOVER_CANDIDATE   *found;
+    UINTN               found_count, i, k, status;
+    
+    Print(L"\nScanning the whole disk for file systems...\n");
+    status = recover_scan(ctx, ctx->recover_threads, &found, &found_count);
+    if (status != 0)
+        return status;
+    
+    if (found_count == 0)
+        Print(L" No file systems found\n");
+    else
+        Print(L" #      Start LBA      End LBA  File System\n");
+    for (i = 0; i < found_count; i++) {
+        if (found[i].sector_count > 0)
+            Print(L" %d   %12lld %12lld  %s", i+1, found[i].start_lba,
+                  found[i].start_lba + found[i].sector_count - 1, found[i].fs.name);
+        else
+            Print(L" %d   %12lld            ?  %s", i+1, found[i].start_lba, found[i].fs.name);
+        if (found[i].fs.label[0])
+            Print(L" \"%s\"", found[i].fs.label);
+        for (k = 0; k < ctx->gpt_part_count; k++)
+            if (ctx->gpt_parts[k].start_lba == found[i].start_lba)
+                Print(L", GPT partition %d", ctx->gpt_parts[k].index + 1);
+        for (k = 0; k < ctx->mbr_part_count; k++)
+            if (ctx->mbr_parts[k].start_lba == found[i].start_lba)
+                Print(L", MBR partition %d", ctx->mbr_parts[k].index + 1);
+        Print(L"\n");
+        if (found[i].fs.uuid[0])
+            Print(L"      UUID: %s\n", found[i].fs.uuid);
+    }
+    
+    free(found);
+    return 0;
+}
+
+#endif
+
 //
 // display algorithm entry point
 //
 
-UINTN showpart(VOID)
+UINTN showpart_init(VOID)
+{
+    lib_init();
+    if (bootcode_next == NULL)
+        return bootcode_compile();
+    return 0;
+}
+
+UINTN showpart(SCAN_CONTEXT *ctx, int optind, int argc, char **argv)
 {
     UINTN   status = 0;
     UINTN   status_gpt, status_mbr;
     
     // get full information from disk
-    status_gpt = read_gpt();
-    status_mbr = read_mbr();
-    if (status_gpt != 0 || status_mbr != 0)
+    status_gpt = read_gpt(ctx);
+    status_mbr = read_mbr(ctx);
+    if (status_gpt != 0 || status_mbr != 0) {
+#ifndef CONFIG_EFI
+        // a damaged table is when the recovery scan matters most
+        if (ctx->recover_threads > 0)
+            show_recovered(ctx);
+#endif
         return (status_gpt || status_mbr);
+    }
+    
+    // fetch everything the analysis will need in a few large reads
+    plan_reads(ctx, TRUE);
     
     // analyze all partitions
-    status = analyze_parts();
+    status = analyze_parts(ctx);
     if (status != 0)
         return status;
     
+    if (ctx->check_contents) {
+        status = show_contents(ctx);
+        if (status != 0)
+            return status;
+    }
+    
+#ifndef CONFIG_EFI
+    if (ctx->recover_threads > 0) {
+        status = show_recovered(ctx);
+        if (status != 0)
+            return status;
+    }
+#endif
+    
     return status;
 }
@@ -0,0 +1,87 @@
+/*
+ * gptsync/typedb.h
+ * On-disk format of the external partition type database
+ *
+ * Copyright (c) 2006 Christoph Pfisterer
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are
+ * met:
+ *
+ *  * Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ *
+ *  * Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the
+ *    distribution.
+ *
+ *  * Neither the name of Christoph Pfisterer nor the names of the
+ *    contributors may be used to endorse or promote products derived
+ *    from this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+ * A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT
+ * OWNER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+ * SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT
+ * LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+ * DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+ * THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+ * OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#ifndef __TYPEDB_H__
+#define __TYPEDB_H__
+
+//
+// A type database is built by mktypedb from a text source and mapped
+// read-only by gptsync and showpart. All fields are little-endian. The
+// file is laid out as
+//
+//   TYPEDB_HEADER
+//   TYPEDB_ENTRY   entries[entry_count]
+//   UINT32         index[index_size]     entry number + 1, 0 = empty slot
+//   CHAR8          names[names_size]     NUL-terminated UTF-8 strings
+//
+// The index is an open-addressing hash table over the GUIDs, probed
+// linearly from typedb_guid_hash(guid) & (index_size - 1). It is at most
+// half full.
+//
+
+#define TYPEDB_MAGIC        "GPTTYPDB"
+#define TYPEDB_VERSION      (1)
+
+typedef struct {
+    UINT8   magic[8];
+    UINT32  version;
+    UINT32  entry_count;
+    UINT32  index_size;         // a power of two
+    UINT32  names_size;
+} TYPEDB_HEADER;
+
+typedef struct {
+    UINT8   guid[16];           // on-disk byte order, as in GPT entries
+    UINT32  name_offset;        // into the name table
+    UINT8   mbr_type;
+    UINT8   kind;               // GPT_KIND_*
+    UINT8   reserved[2];
+} TYPEDB_ENTRY;
+
+// also used for the index over the built-in table
+static UINT32 typedb_guid_hash(UINT8 *guid)
+{
+    UINT32  w[4], hash;
+    
+    CopyMem(w, guid, 16);
+    hash = w[0] * 0x9E3779B1 ^ w[1] * 0x85EBCA77 ^ w[2] * 0xC2B2AE3D ^ w[3] * 0x27D4EB2F;
+    hash ^= hash >> 15;
+    return hash;
+}
+
+#endif
+
+/* EOF */
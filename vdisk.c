@@ -0,0 +1,847 @@
+/*
+ * gptsync/vdisk.c
+ * Read-only backends for virtual disk image containers
+ * (qcow2, VHD, VHDX and VMDK monolithic sparse)
+ *
+ * Copyright (c) 2006-2007 Christoph Pfisterer
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are
+ * met:
+ *
+ *  * Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ *
+ *  * Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the
+ *    distribution.
+ *
+ *  * Neither the name of Christoph Pfisterer nor the names of the
+ *    contributors may be used to endorse or promote products derived
+ *    from this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+ * A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT
+ * OWNER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+ * SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT
+ * LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+ * DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+ * THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+ * OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include "gptsync.h"
+
+// host offset returned by the mapping functions for ranges that read as zeros
+#define VDISK_ZERO          ((UINT64)-1)
+
+// refuse images whose top-level table would need more memory than this
+#define VDISK_MAX_TABLE     (64*1024*1024)
+
+typedef struct _VIRTUAL_DISK VIRTUAL_DISK;
+
+struct _VIRTUAL_DISK {
+    DISK_DEVICE disk;
+    DISK_DEVICE *lower;                 // the container file
+    
+    // translates a guest byte offset into a host byte offset; run is set to
+    // the number of bytes that stay contiguous from there
+    UINTN       (*map)(VIRTUAL_DISK *vd, UINT64 offset, UINT64 *host_offset, UINT64 *run);
+    
+    UINT64      size;                   // guest size in bytes
+    UINT64      block_size;             // mapping granularity in bytes
+    UINT64      *table;                 // qcow2 L1, VHD/VHDX BAT, VMDK grain directory
+    UINT64      table_entries;
+    UINT8       *l2;                    // last second-level table (qcow2 L2, VMDK grain table)
+    UINTN       l2_size;
+    UINT64      l2_offset;              // its host offset, VDISK_ZERO if none
+    UINT64      data_offset;            // fixed VHD: start of the guest data
+    UINT64      bitmap_size;            // VHD: sector bitmap in front of each block
+    UINT64      chunk_ratio;            // VHDX: payload blocks per sector bitmap block
+    UINT64      grain_table_entries;    // VMDK
+    
+    UINT8       *bounce;                // one host sector for unaligned access
+};
+
+//
+// byte order helpers
+//
+
+static UINT16 get_le16(UINT8 *p)
+{
+    return (UINT16)(p[0] | (p[1] << 8));
+}
+
+static UINT32 get_le32(UINT8 *p)
+{
+    return (UINT32)p[0] | ((UINT32)p[1] << 8) | ((UINT32)p[2] << 16) | ((UINT32)p[3] << 24);
+}
+
+static UINT64 get_le64(UINT8 *p)
+{
+    return (UINT64)get_le32(p) | ((UINT64)get_le32(p + 4) << 32);
+}
+
+static UINT32 get_be32(UINT8 *p)
+{
+    return ((UINT32)p[0] << 24) | ((UINT32)p[1] << 16) | ((UINT32)p[2] << 8) | (UINT32)p[3];
+}
+
+static UINT64 get_be64(UINT8 *p)
+{
+    return ((UINT64)get_be32(p) << 32) | (UINT64)get_be32(p + 4);
+}
+
+//
+// access to the container file at byte granularity
+//
+
+static UINTN host_read(VIRTUAL_DISK *vd, UINT64 offset, UINT64 length, UINT8 *buffer)
+{
+    UINTN   status;
+    UINTN   host_sector_size = vd->lower->sector_size;
+    UINT64  skip, chunk, count;
+    
+    while (length > 0) {
+        skip = offset % host_sector_size;
+        if (skip == 0 && length >= host_sector_size) {
+            // whole sectors go straight into the caller's buffer
+            count = length / host_sector_size;
+            status = disk_read(vd->lower, offset / host_sector_size, (UINTN)count, buffer);
+            if (status != 0)
+                return status;
+            chunk = count * host_sector_size;
+        } else {
+            status = disk_read(vd->lower, offset / host_sector_size, 1, vd->bounce);
+            if (status != 0)
+                return status;
+            chunk = host_sector_size - skip;
+            if (chunk > length)
+                chunk = length;
+            CopyMem(buffer, vd->bounce + skip, (UINTN)chunk);
+        }
+        offset += chunk;
+        length -= chunk;
+        buffer += chunk;
+    }
+    return 0;
+}
+
+// reads a top-level table of 32-bit or 64-bit entries into vd->table
+static UINTN load_table(VIRTUAL_DISK *vd, UINT64 offset, UINT64 entries, UINTN entry_size, BOOLEAN big_endian)
+{
+    UINTN   status;
+    UINT64  i;
+    UINT8   *raw;
+    
+    if (entries == 0 || entries > VDISK_MAX_TABLE / sizeof(UINT64)) {
+        error("Image has an unsupported table size");
+        return 1;
+    }
+    vd->table = AllocatePool((UINTN)entries * sizeof(UINT64));
+    raw = AllocatePool((UINTN)entries * entry_size);
+    if (vd->table == NULL || raw == NULL) {
+        error("Out of memory");
+        if (raw != NULL)
+            FreePool(raw);
+        return 1;
+    }
+    vd->table_entries = entries;
+    
+    status = host_read(vd, offset, entries * entry_size, raw);
+    if (status == 0) {
+        for (i = 0; i < entries; i++) {
+            if (entry_size == 8)
+                vd->table[i] = big_endian ? get_be64(raw + i * 8) : get_le64(raw + i * 8);
+            else
+                vd->table[i] = big_endian ? get_be32(raw + i * 4) : get_le32(raw + i * 4);
+        }
+    }
+    FreePool(raw);
+    return status;
+}
+
+// second-level tables are cached one at a time, lookups are mostly local
+static UINTN load_l2(VIRTUAL_DISK *vd, UINT64 offset)
+{
+    UINTN   status;
+    
+    if (vd->l2_offset == offset)
+        return 0;
+    vd->l2_offset = VDISK_ZERO;
+    status = host_read(vd, offset, vd->l2_size, vd->l2);
+    if (status != 0)
+        return status;
+    vd->l2_offset = offset;
+    return 0;
+}
+
+//
+// qcow2 (versions 2 and 3, no backing file, no compression, no encryption)
+//
+
+#define QCOW2_OFFSET_MASK   (0x00fffffffffffe00ULL)
+#define QCOW2_COMPRESSED    (1ULL << 62)
+#define QCOW2_ZERO          (1ULL << 0)
+
+static UINTN qcow2_map(VIRTUAL_DISK *vd, UINT64 offset, UINT64 *host_offset, UINT64 *run)
+{
+    UINTN   status;
+    UINT64  in_block, l1_index, l2_index, l2_offset, entry;
+    UINT64  l2_entries = vd->l2_size / 8;
+    
+    in_block = offset % vd->block_size;
+    *run = vd->block_size - in_block;
+    *host_offset = VDISK_ZERO;
+    
+    l1_index = offset / vd->block_size / l2_entries;
+    l2_index = (offset / vd->block_size) % l2_entries;
+    if (l1_index >= vd->table_entries)
+        return 0;
+    l2_offset = vd->table[l1_index] & QCOW2_OFFSET_MASK;
+    if (l2_offset == 0)
+        return 0;
+    
+    status = load_l2(vd, l2_offset);
+    if (status != 0)
+        return status;
+    entry = get_be64(vd->l2 + l2_index * 8);
+    if (entry & QCOW2_COMPRESSED) {
+        error("qcow2 image: compressed clusters are not supported");
+        return 1;
+    }
+    if ((entry & QCOW2_ZERO) || (entry & QCOW2_OFFSET_MASK) == 0)
+        return 0;
+    *host_offset = (entry & QCOW2_OFFSET_MASK) + in_block;
+    return 0;
+}
+
+static UINTN qcow2_open(VIRTUAL_DISK *vd, UINT8 *header)
+{
+    UINT32  version, cluster_bits;
+    UINT64  incompatible;
+    
+    version      = get_be32(header + 4);
+    cluster_bits = get_be32(header + 20);
+    if (version != 2 && version != 3) {
+        error("qcow2 image: unsupported version %d", (int)version);
+        return 1;
+    }
+    if (get_be64(header + 8) != 0) {
+        error("qcow2 image: backing files are not supported");
+        return 1;
+    }
+    if (get_be32(header + 32) != 0) {
+        error("qcow2 image: encrypted images are not supported");
+        return 1;
+    }
+    if (version == 3) {
+        // corrupt (bit 1), external data file (bit 2), extended L2 (bit 4)
+        incompatible = get_be64(header + 72);
+        if (incompatible & ~0x9ULL) {
+            error("qcow2 image: unsupported incompatible features 0x%llx", incompatible);
+            return 1;
+        }
+    }
+    if (cluster_bits < 9 || cluster_bits > 21) {
+        error("qcow2 image: invalid cluster size");
+        return 1;
+    }
+    
+    vd->map        = qcow2_map;
+    vd->size       = get_be64(header + 24);
+    vd->block_size = 1ULL << cluster_bits;
+    vd->l2_size    = (UINTN)vd->block_size;
+    return load_table(vd, get_be64(header + 40), get_be32(header + 36), 8, TRUE);
+}
+
+//
+// VHD (fixed and dynamic, no differencing disks)
+//
+
+#define VHD_TYPE_FIXED      (2)
+#define VHD_TYPE_DYNAMIC    (3)
+#define VHD_UNALLOCATED     (0xffffffffULL)
+
+static UINTN vhd_fixed_map(VIRTUAL_DISK *vd, UINT64 offset, UINT64 *host_offset, UINT64 *run)
+{
+    *host_offset = vd->data_offset + offset;
+    *run = vd->size - offset;
+    return 0;
+}
+
+static UINTN vhd_map(VIRTUAL_DISK *vd, UINT64 offset, UINT64 *host_offset, UINT64 *run)
+{
+    UINT64  block, in_block;
+    
+    block    = offset / vd->block_size;
+    in_block = offset % vd->block_size;
+    *run = vd->block_size - in_block;
+    *host_offset = VDISK_ZERO;
+    
+    // the per-block sector bitmap is not consulted, without a parent disk
+    // unmarked sectors read as zeros and are zero-filled on allocation
+    if (block >= vd->table_entries || vd->table[block] == VHD_UNALLOCATED)
+        return 0;
+    *host_offset = vd->table[block] * 512 + vd->bitmap_size + in_block;
+    return 0;
+}
+
+static UINTN vhd_open(VIRTUAL_DISK *vd, UINT8 *footer, UINT64 footer_offset)
+{
+    UINTN   status;
+    UINT32  disk_type;
+    UINT8   *header;
+    
+    disk_type = get_be32(footer + 60);
+    vd->size  = get_be64(footer + 48);
+    
+    if (disk_type == VHD_TYPE_FIXED) {
+        if (vd->size > footer_offset) {
+            error("VHD image: file is shorter than the disk it describes");
+            return 1;
+        }
+        vd->map         = vhd_fixed_map;
+        vd->block_size  = 512;
+        vd->data_offset = 0;
+        return 0;
+    }
+    if (disk_type != VHD_TYPE_DYNAMIC) {
+        error("VHD image: differencing disks are not supported");
+        return 1;
+    }
+    
+    // dynamic disk header, found through the footer
+    header = AllocatePool(1024);
+    if (header == NULL) {
+        error("Out of memory");
+        return 1;
+    }
+    status = host_read(vd, get_be64(footer + 16), 1024, header);
+    if (status == 0 && CompareMem(header, "cxsparse", 8) != 0) {
+        error("VHD image: dynamic disk header not found");
+        status = 1;
+    }
+    if (status == 0) {
+        vd->block_size = get_be32(header + 32);
+        if (vd->block_size < 512 || (vd->block_size & (vd->block_size - 1)) != 0) {
+            error("VHD image: invalid block size");
+            status = 1;
+        }
+    }
+    if (status == 0) {
+        vd->map         = vhd_map;
+        vd->bitmap_size = (vd->block_size / 512 / 8 + 511) & ~511ULL;
+        status = load_table(vd, get_be64(header + 16), get_be32(header + 28), 4, TRUE);
+    }
+    FreePool(header);
+    return status;
+}
+
+//
+// VHDX (dynamic and fixed, no differencing disks, clean log only)
+//
+
+#define VHDX_HEADER_SIZE            (4096)
+#define VHDX_REGION_TABLE_SIZE      (65536)
+
+#define VHDX_BLOCK_NOT_PRESENT      (0)
+#define VHDX_BLOCK_FULLY_PRESENT    (6)
+#define VHDX_BLOCK_PARTIALLY_PRESENT (7)
+
+static UINT8 vhdx_bat_guid[16]           = { 0x66,0x77,0xC2,0x2D,0x23,0xF6,0x00,0x42,0x9D,0x64,0x11,0x5E,0x9B,0xFD,0x4A,0x08 };
+static UINT8 vhdx_metadata_guid[16]      = { 0x06,0xA2,0x7C,0x8B,0x90,0x47,0x9A,0x4B,0xB8,0xFE,0x57,0x5F,0x05,0x0F,0x88,0x6E };
+static UINT8 vhdx_file_params_guid[16]   = { 0x37,0x67,0xA1,0xCA,0x36,0xFA,0x43,0x4D,0xB3,0xB6,0x33,0xF0,0xAA,0x44,0xE7,0x6B };
+static UINT8 vhdx_disk_size_guid[16]     = { 0x24,0x42,0xA5,0x2F,0x1B,0xCD,0x76,0x48,0xB2,0x11,0x5D,0xBE,0xD8,0x3B,0xF4,0xB8 };
+static UINT8 vhdx_logical_sector_guid[16] = { 0x1D,0xBF,0x41,0x81,0x6F,0xA9,0x09,0x47,0xBA,0x47,0xF2,0x33,0xA8,0xFA,0xAB,0x5F };
+static UINT8 vhdx_physical_sector_guid[16] = { 0xC7,0x48,0xA3,0xCD,0x5D,0x44,0x71,0x44,0x9C,0xC9,0xE9,0x88,0x52,0x51,0xC5,0x56 };
+
+// CRC-32C (Castagnoli), used by the VHDX header and region table checksums
+static UINT32 crc32c(UINT8 *data, UINTN length)
+{
+    UINT32  crc = 0xffffffff;
+    UINTN   i, bit;
+    
+    for (i = 0; i < length; i++) {
+        crc ^= data[i];
+        for (bit = 0; bit < 8; bit++)
+            crc = (crc >> 1) ^ (0x82F63B78 & (0 - (crc & 1)));
+    }
+    return ~crc;
+}
+
+// checks the signature and the checksum stored at offset 4
+static BOOLEAN vhdx_valid(UINT8 *data, UINTN length, const char *signature)
+{
+    UINT32  checksum;
+    BOOLEAN valid;
+    
+    if (CompareMem(data, signature, 4) != 0)
+        return FALSE;
+    checksum = get_le32(data + 4);
+    ZeroMem(data + 4, 4);
+    valid = (crc32c(data, length) == checksum);
+    CopyMem(data + 4, &checksum, 4);
+    return valid;
+}
+
+static UINTN vhdx_map(VIRTUAL_DISK *vd, UINT64 offset, UINT64 *host_offset, UINT64 *run)
+{
+    UINT64  block, in_block, entry;
+    
+    block    = offset / vd->block_size;
+    in_block = offset % vd->block_size;
+    *run = vd->block_size - in_block;
+    *host_offset = VDISK_ZERO;
+    
+    // a sector bitmap entry follows every chunk_ratio payload entries
+    block += block / vd->chunk_ratio;
+    if (block >= vd->table_entries)
+        return 0;
+    entry = vd->table[block];
+    switch (entry & 7) {
+        case VHDX_BLOCK_FULLY_PRESENT:
+            *host_offset = (entry & ~0xfffffULL) + in_block;
+            return 0;
+        case VHDX_BLOCK_PARTIALLY_PRESENT:
+            error("VHDX image: partially present blocks need a parent disk");
+            return 1;
+        default:
+            // not present, undefined, zero or unmapped
+            return 0;
+    }
+}
+
+static UINTN vhdx_open(VIRTUAL_DISK *vd)
+{
+    UINTN   status, i, entry_count;
+    UINT8   *buffer, *entry, *header;
+    UINT8   headers[2][VHDX_HEADER_SIZE];
+    UINT8   item[8];
+    UINT64  sequence[2];
+    UINT64  bat_offset, bat_length, meta_offset, meta_length, item_offset;
+    UINT64  logical_sector_size, physical_sector_size;
+    UINT32  flags;
+    
+    buffer = AllocatePool(VHDX_REGION_TABLE_SIZE);
+    if (buffer == NULL) {
+        error("Out of memory");
+        return 1;
+    }
+    
+    // the valid header with the higher sequence number is the current one
+    header = NULL;
+    for (i = 0; i < 2; i++) {
+        sequence[i] = 0;
+        status = host_read(vd, 65536 * (i + 1), VHDX_HEADER_SIZE, headers[i]);
+        if (status != 0)
+            goto done;
+        if (vhdx_valid(headers[i], VHDX_HEADER_SIZE, "head")) {
+            sequence[i] = get_le64(headers[i] + 8);
+            if (header == NULL || sequence[i] > sequence[i ^ 1])
+                header = headers[i];
+        }
+    }
+    status = 1;
+    if (header == NULL) {
+        error("VHDX image: no valid header");
+        goto done;
+    }
+    for (i = 0; i < 16; i++)
+        if (header[48 + i] != 0)
+            break;
+    if (i < 16) {
+        error("VHDX image: the log must be replayed first (open the image once in its hypervisor)");
+        goto done;
+    }
+    
+    // region table, the second copy is only used when the first is damaged
+    for (i = 0; i < 2; i++) {
+        status = host_read(vd, 196608 + 65536 * i, VHDX_REGION_TABLE_SIZE, buffer);
+        if (status != 0)
+            goto done;
+        if (vhdx_valid(buffer, VHDX_REGION_TABLE_SIZE, "regi"))
+            break;
+    }
+    status = 1;
+    if (i == 2) {
+        error("VHDX image: no valid region table");
+        goto done;
+    }
+    bat_offset = bat_length = meta_offset = meta_length = 0;
+    entry_count = get_le32(buffer + 8);
+    if (entry_count > 2047)
+        entry_count = 2047;
+    for (i = 0, entry = buffer + 16; i < entry_count; i++, entry += 32) {
+        if (guids_are_equal(entry, vhdx_bat_guid)) {
+            bat_offset = get_le64(entry + 16);
+            bat_length = get_le32(entry + 24);
+        } else if (guids_are_equal(entry, vhdx_metadata_guid)) {
+            meta_offset = get_le64(entry + 16);
+            meta_length = get_le32(entry + 24);
+        } else if (get_le32(entry + 28) & 1) {
+            error("VHDX image: unknown required region");
+            goto done;
+        }
+    }
+    if (bat_offset == 0 || meta_offset == 0) {
+        error("VHDX image: BAT or metadata region missing");
+        goto done;
+    }
+    
+    // metadata table and the items we need
+    status = host_read(vd, meta_offset, VHDX_REGION_TABLE_SIZE, buffer);
+    if (status != 0)
+        goto done;
+    status = 1;
+    if (CompareMem(buffer, "metadata", 8) != 0) {
+        error("VHDX image: metadata table not found");
+        goto done;
+    }
+    vd->block_size = 0;
+    vd->size = 0;
+    flags = 0;
+    logical_sector_size = physical_sector_size = 512;
+    entry_count = get_le16(buffer + 10);
+    if (entry_count > 2047)
+        entry_count = 2047;
+    for (i = 0, entry = buffer + 32; i < entry_count; i++, entry += 32) {
+        if (!guids_are_equal(entry, vhdx_file_params_guid) &&
+            !guids_are_equal(entry, vhdx_disk_size_guid) &&
+            !guids_are_equal(entry, vhdx_logical_sector_guid) &&
+            !guids_are_equal(entry, vhdx_physical_sector_guid))
+            continue;
+        
+        // all items we need are at most 8 bytes long
+        item_offset = get_le32(entry + 16);
+        if (item_offset + 8 > meta_length) {
+            error("VHDX image: metadata item out of range");
+            goto done;
+        }
+        status = host_read(vd, meta_offset + item_offset, 8, item);
+        if (status != 0)
+            goto done;
+        status = 1;
+        
+        if (guids_are_equal(entry, vhdx_file_params_guid)) {
+            vd->block_size = get_le32(item);
+            flags = get_le32(item + 4);
+        } else if (guids_are_equal(entry, vhdx_disk_size_guid)) {
+            vd->size = get_le64(item);
+        } else if (guids_are_equal(entry, vhdx_logical_sector_guid)) {
+            logical_sector_size = get_le32(item);
+        } else {
+            physical_sector_size = get_le32(item);
+        }
+    }
+    if (flags & 2) {
+        error("VHDX image: differencing disks are not supported");
+        goto done;
+    }
+    if (vd->block_size < 1024 * 1024 || vd->block_size > 256 * 1024 * 1024 ||
+        (vd->block_size & (vd->block_size - 1)) != 0 ||
+        (logical_sector_size != 512 && logical_sector_size != 4096)) {
+        error("VHDX image: invalid file parameters");
+        goto done;
+    }
+    
+    vd->map                         = vhdx_map;
+    vd->chunk_ratio                 = (8388608ULL * logical_sector_size) / vd->block_size;
+    vd->disk.sector_size            = (UINTN)logical_sector_size;
+    vd->disk.physical_sector_size   = (UINTN)physical_sector_size;
+    status = load_table(vd, bat_offset, bat_length / 8, 8, FALSE);
+    
+done:
+    FreePool(buffer);
+    return status;
+}
+
+//
+// VMDK (monolithic sparse extents without compression)
+//
+
+#define VMDK_COMPRESSED         (1 << 16)
+#define VMDK_GD_AT_END          (0xffffffffffffffffULL)
+
+static UINTN vmdk_map(VIRTUAL_DISK *vd, UINT64 offset, UINT64 *host_offset, UINT64 *run)
+{
+    UINTN   status;
+    UINT64  grain, in_grain, gd_index, gt_index;
+    UINT32  entry;
+    
+    grain    = offset / vd->block_size;
+    in_grain = offset % vd->block_size;
+    *run = vd->block_size - in_grain;
+    *host_offset = VDISK_ZERO;
+    
+    gd_index = grain / vd->grain_table_entries;
+    gt_index = grain % vd->grain_table_entries;
+    if (gd_index >= vd->table_entries || vd->table[gd_index] == 0)
+        return 0;
+    
+    status = load_l2(vd, vd->table[gd_index] * 512);
+    if (status != 0)
+        return status;
+    entry = get_le32(vd->l2 + gt_index * 4);
+    if (entry <= 1)
+        return 0;   // unallocated (0) or zeroed grain (1)
+    *host_offset = (UINT64)entry * 512 + in_grain;
+    return 0;
+}
+
+static UINTN vmdk_open(VIRTUAL_DISK *vd, UINT8 *header)
+{
+    UINTN   status, i, length;
+    UINT64  grain_size, grains, gd_entries, descriptor_offset, descriptor_size;
+    UINT8   *descriptor;
+    
+    if (get_le32(header + 8) & VMDK_COMPRESSED) {
+        error("VMDK image: compressed (stream-optimized) extents are not supported");
+        return 1;
+    }
+    if (get_le64(header + 56) == VMDK_GD_AT_END) {
+        error("VMDK image: grain directory at end of file is not supported");
+        return 1;
+    }
+    
+    // an embedded descriptor tells whether this extent is the whole disk
+    descriptor_offset = get_le64(header + 28);
+    descriptor_size   = get_le64(header + 36);
+    if (descriptor_offset != 0 && descriptor_size != 0 && descriptor_size <= 2048) {
+        length = (UINTN)descriptor_size * 512;
+        descriptor = AllocatePool(length);
+        if (descriptor == NULL) {
+            error("Out of memory");
+            return 1;
+        }
+        status = host_read(vd, descriptor_offset * 512, length, descriptor);
+        if (status == 0) {
+            status = 1;
+            for (i = 0; i + 16 <= length; i++) {
+                if (CompareMem(descriptor + i, "monolithicSparse", 16) == 0) {
+                    status = 0;
+                    break;
+                }
+            }
+            if (status != 0)
+                error("VMDK image: only monolithic sparse images are supported");
+        }
+        FreePool(descriptor);
+        if (status != 0)
+            return status;
+    }
+    
+    grain_size = get_le64(header + 20);
+    vd->grain_table_entries = get_le32(header + 44);
+    if (grain_size < 1 || grain_size > 65536 || (grain_size & (grain_size - 1)) != 0 ||
+        vd->grain_table_entries < 1 || vd->grain_table_entries > 65536) {
+        error("VMDK image: invalid grain geometry");
+        return 1;
+    }
+    
+    vd->map        = vmdk_map;
+    vd->size       = get_le64(header + 12) * 512;
+    vd->block_size = grain_size * 512;
+    vd->l2_size    = (UINTN)vd->grain_table_entries * 4;
+    grains     = (vd->size + vd->block_size - 1) / vd->block_size;
+    gd_entries = (grains + vd->grain_table_entries - 1) / vd->grain_table_entries;
+    return load_table(vd, get_le64(header + 56) * 512, gd_entries, 4, FALSE);
+}
+
+//
+// generic part of the backend
+//
+
+static UINTN vdisk_read(DISK_DEVICE *disk, UINT64 lba, UINTN count, UINT8 *buffer)
+{
+    VIRTUAL_DISK *vd = disk->data;
+    UINTN   status;
+    UINT64  offset, length, host_offset, run;
+    
+    offset = lba * disk->sector_size;
+    length = (UINT64)count * disk->sector_size;
+    if (offset > vd->size || length > vd->size - offset) {
+        error("Data access beyond end of image at position %llu", offset);
+        return 1;
+    }
+    
+    while (length > 0) {
+        status = vd->map(vd, offset, &host_offset, &run);
+        if (status != 0)
+            return status;
+        if (run > length)
+            run = length;
+        if (host_offset == VDISK_ZERO)
+            ZeroMem(buffer, (UINTN)run);
+        else {
+            status = host_read(vd, host_offset, run, buffer);
+            if (status != 0)
+                return status;
+        }
+        offset += run;
+        length -= run;
+        buffer += run;
+    }
+    return 0;
+}
+
+// unallocated and zero blocks of the image are holes of the guest disk
+static UINTN vdisk_find_data(DISK_DEVICE *disk, UINT64 lba, UINT64 end_lba, UINT64 *data_lba, UINT64 *data_end)
+{
+    VIRTUAL_DISK *vd = disk->data;
+    UINTN   status;
+    UINT64  offset, end, host_offset, run;
+    
+    offset = lba * disk->sector_size;
+    end    = end_lba * disk->sector_size;
+    if (end > vd->size)
+        end = vd->size;
+    
+    // skip the holes, then extend over the allocated blocks after them
+    for (; offset < end; offset += run) {
+        status = vd->map(vd, offset, &host_offset, &run);
+        if (status != 0)
+            return status;
+        if (host_offset != VDISK_ZERO)
+            break;
+    }
+    if (offset >= end) {
+        *data_lba = end_lba;
+        *data_end = end_lba;
+        return 0;
+    }
+    *data_lba = offset / disk->sector_size;
+    for (; offset < end; offset += run) {
+        status = vd->map(vd, offset, &host_offset, &run);
+        if (status != 0)
+            return status;
+        if (host_offset == VDISK_ZERO)
+            break;
+    }
+    *data_end = (offset + disk->sector_size - 1) / disk->sector_size;
+    if (*data_end > end_lba)
+        *data_end = end_lba;
+    return 0;
+}
+
+static VOID vdisk_close(DISK_DEVICE *disk)
+{
+    VIRTUAL_DISK *vd = disk->data;
+    
+    // the container file belongs to the image
+    disk_close(vd->lower);
+    if (vd->table != NULL)
+        FreePool(vd->table);
+    if (vd->l2 != NULL)
+        free_io_buffer(vd->l2);
+    if (vd->bounce != NULL)
+        free_io_buffer(vd->bounce);
+    FreePool(vd);
+}
+
+static DISK_OPS vdisk_ops = {
+    STR("image"),
+    vdisk_read,
+    NULL,
+    NULL,
+    NULL,
+    vdisk_find_data,
+    vdisk_close,
+};
+
+// Checks the container file for a known image format. On success *image is
+// either NULL (a raw image, the caller keeps using lower) or a read-only
+// device for the guest disk that takes ownership of lower.
+UINTN disk_open_image(DISK_DEVICE *lower, UINTN sector_size, DISK_DEVICE **image)
+{
+    VIRTUAL_DISK *vd;
+    UINTN   status;
+    UINT8   *head, *tail;
+    UINT64  footer_offset;
+    
+    *image = NULL;
+    if (lower->block_count == 0)
+        return 0;
+    
+    vd = AllocatePool(sizeof(VIRTUAL_DISK));
+    if (vd == NULL) {
+        error("Out of memory");
+        return 1;
+    }
+    ZeroMem(vd, sizeof(VIRTUAL_DISK));
+    vd->lower     = lower;
+    vd->l2_offset = VDISK_ZERO;
+    vd->bounce    = alloc_io_buffer(lower->sector_size);
+    head = alloc_io_buffer(2 * lower->sector_size);
+    if (vd->bounce == NULL || head == NULL) {
+        error("Out of memory");
+        status = 1;
+        goto fail;
+    }
+    tail = head + lower->sector_size;
+    vd->disk.sector_size          = sector_size;
+    vd->disk.physical_sector_size = sector_size;
+    
+    // first and last sector carry the signatures
+    footer_offset = (lower->block_count - 1) * lower->sector_size;
+    status = disk_read(lower, 0, 1, head);
+    if (status == 0)
+        status = disk_read(lower, lower->block_count - 1, 1, tail);
+    if (status != 0)
+        goto fail;
+    
+    if (CompareMem(head, "QFI\xfb", 4) == 0)
+        status = qcow2_open(vd, head);
+    else if (CompareMem(head, "vhdxfile", 8) == 0)
+        status = vhdx_open(vd);
+    else if (CompareMem(head, "KDMV", 4) == 0)
+        status = vmdk_open(vd, head);
+    else if (CompareMem(head, "conectix", 8) == 0)
+        status = vhd_open(vd, head, footer_offset);
+    else if (CompareMem(tail, "conectix", 8) == 0)
+        status = vhd_open(vd, tail, footer_offset);
+    else {
+        // raw image
+        free_io_buffer(head);
+        free_io_buffer(vd->bounce);
+        FreePool(vd);
+        return 0;
+    }
+    if (status != 0)
+        goto fail;
+    
+    // allocate the second-level table cache now that its size is known
+    if (vd->l2_size > 0) {
+        vd->l2 = alloc_io_buffer(vd->l2_size);
+        if (vd->l2 == NULL) {
+            error("Out of memory");
+            status = 1;
+            goto fail;
+        }
+    }
+    free_io_buffer(head);
+    
+    vd->disk.ops             = &vdisk_ops;
+    vd->disk.data            = vd;
+    vd->disk.block_count     = vd->size / vd->disk.sector_size;
+    vd->disk.optimal_io_size = (vd->block_size <= 1024 * 1024) ? (UINTN)vd->block_size : 0;
+    vd->disk.rotational      = lower->rotational;
+    vd->disk.read_only       = TRUE;
+    *image = &vd->disk;
+    return 0;
+    
+fail:
+    if (head != NULL)
+        free_io_buffer(head);
+    if (vd->table != NULL)
+        FreePool(vd->table);
+    if (vd->bounce != NULL)
+        free_io_buffer(vd->bounce);
+    FreePool(vd);
+    return status;
+}
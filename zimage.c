@@ -0,0 +1,897 @@
+/*
+ * gptsync/zimage.c
+ * Read-only backend for compressed image files (gzip and zstd), Unix only
+ *
+ * Copyright (c) 2006-2007 Christoph Pfisterer
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are
+ * met:
+ *
+ *  * Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ *
+ *  * Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the
+ *    distribution.
+ *
+ *  * Neither the name of Christoph Pfisterer nor the names of the
+ *    contributors may be used to endorse or promote products derived
+ *    from this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+ * A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT
+ * OWNER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+ * SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT
+ * LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+ * DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+ * THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+ * OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include "gptsync.h"
+
+#include <stddef.h>
+
+#ifdef HAVE_ZLIB
+#include <zlib.h>
+#endif
+#ifdef HAVE_ZSTD
+#include <zstd.h>
+#endif
+
+#define ZFORMAT_GZIP        (1)
+#define ZFORMAT_ZSTD        (2)
+
+// gzip: distance between access points, each one costs a 32K window
+#define ZINDEX_SPAN         (4*1024*1024)
+#define GZIP_WINDOW         (32768)
+
+// decompressed data is produced and kept in pieces of this size
+#define ZSPAN_SIZE          (1024*1024)
+#define ZINPUT_SIZE         (65536)
+
+#define ZSTD_MAGIC          (0xFD2FB528)
+#define ZSTD_SKIP_MAGIC     (0x184D2A50)        // low 4 bits are free
+#define ZSTD_SEEKABLE_MAGIC (0x8F92EAB1)
+
+// indexes that need a full pass over the data are cached next to the image
+#define ZINDEX_SUFFIX       ".gptidx"
+#define ZINDEX_MAGIC        "GPTSZIX1"
+
+typedef struct {
+    UINT64  out_offset;                 // position in the uncompressed data
+    UINT64  in_offset;                  // position in the compressed file
+    UINT32  bits;                       // gzip: unused bits of the byte before in_offset
+    UINT32  window_size;                // gzip: size of the deflated window
+    UINT8   *window;                    // gzip: deflated 32K history
+} ZPOINT;
+
+typedef struct {
+    char    magic[8];
+    UINT32  format;
+    UINT32  reserved;
+    UINT64  file_size;
+    UINT64  file_mtime;
+    UINT64  size;
+    UINT64  point_count;
+} ZINDEX_HEADER;
+
+typedef struct {
+    DISK_DEVICE disk;
+    int         fd;
+    UINT64      file_size;
+    UINTN       format;
+    UINT64      size;                   // uncompressed size
+    
+    ZPOINT      *points;
+    UINTN       point_count, point_alloc;
+    
+    UINT8       *span;                  // most recently decompressed piece
+    UINT64      span_offset, span_length;
+    UINT8       *input;
+#ifdef HAVE_ZSTD
+    ZSTD_DCtx   *dctx;
+#endif
+} COMPRESSED_DISK;
+
+static UINT32 zget_le32(UINT8 *p)
+{
+    return (UINT32)p[0] | ((UINT32)p[1] << 8) | ((UINT32)p[2] << 16) | ((UINT32)p[3] << 24);
+}
+
+// reads compressed input, *got may fall short at the end of the file
+static UINTN zread_input(COMPRESSED_DISK *z, UINT64 offset, UINTN length, UINT8 *buffer, UINTN *got)
+{
+    ssize_t r;
+    
+    *got = 0;
+    while (*got < length) {
+        r = pread(z->fd, buffer + *got, length - *got, (off_t)(offset + *got));
+        if (r < 0 && errno == EINTR)
+            continue;
+        if (r < 0) {
+            errore("Compressed data read failed at position %llu", offset + *got);
+            return 1;
+        }
+        if (r == 0)
+            break;
+        *got += (UINTN)r;
+    }
+    return 0;
+}
+
+static UINTN zadd_point(COMPRESSED_DISK *z, UINT64 out_offset, UINT64 in_offset)
+{
+    ZPOINT  *points;
+    
+    if (z->point_count == z->point_alloc) {
+        z->point_alloc = z->point_alloc ? 2 * z->point_alloc : 64;
+        points = realloc(z->points, z->point_alloc * sizeof(ZPOINT));
+        if (points == NULL) {
+            error("Out of memory");
+            return 1;
+        }
+        z->points = points;
+    }
+    ZeroMem(&z->points[z->point_count], sizeof(ZPOINT));
+    z->points[z->point_count].out_offset = out_offset;
+    z->points[z->point_count].in_offset  = in_offset;
+    z->point_count++;
+    return 0;
+}
+
+//
+// gzip, indexed zran-style: access points at deflate block boundaries
+// together with the 32K of history needed to resume there
+//
+
+#ifdef HAVE_ZLIB
+
+static UINTN gzip_add_point(COMPRESSED_DISK *z, UINT64 out_offset, UINT64 in_offset,
+                            UINTN bits, UINTN left, UINT8 *window)
+{
+    ZPOINT  *point;
+    UINT8   history[GZIP_WINDOW];
+    uLongf  window_size;
+    
+    if (zadd_point(z, out_offset, in_offset) != 0)
+        return 1;
+    point = &z->points[z->point_count - 1];
+    point->bits = (UINT32)bits;
+    
+    // the window is circular, put the history in order and keep it deflated
+    if (left > 0)
+        CopyMem(history, window + GZIP_WINDOW - left, left);
+    if (left < GZIP_WINDOW)
+        CopyMem(history + left, window, GZIP_WINDOW - left);
+    window_size = compressBound(GZIP_WINDOW);
+    point->window = AllocatePool(window_size);
+    if (point->window == NULL || compress2(point->window, &window_size, history, GZIP_WINDOW, 1) != Z_OK) {
+        error("Out of memory");
+        return 1;
+    }
+    point->window_size = (UINT32)window_size;
+    return 0;
+}
+
+static UINTN gzip_build_index(COMPRESSED_DISK *z)
+{
+    z_stream    strm;
+    UINT8       *window;
+    UINT8       magic[2];
+    UINT64      in_pos, total_in, total_out, last;
+    UINTN       got, status;
+    BOOLEAN     member_start;
+    int         ret;
+    
+    window = AllocatePool(GZIP_WINDOW);
+    if (window == NULL) {
+        error("Out of memory");
+        return 1;
+    }
+    ZeroMem(window, GZIP_WINDOW);
+    ZeroMem(&strm, sizeof(strm));
+    if (inflateInit2(&strm, 47) != Z_OK) {     // gzip or zlib header
+        error("Out of memory");
+        FreePool(window);
+        return 1;
+    }
+    
+    in_pos = total_in = total_out = last = 0;
+    member_start = TRUE;
+    status = 0;
+    while (status == 0) {
+        if (strm.avail_in == 0) {
+            status = zread_input(z, in_pos, ZINPUT_SIZE, z->input, &got);
+            if (status != 0)
+                break;
+            if (got == 0) {
+                error("gzip image: unexpected end of compressed data");
+                status = 1;
+                break;
+            }
+            in_pos += got;
+            strm.next_in  = z->input;
+            strm.avail_in = got;
+        }
+        
+        // decompress one deflate block at a time, noting block boundaries
+        do {
+            if (strm.avail_out == 0) {
+                strm.next_out  = window;
+                strm.avail_out = GZIP_WINDOW;
+            }
+            total_in  += strm.avail_in;
+            total_out += strm.avail_out;
+            ret = inflate(&strm, Z_BLOCK);
+            total_in  -= strm.avail_in;
+            total_out -= strm.avail_out;
+            if (ret == Z_NEED_DICT || ret == Z_DATA_ERROR || ret == Z_MEM_ERROR) {
+                error("gzip image: invalid compressed data");
+                status = 1;
+                break;
+            }
+            if (ret == Z_STREAM_END)
+                break;
+            if ((strm.data_type & 128) && !(strm.data_type & 64) &&
+                (member_start || total_out - last >= ZINDEX_SPAN)) {
+                status = gzip_add_point(z, total_out, total_in, strm.data_type & 7, strm.avail_out, window);
+                last = total_out;
+                member_start = FALSE;
+            }
+        } while (strm.avail_in != 0 && status == 0);
+        
+        if (status != 0 || ret != Z_STREAM_END)
+            continue;
+        
+        // another gzip member may follow (e.g. pigz or concatenated files)
+        if (total_in >= z->file_size)
+            break;
+        status = zread_input(z, total_in, 2, magic, &got);
+        if (status != 0 || got < 2 || magic[0] != 0x1f || magic[1] != 0x8b)
+            break;
+        inflateReset(&strm);
+        member_start = TRUE;
+    }
+    
+    inflateEnd(&strm);
+    FreePool(window);
+    z->size = total_out;
+    return status;
+}
+
+// decompresses from an access point, dropping the first skip bytes
+static UINTN gzip_extract(COMPRESSED_DISK *z, ZPOINT *point, UINT64 skip,
+                          UINT8 *out, UINTN capacity, UINTN *written)
+{
+    z_stream    strm;
+    UINT8       history[GZIP_WINDOW];
+    UINT8       byte;
+    uLongf      history_size;
+    UINT64      in_pos;
+    UINTN       got, status, chunk;
+    int         ret;
+    
+    *written = 0;
+    history_size = GZIP_WINDOW;
+    if (uncompress(history, &history_size, point->window, point->window_size) != Z_OK) {
+        error("gzip image: damaged index");
+        return 1;
+    }
+    
+    ZeroMem(&strm, sizeof(strm));
+    if (inflateInit2(&strm, -15) != Z_OK) {    // raw deflate
+        error("Out of memory");
+        return 1;
+    }
+    in_pos = point->in_offset;
+    status = 0;
+    if (point->bits) {
+        in_pos--;
+        status = zread_input(z, in_pos, 1, &byte, &got);
+        if (status == 0 && got < 1) {
+            error("gzip image: unexpected end of compressed data");
+            status = 1;
+        }
+        in_pos++;
+        if (status == 0)
+            inflatePrime(&strm, point->bits, byte >> (8 - point->bits));
+    }
+    if (status == 0)
+        inflateSetDictionary(&strm, history, GZIP_WINDOW);
+    
+    ret = Z_OK;
+    while (status == 0 && *written < capacity && ret != Z_STREAM_END) {
+        if (strm.avail_in == 0) {
+            status = zread_input(z, in_pos, ZINPUT_SIZE, z->input, &got);
+            if (status != 0)
+                break;
+            if (got == 0) {
+                error("gzip image: unexpected end of compressed data");
+                status = 1;
+                break;
+            }
+            in_pos += got;
+            strm.next_in  = z->input;
+            strm.avail_in = got;
+        }
+        
+        // output before the wanted range lands in the output buffer too and
+        // is overwritten right away
+        if (skip > 0) {
+            chunk = (skip < capacity) ? (UINTN)skip : capacity;
+            strm.next_out  = out;
+            strm.avail_out = chunk;
+        } else {
+            chunk = capacity - *written;
+            strm.next_out  = out + *written;
+            strm.avail_out = chunk;
+        }
+        ret = inflate(&strm, Z_NO_FLUSH);
+        if (ret == Z_NEED_DICT || ret == Z_DATA_ERROR || ret == Z_MEM_ERROR) {
+            error("gzip image: invalid compressed data");
+            status = 1;
+            break;
+        }
+        if (skip > 0)
+            skip -= chunk - strm.avail_out;
+        else
+            *written += chunk - strm.avail_out;
+    }
+    
+    inflateEnd(&strm);
+    return status;
+}
+
+#endif
+
+//
+// zstd: every frame is an access point, taken from the seek table of the
+// seekable format or found by walking the frame headers
+//
+
+static UINTN zstd_read_seek_table(COMPRESSED_DISK *z, BOOLEAN *found)
+{
+    UINT8   footer[9], *table;
+    UINT64  frames, entry_size, table_size, in_offset, out_offset, i;
+    UINTN   got, status;
+    
+    *found = FALSE;
+    if (z->file_size < 17)
+        return 0;
+    status = zread_input(z, z->file_size - 9, 9, footer, &got);
+    if (status != 0 || got < 9 || zget_le32(footer + 5) != ZSTD_SEEKABLE_MAGIC)
+        return status;
+    
+    frames     = zget_le32(footer);
+    entry_size = (footer[4] & 0x80) ? 12 : 8;
+    table_size = frames * entry_size;
+    if (frames == 0 || table_size + 17 > z->file_size)
+        return 0;
+    table = AllocatePool((size_t)table_size + 8);
+    if (table == NULL) {
+        error("Out of memory");
+        return 1;
+    }
+    status = zread_input(z, z->file_size - 9 - table_size - 8, (UINTN)table_size + 8, table, &got);
+    if (status == 0 && ((zget_le32(table) & 0xfffffff0) != ZSTD_SKIP_MAGIC ||
+                        zget_le32(table + 4) != table_size + 9)) {
+        FreePool(table);
+        return 0;
+    }
+    
+    in_offset = out_offset = 0;
+    for (i = 0; i < frames && status == 0; i++) {
+        status = zadd_point(z, out_offset, in_offset);
+        in_offset  += zget_le32(table + 8 + i * entry_size);
+        out_offset += zget_le32(table + 8 + i * entry_size + 4);
+    }
+    FreePool(table);
+    z->size = out_offset;
+    *found = (status == 0);
+    return status;
+}
+
+#ifdef HAVE_ZSTD
+
+// decompresses the frame at in_offset, dropping the first skip bytes;
+// *total receives the number of bytes decoded up to where it stopped
+static UINTN zstd_extract(COMPRESSED_DISK *z, UINT64 in_offset, UINT64 skip,
+                          UINT8 *out, UINTN capacity, UINTN *written, UINT64 *total)
+{
+    ZSTD_inBuffer   in;
+    ZSTD_outBuffer  output;
+    UINTN           got, status;
+    size_t          ret;
+    
+    *written = 0;
+    *total   = 0;
+    ZSTD_DCtx_reset(z->dctx, ZSTD_reset_session_only);
+    
+    in.src  = z->input;
+    in.size = in.pos = 0;
+    ret = 1;
+    status = 0;
+    while (status == 0 && ret != 0 && (*written < capacity || capacity == 0)) {
+        if (in.pos == in.size) {
+            status = zread_input(z, in_offset, ZINPUT_SIZE, z->input, &got);
+            if (status != 0)
+                break;
+            if (got == 0) {
+                error("zstd image: unexpected end of compressed data");
+                status = 1;
+                break;
+            }
+            in_offset += got;
+            in.size = got;
+            in.pos  = 0;
+        }
+        
+        // skipped output goes to the span buffer and is overwritten later
+        if (skip > 0) {
+            output.dst  = z->span;
+            output.size = (skip < ZSPAN_SIZE) ? (size_t)skip : ZSPAN_SIZE;
+        } else {
+            output.dst  = out + *written;
+            output.size = capacity - *written;
+        }
+        output.pos = 0;
+        ret = ZSTD_decompressStream(z->dctx, &output, &in);
+        if (ZSTD_isError(ret)) {
+            error("zstd image: %s", ZSTD_getErrorName(ret));
+            status = 1;
+            break;
+        }
+        *total += output.pos;
+        if (skip > 0)
+            skip -= output.pos;
+        else
+            *written += output.pos;
+    }
+    return status;
+}
+
+#endif
+
+// parses a frame header: returns its size and the content size if stored
+static VOID zstd_frame_header(UINT8 *header, UINTN *header_size, UINT64 *content_size, BOOLEAN *checksum)
+{
+    static UINTN dict_id_sizes[4] = { 0, 1, 2, 4 };
+    static UINTN fcs_sizes[4]     = { 0, 2, 4, 8 };
+    UINTN   fhd, single_segment, fcs_size, pos, i;
+    
+    fhd            = header[4];
+    single_segment = (fhd >> 5) & 1;
+    *checksum      = (fhd >> 2) & 1;
+    fcs_size       = fcs_sizes[fhd >> 6];
+    if (fcs_size == 0 && single_segment)
+        fcs_size = 1;
+    
+    pos = 5 + (single_segment ? 0 : 1) + dict_id_sizes[fhd & 3];
+    *header_size = pos + fcs_size;
+    *content_size = (UINT64)-1;
+    if (fcs_size > 0) {
+        *content_size = 0;
+        for (i = 0; i < fcs_size; i++)
+            *content_size |= (UINT64)header[pos + i] << (8 * i);
+        if (fcs_size == 2)
+            *content_size += 256;
+    }
+}
+
+static UINTN zstd_scan_frames(COMPRESSED_DISK *z)
+{
+    UINT8   header[18];
+    UINT64  pos, block_pos, out_offset, content_size;
+    UINTN   got, status, header_size, block_header, block_type;
+    BOOLEAN checksum;
+    UINT32  magic;
+#ifdef HAVE_ZSTD
+    UINTN   written;
+#endif
+    
+    pos = out_offset = 0;
+    while (pos < z->file_size) {
+        status = zread_input(z, pos, sizeof(header), header, &got);
+        if (status != 0)
+            return status;
+        if (got < 8)
+            break;
+        magic = zget_le32(header);
+        if ((magic & 0xfffffff0) == ZSTD_SKIP_MAGIC) {
+            pos += 8 + (UINT64)zget_le32(header + 4);
+            continue;
+        }
+        if (magic != ZSTD_MAGIC) {
+            error("zstd image: unexpected data at position %llu", pos);
+            return 1;
+        }
+        zstd_frame_header(header, &header_size, &content_size, &checksum);
+        
+        // walk the block headers to find the end of the frame
+        block_pos = pos + header_size;
+        do {
+            status = zread_input(z, block_pos, 3, header, &got);
+            if (status != 0)
+                return status;
+            if (got < 3) {
+                error("zstd image: unexpected end of compressed data");
+                return 1;
+            }
+            block_header = header[0] | (header[1] << 8) | (header[2] << 16);
+            block_type   = (block_header >> 1) & 3;
+            if (block_type == 3) {
+                error("zstd image: invalid block at position %llu", block_pos);
+                return 1;
+            }
+            block_pos += 3 + ((block_type == 1) ? 1 : (block_header >> 3));
+        } while ((block_header & 1) == 0);
+        if (checksum)
+            block_pos += 4;
+        
+        if (content_size == (UINT64)-1) {
+#ifdef HAVE_ZSTD
+            // size not recorded in the header, count it
+            status = zstd_extract(z, pos, (UINT64)-1, NULL, 0, &written, &content_size);
+            if (status != 0)
+                return status;
+#else
+            return 1;
+#endif
+        }
+        
+        status = zadd_point(z, out_offset, pos);
+        if (status != 0)
+            return status;
+        out_offset += content_size;
+        pos = block_pos;
+    }
+    
+    z->size = out_offset;
+    if (z->point_count == 1 && z->size > ZSPAN_SIZE)
+        Print(L"Warning: the zstd image is a single frame, reads will decompress from its start\n");
+    return 0;
+}
+
+//
+// index cache
+//
+
+static char * zindex_path(char *filename)
+{
+    char    *path;
+    
+    path = AllocatePool(strlen(filename) + sizeof(ZINDEX_SUFFIX));
+    if (path != NULL) {
+        strcpy(path, filename);
+        strcat(path, ZINDEX_SUFFIX);
+    }
+    return path;
+}
+
+static BOOLEAN zindex_load(COMPRESSED_DISK *z, char *path, UINT64 mtime)
+{
+    FILE            *f;
+    ZINDEX_HEADER   header;
+    ZPOINT          *point;
+    UINT64          i;
+    BOOLEAN         ok;
+    
+    f = fopen(path, "rb");
+    if (f == NULL)
+        return FALSE;
+    ok = (fread(&header, sizeof(header), 1, f) == 1 &&
+          CompareMem(header.magic, ZINDEX_MAGIC, 8) == 0 &&
+          header.format == z->format && header.file_size == z->file_size &&
+          header.file_mtime == mtime && header.point_count > 0);
+    for (i = 0; ok && i < header.point_count; i++) {
+        if (zadd_point(z, 0, 0) != 0) {
+            ok = FALSE;
+            break;
+        }
+        point = &z->points[z->point_count - 1];
+        ok = (fread(point, offsetof(ZPOINT, window), 1, f) == 1 &&
+              point->window_size <= 2 * GZIP_WINDOW && point->bits < 8);
+        
+        // the lookups in zfill_span() rely on points in ascending order
+        // that lie within the data, starting with the very first byte
+        if (ok)
+            ok = (point->in_offset < z->file_size && (point->bits == 0 || point->in_offset > 0) &&
+                  ((i == 0) ? point->out_offset == 0 :
+                   (point->out_offset >= point[-1].out_offset && point->in_offset > point[-1].in_offset)));
+        if (ok && point->window_size > 0) {
+            point->window = AllocatePool(point->window_size);
+            ok = (point->window != NULL &&
+                  fread(point->window, point->window_size, 1, f) == 1);
+        }
+    }
+    fclose(f);
+    if (ok && z->points[z->point_count - 1].out_offset >= header.size)
+        ok = FALSE;
+    
+    if (!ok) {
+        // stale or damaged, start over
+        for (i = 0; i < z->point_count; i++)
+            if (z->points[i].window != NULL)
+                FreePool(z->points[i].window);
+        z->point_count = 0;
+        return FALSE;
+    }
+    z->size = header.size;
+    return TRUE;
+}
+
+static VOID zindex_save(COMPRESSED_DISK *z, char *path, UINT64 mtime)
+{
+    FILE            *f;
+    ZINDEX_HEADER   header;
+    char            *temp_path;
+    UINTN           i;
+    BOOLEAN         ok;
+    
+    temp_path = AllocatePool(strlen(path) + 5);
+    if (temp_path == NULL)
+        return;
+    strcpy(temp_path, path);
+    strcat(temp_path, ".tmp");
+    
+    // the cache is optional, a read-only directory is no error
+    f = fopen(temp_path, "wb");
+    if (f == NULL) {
+        FreePool(temp_path);
+        return;
+    }
+    ZeroMem(&header, sizeof(header));
+    CopyMem(header.magic, ZINDEX_MAGIC, 8);
+    header.format      = (UINT32)z->format;
+    header.file_size   = z->file_size;
+    header.file_mtime  = mtime;
+    header.size        = z->size;
+    header.point_count = z->point_count;
+    ok = (fwrite(&header, sizeof(header), 1, f) == 1);
+    for (i = 0; ok && i < z->point_count; i++) {
+        ok = (fwrite(&z->points[i], offsetof(ZPOINT, window), 1, f) == 1);
+        if (ok && z->points[i].window_size > 0)
+            ok = (fwrite(z->points[i].window, z->points[i].window_size, 1, f) == 1);
+    }
+    if (fclose(f) != 0)
+        ok = FALSE;
+    if (!ok || rename(temp_path, path) != 0)
+        unlink(temp_path);
+    FreePool(temp_path);
+}
+
+//
+// backend
+//
+
+// decompresses the piece of data containing offset into the span buffer
+static UINTN zfill_span(COMPRESSED_DISK *z, UINT64 offset)
+{
+    ZPOINT  *point;
+    UINTN   low, high, mid, capacity, written, status;
+    UINT64  start, limit;
+#ifdef HAVE_ZSTD
+    UINT64  total;
+#endif
+    
+    // last access point at or before offset
+    low = 0;
+    high = z->point_count;
+    while (high - low > 1) {
+        mid = (low + high) / 2;
+        if (z->points[mid].out_offset <= offset)
+            low = mid;
+        else
+            high = mid;
+    }
+    point = &z->points[low];
+    limit = (low + 1 < z->point_count) ? z->points[low + 1].out_offset : z->size;
+    start = point->out_offset + ((offset - point->out_offset) / ZSPAN_SIZE) * ZSPAN_SIZE;
+    capacity = (limit - start < ZSPAN_SIZE) ? (UINTN)(limit - start) : ZSPAN_SIZE;
+    if (capacity == 0) {
+        error("Compressed image index is damaged");
+        return 1;
+    }
+    
+    z->span_length = 0;
+    status  = 1;
+    written = 0;
+#ifdef HAVE_ZLIB
+    if (z->format == ZFORMAT_GZIP)
+        status = gzip_extract(z, point, start - point->out_offset, z->span, capacity, &written);
+#endif
+#ifdef HAVE_ZSTD
+    if (z->format == ZFORMAT_ZSTD)
+        status = zstd_extract(z, point->in_offset, start - point->out_offset, z->span, capacity, &written, &total);
+#endif
+    if (status != 0)
+        return status;
+    if (written <= offset - start) {
+        error("Compressed image ends early at position %llu", start + written);
+        return 1;
+    }
+    z->span_offset = start;
+    z->span_length = written;
+    return 0;
+}
+
+static UINTN zdisk_read(DISK_DEVICE *disk, UINT64 lba, UINTN count, UINT8 *buffer)
+{
+    COMPRESSED_DISK *z = disk->data;
+    UINT64  offset, length, chunk;
+    UINTN   status;
+    
+    offset = lba * disk->sector_size;
+    length = (UINT64)count * disk->sector_size;
+    if (offset > z->size || length > z->size - offset) {
+        error("Data access beyond end of image at position %llu", offset);
+        return 1;
+    }
+    
+    while (length > 0) {
+        if (offset < z->span_offset || offset >= z->span_offset + z->span_length) {
+            status = zfill_span(z, offset);
+            if (status != 0)
+                return status;
+        }
+        chunk = z->span_offset + z->span_length - offset;
+        if (chunk > length)
+            chunk = length;
+        CopyMem(buffer, z->span + (offset - z->span_offset), (size_t)chunk);
+        offset += chunk;
+        length -= chunk;
+        buffer += chunk;
+    }
+    return 0;
+}
+
+static VOID zdisk_close(DISK_DEVICE *disk)
+{
+    COMPRESSED_DISK *z = disk->data;
+    UINTN   i;
+    
+    for (i = 0; i < z->point_count; i++)
+        if (z->points[i].window != NULL)
+            FreePool(z->points[i].window);
+    if (z->points != NULL)
+        FreePool(z->points);
+    if (z->span != NULL)
+        free_io_buffer(z->span);
+    if (z->input != NULL)
+        FreePool(z->input);
+#ifdef HAVE_ZSTD
+    if (z->dctx != NULL)
+        ZSTD_freeDCtx(z->dctx);
+#endif
+    close(z->fd);
+    FreePool(z);
+}
+
+static DISK_OPS zdisk_ops = {
+    STR("compressed"),
+    zdisk_read,
+    NULL,
+    NULL,
+    NULL,
+    NULL,
+    zdisk_close,
+};
+
+// Checks for a gzip or zstd compressed image. On success *image is either
+// NULL (not compressed) or a read-only device for the uncompressed data.
+UINTN disk_open_compressed(char *filename, UINTN sector_size, DISK_DEVICE **image)
+{
+    COMPRESSED_DISK *z;
+    struct stat sb;
+    UINT8   magic[4];
+    UINTN   status, format;
+    BOOLEAN found;
+    char    *index_path;
+    int     fd;
+    
+    *image = NULL;
+    fd = open(filename, O_RDONLY);
+    if (fd < 0)
+        return 0;   // reported by the regular open
+    if (fstat(fd, &sb) != 0 || pread(fd, magic, 4, 0) != 4) {
+        close(fd);
+        return 0;
+    }
+    if (magic[0] == 0x1f && magic[1] == 0x8b)
+        format = ZFORMAT_GZIP;
+    else if (zget_le32(magic) == ZSTD_MAGIC || (zget_le32(magic) & 0xfffffff0) == ZSTD_SKIP_MAGIC)
+        format = ZFORMAT_ZSTD;
+    else {
+        close(fd);
+        return 0;
+    }
+    
+#ifndef HAVE_ZLIB
+    if (format == ZFORMAT_GZIP) {
+        error("%.300s: gzip compressed images are not supported by this build", filename);
+        close(fd);
+        return 1;
+    }
+#endif
+#ifndef HAVE_ZSTD
+    if (format == ZFORMAT_ZSTD) {
+        error("%.300s: zstd compressed images are not supported by this build", filename);
+        close(fd);
+        return 1;
+    }
+#endif
+    
+    z = AllocatePool(sizeof(COMPRESSED_DISK));
+    if (z == NULL) {
+        error("Out of memory");
+        close(fd);
+        return 1;
+    }
+    ZeroMem(z, sizeof(COMPRESSED_DISK));
+    z->fd        = fd;
+    z->file_size = sb.st_size;
+    z->format    = format;
+    z->span      = alloc_io_buffer(ZSPAN_SIZE);
+    z->input     = AllocatePool(ZINPUT_SIZE);
+    status       = 0;
+    z->disk.ops  = &zdisk_ops;
+    z->disk.data = z;
+#ifdef HAVE_ZSTD
+    if (format == ZFORMAT_ZSTD) {
+        z->dctx = ZSTD_createDCtx();
+        if (z->dctx == NULL)
+            status = 1;
+    }
+#endif
+    if (z->span == NULL || z->input == NULL || status != 0) {
+        error("Out of memory");
+        zdisk_close(&z->disk);
+        return 1;
+    }
+    
+    // find or build the index of access points
+    found = FALSE;
+    if (format == ZFORMAT_ZSTD)
+        status = zstd_read_seek_table(z, &found);
+    index_path = NULL;
+    if (status == 0 && !found) {
+        index_path = zindex_path(filename);
+        if (index_path != NULL)
+            found = zindex_load(z, index_path, sb.st_mtime);
+        if (!found) {
+#ifdef HAVE_ZLIB
+            if (format == ZFORMAT_GZIP)
+                status = gzip_build_index(z);
+#endif
+            if (format == ZFORMAT_ZSTD)
+                status = zstd_scan_frames(z);
+            if (status == 0 && index_path != NULL)
+                zindex_save(z, index_path, sb.st_mtime);
+        }
+        if (index_path != NULL)
+            FreePool(index_path);
+    }
+    if (status == 0 && z->point_count == 0) {
+        error("%.300s: compressed image holds no data", filename);
+        status = 1;
+    }
+    if (status != 0) {
+        zdisk_close(&z->disk);
+        return status;
+    }
+    
+    z->disk.sector_size          = sector_size;
+    z->disk.physical_sector_size = sector_size;
+    z->disk.block_count          = z->size / sector_size;
+    z->disk.rotational           = FALSE;
+    z->disk.read_only            = TRUE;
+    *image = &z->disk;
+    return 0;
+}